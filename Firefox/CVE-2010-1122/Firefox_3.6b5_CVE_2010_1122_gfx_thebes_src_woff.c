@@ -49,6 +49,28 @@
 # define free    PR_Free
 #endif
 
+/*
+ * The decoder inflates several tables at once when built with a thread
+ * library: NSPR in Gecko, or pthreads if WOFF_USE_PTHREADS is defined.
+ * Define WOFF_DECODE_THREADS as 1 to keep it single-threaded.
+ */
+#ifndef WOFF_DECODE_THREADS
+# if defined(WOFF_MOZILLA_CLIENT) || defined(WOFF_USE_PTHREADS)
+#  define WOFF_DECODE_THREADS 4
+# else
+#  define WOFF_DECODE_THREADS 1
+# endif
+#endif
+
+#if WOFF_DECODE_THREADS > 1
+# ifdef WOFF_MOZILLA_CLIENT
+#  include "prlock.h"
+#  include "prthread.h"
+# else
+#  include <pthread.h>
+# endif
+#endif
+
 /*
  * Just simple whole-file encoding and decoding functions; a more extensive
  * WOFF library could provide support for accessing individual tables from a
@@ -620,6 +642,278 @@ failure:
 /* * * * * * * * * * * * * * DECODING * * * * * * * * * * * * * * */
 /******************************************************************/
 
+/* bytes of table data checksummed at a time, while they are still in cache */
+#define DECODE_CHUNK_SIZE 0x8000
+
+/* total compressed size below which starting threads costs more than it
+   saves */
+#define PARALLEL_DECODE_MIN_SIZE 0x40000
+
+/* one table to be expanded into its place in the sfnt buffer */
+typedef struct {
+  const uint8_t * src;
+  uint8_t * dst;
+  uint32_t compLen;
+  uint32_t origLen;
+  uint32_t tag;
+  uint32_t checksum; /* as recorded in the WOFF directory */
+  uint32_t status;
+} decodeJob;
+
+typedef struct {
+  decodeJob * jobs;
+  uint16_t numJobs;
+  uint16_t nextJob;
+#if WOFF_DECODE_THREADS > 1
+# ifdef WOFF_MOZILLA_CLIENT
+  PRLock * lock;
+# else
+  pthread_mutex_t lock;
+# endif
+#endif
+} decodeQueue;
+
+static uint32_t
+sumLongs(const uint8_t * data, uint32_t length)
+{
+  /* data must be longword-aligned; any partial longword at the end is
+     ignored */
+  const uint32_t * csumPtr = (const uint32_t *) data;
+  const uint32_t * csumEnd = csumPtr + length / 4;
+  uint32_t csum = 0;
+  while (csumPtr < csumEnd) {
+    csum += READ32BE(*csumPtr);
+    csumPtr++;
+  }
+  return csum;
+}
+
+static void
+decodeTable(decodeJob * job)
+{
+  /* the table is expanded a chunk at a time, and each chunk added into the
+     checksum straight away; summed is the longword-aligned length done */
+  uint32_t summed = 0;
+  uint32_t csum = 0;
+
+  if (job->compLen < job->origLen) {
+    z_stream stream;
+    int zerr;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.next_in = (Bytef *) job->src;
+    stream.avail_in = job->compLen;
+    stream.next_out = (Bytef *) job->dst;
+    if (inflateInit(&stream) != Z_OK) {
+      job->status |= eWOFF_compression_failure;
+      return;
+    }
+    do {
+      uint32_t avail = job->origLen - (uint32_t) stream.total_out;
+      stream.avail_out = avail < DECODE_CHUNK_SIZE ? avail : DECODE_CHUNK_SIZE;
+      /* like uncompress(), a stream that wants more room than origLen
+         ends with Z_BUF_ERROR once avail_out stays at zero */
+      zerr = inflate(&stream, Z_NO_FLUSH);
+      csum += sumLongs(job->dst + summed,
+                       ((uint32_t) stream.total_out & ~3) - summed);
+      summed = (uint32_t) stream.total_out & ~3;
+    } while (zerr == Z_OK);
+    inflateEnd(&stream);
+    if (zerr != Z_STREAM_END || stream.total_out != job->origLen) {
+      job->status |= eWOFF_compression_failure;
+      return;
+    }
+  } else {
+    while (summed < (job->origLen & ~3)) {
+      uint32_t chunk = (job->origLen & ~3) - summed;
+      if (chunk > DECODE_CHUNK_SIZE) {
+        chunk = DECODE_CHUNK_SIZE;
+      }
+      memcpy(job->dst + summed, job->src + summed, chunk);
+      csum += sumLongs(job->dst + summed, chunk);
+      summed += chunk;
+    }
+    memcpy(job->dst + summed, job->src + summed, job->origLen - summed);
+  }
+
+  /* the final partial longword, if any, includes the zero padding that
+     was written before decoding started */
+  csum += sumLongs(job->dst + summed, LONGALIGN(job->origLen) - summed);
+
+  if (job->tag == TABLE_TAG_head || job->tag == TABLE_TAG_bhed) {
+    if (job->origLen < HEAD_TABLE_SIZE) {
+      /* reported by the caller */
+      return;
+    }
+    csum -= READ32BE(((const sfntHeadTable *) job->dst)->checkSumAdjustment);
+  }
+  if (csum != job->checksum) {
+    job->status |= eWOFF_warn_checksum_mismatch;
+  }
+}
+
+static decodeJob *
+takeJob(decodeQueue * queue)
+{
+  decodeJob * job = NULL;
+#if WOFF_DECODE_THREADS > 1
+# ifdef WOFF_MOZILLA_CLIENT
+  PR_Lock(queue->lock);
+# else
+  pthread_mutex_lock(&queue->lock);
+# endif
+#endif
+  if (queue->nextJob < queue->numJobs) {
+    job = &queue->jobs[queue->nextJob++];
+  }
+#if WOFF_DECODE_THREADS > 1
+# ifdef WOFF_MOZILLA_CLIENT
+  PR_Unlock(queue->lock);
+# else
+  pthread_mutex_unlock(&queue->lock);
+# endif
+#endif
+  return job;
+}
+
+static void
+runJobs(decodeQueue * queue)
+{
+  decodeJob * job;
+  while ((job = takeJob(queue)) != NULL) {
+    decodeTable(job);
+  }
+}
+
+#if WOFF_DECODE_THREADS > 1
+
+#ifdef WOFF_MOZILLA_CLIENT
+static void PR_CALLBACK
+decodeThreadMain(void * arg)
+{
+  runJobs((decodeQueue *) arg);
+}
+#else
+static void *
+decodeThreadMain(void * arg)
+{
+  runJobs((decodeQueue *) arg);
+  return NULL;
+}
+#endif
+
+static int
+compareCompLen(const void * lhs, const void * rhs)
+{
+  const decodeJob * a = (const decodeJob *) lhs;
+  const decodeJob * b = (const decodeJob *) rhs;
+  /* largest first, so that no thread is left with a big table at the end */
+  return a->compLen < b->compLen ? 1 :
+         a->compLen > b->compLen ? -1 :
+         0;
+}
+
+#endif /* WOFF_DECODE_THREADS > 1 */
+
+/* decodes all the tables, on several threads if they are big enough;
+   returns the combined status of the jobs */
+static uint32_t
+decodeTables(decodeJob * jobs, uint16_t numJobs)
+{
+  decodeQueue queue;
+  uint32_t status = eWOFF_ok;
+  uint16_t i;
+
+  queue.jobs = jobs;
+  queue.numJobs = numJobs;
+  queue.nextJob = 0;
+
+#if WOFF_DECODE_THREADS > 1
+  {
+#ifdef WOFF_MOZILLA_CLIENT
+    PRThread * threads[WOFF_DECODE_THREADS - 1];
+#else
+    pthread_t threads[WOFF_DECODE_THREADS - 1];
+#endif
+    uint32_t compTotal = 0;
+    int numThreads = 0;
+    int maxThreads = 0;
+
+    for (i = 0; i < numJobs; ++i) {
+      /* tables stored uncompressed are only copied; don't count them */
+      if (jobs[i].compLen < jobs[i].origLen) {
+        compTotal += jobs[i].compLen;
+      }
+    }
+    if (compTotal >= PARALLEL_DECODE_MIN_SIZE) {
+      maxThreads = numJobs - 1 < WOFF_DECODE_THREADS - 1 ?
+                   numJobs - 1 : WOFF_DECODE_THREADS - 1;
+    }
+
+    if (maxThreads > 0) {
+#ifdef WOFF_MOZILLA_CLIENT
+      queue.lock = PR_NewLock();
+      if (!queue.lock) {
+        maxThreads = 0;
+      }
+#else
+      if (pthread_mutex_init(&queue.lock, NULL) != 0) {
+        maxThreads = 0;
+      }
+#endif
+    }
+
+    if (maxThreads > 0) {
+      qsort(jobs, numJobs, sizeof(decodeJob), compareCompLen);
+      /* if a thread can't be started, the ones we have do its share */
+      while (numThreads < maxThreads) {
+#ifdef WOFF_MOZILLA_CLIENT
+        threads[numThreads] = PR_CreateThread(PR_USER_THREAD,
+                                              decodeThreadMain, &queue,
+                                              PR_PRIORITY_NORMAL,
+                                              PR_GLOBAL_THREAD,
+                                              PR_JOINABLE_THREAD, 0);
+        if (!threads[numThreads]) {
+          break;
+        }
+#else
+        if (pthread_create(&threads[numThreads], NULL,
+                           decodeThreadMain, &queue) != 0) {
+          break;
+        }
+#endif
+        ++numThreads;
+      }
+    }
+
+    runJobs(&queue);
+
+    if (maxThreads > 0) {
+      while (numThreads > 0) {
+        --numThreads;
+#ifdef WOFF_MOZILLA_CLIENT
+        PR_JoinThread(threads[numThreads]);
+#else
+        pthread_join(threads[numThreads], NULL);
+#endif
+      }
+#ifdef WOFF_MOZILLA_CLIENT
+      PR_DestroyLock(queue.lock);
+#else
+      pthread_mutex_destroy(&queue.lock);
+#endif
+    }
+  }
+#else
+  runJobs(&queue);
+#endif
+
+  for (i = 0; i < numJobs; ++i) {
+    status |= jobs[i].status;
+  }
+  return status;
+}
+
 static uint32_t
 sanityCheck(const uint8_t * woffData, uint32_t woffLen)
 {
@@ -714,6 +1008,7 @@ woffDecodeToBufferInternal(const uint8_t * woffData, uint32_t woffLen,
      (c) the sum of original sizes + header/directory matches totalSfntSize
      so we don't have to re-check those overflow conditions here */
   tableOrderRec * tableOrder = NULL;
+  decodeJob * jobs = NULL;
   const woffHeader * header;
   uint16_t numTables;
   uint16_t tableIndex;
@@ -781,11 +1076,19 @@ woffDecodeToBufferInternal(const uint8_t * woffData, uint32_t woffLen,
   }
   qsort(tableOrder, numTables, sizeof(tableOrderRec), compareOffsets);
 
-  /* process each table, filling in the sfnt directory */
+  jobs = (decodeJob *) malloc(numTables * sizeof(decodeJob));
+  if (!jobs) {
+    FAIL(eWOFF_out_of_memory);
+  }
+
+  /* lay out the tables, filling in the sfnt directory; every destination
+     is known before any table is decoded, so they can be decoded in any
+     order */
   offset = sizeof(sfntHeader) + numTables * sizeof(sfntDirEntry);
   sfntDir = (sfntDirEntry *) (sfntData + sizeof(sfntHeader));
   for (order = 0; order < numTables; ++order) {
     uint32_t origLen, compLen, tag, sourceOffset;
+    decodeJob * job = &jobs[order];
     tableIndex = tableOrder[order].oldIndex;
 
     /* validity of these was confirmed by sanityCheck */
@@ -799,17 +1102,6 @@ woffDecodeToBufferInternal(const uint8_t * woffData, uint32_t woffLen,
     sfntDir[tableIndex].checksum = woffDir[tableIndex].checksum;
     csum += READ32BE(sfntDir[tableIndex].checksum);
 
-    if (compLen < origLen) {
-      uLongf destLen = origLen;
-      if (uncompress((Bytef *)(sfntData + offset), &destLen,
-                     (const Bytef *)(woffData + sourceOffset),
-                     compLen) != Z_OK || destLen != origLen) {
-        FAIL(eWOFF_compression_failure);
-      }
-    } else {
-      memcpy(sfntData + offset, woffData + sourceOffset, origLen);
-    }
-
     /* note that old Mac bitmap-only fonts have no 'head' table
        (eg NISC18030.ttf) but a 'bhed' table instead */
     tag = READ32BE(sfntDir[tableIndex].tag);
@@ -818,6 +1110,14 @@ woffDecodeToBufferInternal(const uint8_t * woffData, uint32_t woffLen,
       headLength = origLen;
     }
 
+    job->src = woffData + sourceOffset;
+    job->dst = sfntData + offset;
+    job->compLen = compLen;
+    job->origLen = origLen;
+    job->tag = tag;
+    job->checksum = READ32BE(woffDir[tableIndex].checksum);
+    job->status = eWOFF_ok;
+
     offset += origLen;
 
     while (offset < totalLen && (offset & 3) != 0) {
@@ -825,6 +1125,11 @@ woffDecodeToBufferInternal(const uint8_t * woffData, uint32_t woffLen,
     }
   }
 
+  status |= decodeTables(jobs, numTables);
+  if (WOFF_FAILURE(status)) {
+    FAIL(status);
+  }
+
   if (headOffset > 0) {
     /* the font checksum in the 'head' table depends on all the individual
        table checksums (collected above), plus the header and directory
@@ -857,10 +1162,14 @@ woffDecodeToBufferInternal(const uint8_t * woffData, uint32_t woffLen,
   if (pStatus) {
     *pStatus |= status;
   }
+  free(jobs);
   free(tableOrder);
   return;
 
 failure:
+  if (jobs) {
+    free(jobs);
+  }
   if (tableOrder) {
     free(tableOrder);
   }
@@ -99,10 +99,58 @@ nsICODecoder::GetNumColors()
 }
 
 
+// Returns the larger of the two dimensions of a directory entry, where a
+// stored dimension of 0 means 256.
+static PRUint32
+DirEntrySize(const IconDirEntry& aEntry)
+{
+  PRUint32 width = aEntry.mWidth == 0 ? 256 : aEntry.mWidth;
+  PRUint32 height = aEntry.mHeight == 0 ? 256 : aEntry.mHeight;
+  return NS_MAX(width, height);
+}
+
+// Ranks how far an entry of aEntrySize is from the requested size: an exact
+// match ranks first, then entries larger than requested (downscaling looks
+// better than upscaling), nearest first, then smaller entries, largest first.
+static PRUint32
+DirEntrySizeRank(PRUint32 aEntrySize, PRUint32 aSize)
+{
+  if (aEntrySize >= aSize) {
+    return aEntrySize - aSize;
+  }
+  return 512 + (aSize - aEntrySize);
+}
+
+// Returns true if aCandidate is a better match than aBest for an icon of
+// aSize pixels at aBitCount bits per pixel.  Among entries of equal size the
+// deepest one not exceeding aBitCount wins; an aBitCount of 0 means "as deep
+// as possible".
+static bool
+IsBetterDirEntry(const IconDirEntry& aCandidate, const IconDirEntry& aBest,
+                 PRUint32 aSize, PRUint16 aBitCount)
+{
+  PRUint32 candidateRank = DirEntrySizeRank(DirEntrySize(aCandidate), aSize);
+  PRUint32 bestRank = DirEntrySizeRank(DirEntrySize(aBest), aSize);
+  if (candidateRank != bestRank) {
+    return candidateRank < bestRank;
+  }
+
+  bool candidateFits = !aBitCount || aCandidate.mBitCount <= aBitCount;
+  bool bestFits = !aBitCount || aBest.mBitCount <= aBitCount;
+  if (candidateFits != bestFits) {
+    return candidateFits;
+  }
+  return candidateFits ? aCandidate.mBitCount > aBest.mBitCount
+                       : aCandidate.mBitCount < aBest.mBitCount;
+}
+
 nsICODecoder::nsICODecoder(RasterImage &aImage, imgIDecoderObserver* aObserver)
  : Decoder(aImage, aObserver)
 {
   mPos = mImageOffset = mCurrIcon = mNumIcons = mBPP = mRowBytes = 0;
+  mPreferredSize = PREFICONSIZE;
+  mPreferredBitCount = 0;
+  mDirectoryOnly = false;
   mIsPNG = false;
   mRow = nsnull;
   mOldLine = mCurLine = 1; // Otherwise decoder will never start
@@ -115,6 +163,65 @@ nsICODecoder::~nsICODecoder()
   }
 }
 
+void
+nsICODecoder::SetPreferredEntry(PRUint32 aSize, PRUint16 aBitCount)
+{
+  NS_ABORT_IF_FALSE(mPos == 0, "Must choose the entry before decoding starts");
+  mPreferredSize = aSize ? aSize : PREFICONSIZE;
+  mPreferredBitCount = aBitCount;
+}
+
+void
+nsICODecoder::SetDirectoryOnly(bool aDirectoryOnly)
+{
+  NS_ABORT_IF_FALSE(mPos == 0, "Must choose the mode before decoding starts");
+  mDirectoryOnly = aDirectoryOnly;
+}
+
+// Scans a complete icon directory held in memory and picks the entry that
+// best matches aSize and aBitCount, without looking at any image data.
+// Callers with random access to the file can use this to read only the
+// directory and then seek straight to aEntry.mImageOffset.
+/* static */ bool
+nsICODecoder::FindBestDirEntry(const char* aBuffer, PRUint32 aCount,
+                               PRUint32 aSize, PRUint16 aBitCount,
+                               IconDirEntry& aEntry)
+{
+  if (aCount < DIRENTRYOFFSET) {
+    return false;
+  }
+  if (aBuffer[0] != 0 || aBuffer[1] != 0 ||
+      (aBuffer[2] != 1 && aBuffer[2] != 2) || aBuffer[3] != 0) {
+    return false;
+  }
+
+  PRUint16 numIcons;
+  memcpy(&numIcons, aBuffer + ICONCOUNTOFFSET, sizeof(numIcons));
+  numIcons = LITTLE_TO_NATIVE16(numIcons);
+  PRUint32 minImageOffset = DIRENTRYOFFSET + numIcons * ICODIRENTRYSIZE;
+  if (numIcons == 0 || aCount < minImageOffset) {
+    return false;
+  }
+
+  if (!aSize) {
+    aSize = PREFICONSIZE;
+  }
+
+  bool found = false;
+  for (PRUint16 i = 0; i < numIcons; i++) {
+    IconDirEntry e;
+    ReadDirEntry(aBuffer + DIRENTRYOFFSET + i * ICODIRENTRYSIZE, e);
+    if (e.mImageOffset < minImageOffset) {
+      continue;
+    }
+    if (!found || IsBetterDirEntry(e, aEntry, aSize, aBitCount)) {
+      memcpy(&aEntry, &e, sizeof(IconDirEntry));
+      found = true;
+    }
+  }
+  return found;
+}
+
 void
 nsICODecoder::FinishInternal()
 {
@@ -288,7 +395,6 @@ nsICODecoder::WriteInternal(const char* aBuffer, PRUint32 aCount)
   if (mNumIcons == 0)
     return; // Nothing to do.
 
-  PRUint16 colorDepth = 0;
   // Loop through each entry's dir entry
   while (mCurrIcon < mNumIcons) { 
     if (mPos >= DIRENTRYOFFSET + (mCurrIcon * sizeof(mDirEntryArray)) && 
@@ -309,30 +415,42 @@ nsICODecoder::WriteInternal(const char* aBuffer, PRUint32 aCount)
     IconDirEntry e;
     if (mPos == (DIRENTRYOFFSET + ICODIRENTRYSIZE) + 
                 (mCurrIcon * sizeof(mDirEntryArray))) {
-      mCurrIcon++;
       ProcessDirEntry(e);
-      // We can't use GetRealWidth and GetRealHeight here because those operate
-      // on mDirEntry, here we are going through each item in the directory
-      if (((e.mWidth == 0 ? 256 : e.mWidth) == PREFICONSIZE && 
-           (e.mHeight == 0 ? 256 : e.mHeight) == PREFICONSIZE && 
-           (e.mBitCount >= colorDepth)) ||
-          (mCurrIcon == mNumIcons && mImageOffset == 0)) {
-        mImageOffset = e.mImageOffset;
-
-        // ensure mImageOffset is >= size of the direntry headers (bug #245631)
-        PRUint32 minImageOffset = DIRENTRYOFFSET + 
-                                  mNumIcons * sizeof(mDirEntryArray);
-        if (mImageOffset < minImageOffset) {
+      // Only the directory is looked at while choosing, so every entry is
+      // considered before any image data is read. As in FindBestDirEntry,
+      // entries whose image would overlap the directory are passed over
+      // (bug #245631); mImageOffset stays 0 until one is chosen.
+      PRUint32 minImageOffset = DIRENTRYOFFSET + 
+                                mNumIcons * sizeof(mDirEntryArray);
+      if (e.mImageOffset >= minImageOffset &&
+          (mImageOffset == 0 ||
+           IsBetterDirEntry(e, mDirEntry, mPreferredSize, mPreferredBitCount))) {
+        memcpy(&mDirEntry, &e, sizeof(IconDirEntry));
+        mImageOffset = mDirEntry.mImageOffset;
+      }
+      mCurrIcon++;
+
+      if (mCurrIcon == mNumIcons) {
+        // No entry has its image past the directory.
+        if (mImageOffset == 0) {
           PostDataError();
           return;
         }
 
-        colorDepth = e.mBitCount;
-        memcpy(&mDirEntry, &e, sizeof(IconDirEntry));
+        // A directory-only size decode is answered from the chosen entry
+        // alone; none of the image data is ever looked at.
+        if (mDirectoryOnly && IsSizeDecode()) {
+          SetHotSpotIfCursor();
+          PostSize(GetRealWidth(), GetRealHeight());
+          return;
+        }
       }
     }
   }
 
+  if (mDirectoryOnly && IsSizeDecode())
+    return; // The size was posted from the directory.
+
   if (mPos < mImageOffset) {
     // Skip to (or at least towards) the desired image offset
     PRUint32 toSkip = mImageOffset - mPos;
@@ -594,19 +712,25 @@ nsICODecoder::WriteInternal(const char* aBuffer, PRUint32 aCount)
 
 void
 nsICODecoder::ProcessDirEntry(IconDirEntry& aTarget)
+{
+  ReadDirEntry(mDirEntryArray, aTarget);
+}
+
+/* static */ void
+nsICODecoder::ReadDirEntry(const char* aRaw, IconDirEntry& aTarget)
 {
   memset(&aTarget, 0, sizeof(aTarget));
-  memcpy(&aTarget.mWidth, mDirEntryArray, sizeof(aTarget.mWidth));
-  memcpy(&aTarget.mHeight, mDirEntryArray + 1, sizeof(aTarget.mHeight));
-  memcpy(&aTarget.mColorCount, mDirEntryArray + 2, sizeof(aTarget.mColorCount));
-  memcpy(&aTarget.mReserved, mDirEntryArray + 3, sizeof(aTarget.mReserved));
-  memcpy(&aTarget.mPlanes, mDirEntryArray + 4, sizeof(aTarget.mPlanes));
+  memcpy(&aTarget.mWidth, aRaw, sizeof(aTarget.mWidth));
+  memcpy(&aTarget.mHeight, aRaw + 1, sizeof(aTarget.mHeight));
+  memcpy(&aTarget.mColorCount, aRaw + 2, sizeof(aTarget.mColorCount));
+  memcpy(&aTarget.mReserved, aRaw + 3, sizeof(aTarget.mReserved));
+  memcpy(&aTarget.mPlanes, aRaw + 4, sizeof(aTarget.mPlanes));
   aTarget.mPlanes = LITTLE_TO_NATIVE16(aTarget.mPlanes);
-  memcpy(&aTarget.mBitCount, mDirEntryArray + 6, sizeof(aTarget.mBitCount));
+  memcpy(&aTarget.mBitCount, aRaw + 6, sizeof(aTarget.mBitCount));
   aTarget.mBitCount = LITTLE_TO_NATIVE16(aTarget.mBitCount);
-  memcpy(&aTarget.mBytesInRes, mDirEntryArray + 8, sizeof(aTarget.mBytesInRes));
+  memcpy(&aTarget.mBytesInRes, aRaw + 8, sizeof(aTarget.mBytesInRes));
   aTarget.mBytesInRes = LITTLE_TO_NATIVE32(aTarget.mBytesInRes);
-  memcpy(&aTarget.mImageOffset, mDirEntryArray + 12, 
+  memcpy(&aTarget.mImageOffset, aRaw + 12, 
          sizeof(aTarget.mImageOffset));
   aTarget.mImageOffset = LITTLE_TO_NATIVE32(aTarget.mImageOffset);
 }
@@ -4,6 +4,7 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "mozilla/Util.h"
+#include "mozilla/SSE.h"
 
 #include "nsSVGElement.h"
 #include "nsGkAtoms.h"
@@ -481,7 +482,24 @@ static PRUint32 ComputeScaledDivisor(PRUint32 aDivisor)
 {
   return PR_UINT32_MAX/(255*aDivisor);
 }
-  
+
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+namespace mozilla {
+namespace SSE2 {
+
+// Implemented in nsSVGFiltersSSE2.cpp. These always blur all four
+// channels, so they are only used when the color channels are wanted.
+void BoxBlur(const PRUint8 *aInput, PRUint8 *aOutput,
+             PRInt32 aStrideMinor, PRInt32 aStartMinor, PRInt32 aEndMinor,
+             PRInt32 aLeftLobe, PRInt32 aRightLobe, PRUint32 aScaledDivisor);
+void BoxBlur4(const PRUint8 *aInput, PRUint8 *aOutput,
+              PRInt32 aStrideMinor, PRInt32 aStartMinor, PRInt32 aEndMinor,
+              PRInt32 aLeftLobe, PRInt32 aRightLobe, PRUint32 aScaledDivisor);
+
+}
+}
+#endif
+
 static void
 BoxBlur(const PRUint8 *aInput, PRUint8 *aOutput,
         PRInt32 aStrideMinor, PRInt32 aStartMinor, PRInt32 aEndMinor,
@@ -491,6 +509,14 @@ BoxBlur(const PRUint8 *aInput, PRUint8 *aOutput,
   PRInt32 scaledDivisor = ComputeScaledDivisor(boxSize);
   PRInt32 sums[4] = {0, 0, 0, 0};
 
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+  if (!aAlphaOnly && mozilla::supports_sse2()) {
+    mozilla::SSE2::BoxBlur(aInput, aOutput, aStrideMinor, aStartMinor,
+                           aEndMinor, aLeftLobe, aRightLobe, scaledDivisor);
+    return;
+  }
+#endif
+
   for (PRInt32 i=0; i < boxSize; i++) {
     PRInt32 pos = aStartMinor - aLeftLobe + i;
     pos = NS_MAX(pos, aStartMinor);
@@ -647,7 +673,22 @@ nsSVGFEGaussianBlurElement::GaussianBlur(const Image *aSource,
   } else {
     PRInt32 longLobe = aDY/2;
     PRInt32 shortLobe = (aDY & 1) ? longLobe : longLobe - 1;
-    for (PRInt32 major = aDataRect.x; major < aDataRect.XMost(); ++major) {
+    PRInt32 major = aDataRect.x;
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+    // Blur four columns at a time, so that each step down the columns
+    // reads and writes one 16-byte run instead of four separate pixels.
+    if (!alphaOnly && mozilla::supports_sse2()) {
+      PRUint32 shortDivisor = ComputeScaledDivisor(longLobe + shortLobe + 1);
+      PRUint32 longDivisor = ComputeScaledDivisor(2*longLobe + 1);
+      for (; major + 4 <= aDataRect.XMost(); major += 4) {
+        PRInt32 ms = major*4;
+        mozilla::SSE2::BoxBlur4(tmp + ms, targetData + ms, stride, aDataRect.y, aDataRect.YMost(), longLobe, shortLobe, shortDivisor);
+        mozilla::SSE2::BoxBlur4(targetData + ms, tmp + ms, stride, aDataRect.y, aDataRect.YMost(), shortLobe, longLobe, shortDivisor);
+        mozilla::SSE2::BoxBlur4(tmp + ms, targetData + ms, stride, aDataRect.y, aDataRect.YMost(), longLobe, longLobe, longDivisor);
+      }
+    }
+#endif
+    for (; major < aDataRect.XMost(); ++major) {
       PRInt32 ms = major*4;
       BoxBlur(tmp + ms, targetData + ms, stride, aDataRect.y, aDataRect.YMost(), longLobe, shortLobe, alphaOnly);
       BoxBlur(targetData + ms, tmp + ms, stride, aDataRect.y, aDataRect.YMost(), shortLobe, longLobe, alphaOnly);
@@ -4243,6 +4284,83 @@ ConvolvePixel(const PRUint8 *aSourceData,
   }
 }
 
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+namespace mozilla {
+namespace SSE2 {
+
+// Implemented in nsSVGFiltersSSE2.cpp; both give the same bytes as
+// ConvolvePixel for the pixels they handle.
+void ConvolveInteriorRow(const PRUint8 *aSourceData, PRUint8 *aTargetData,
+                         PRInt32 aStride, PRInt32 aY, PRInt32 aX0, PRInt32 aX1,
+                         const float *aKernel, float aDivisor, float aBias,
+                         bool aPreserveAlpha,
+                         PRInt32 aOrderX, PRInt32 aOrderY,
+                         PRInt32 aTargetX, PRInt32 aTargetY);
+bool ConvolveSeparable(const PRUint8 *aSourceData, PRUint8 *aTargetData,
+                       PRInt32 aWidth, PRInt32 aHeight, PRInt32 aStride,
+                       const nsIntRect& aDataRect, PRUint16 aEdgeMode,
+                       const float *aRow, PRInt32 aOrderX,
+                       const float *aColumn, PRInt32 aOrderY,
+                       float aDivisor, float aBias, bool aPreserveAlpha,
+                       PRInt32 aTargetX, PRInt32 aTargetY);
+
+}
+}
+#endif
+
+/**
+ * Splits an integer kernel into aColumn x aRow if it has rank one. Both
+ * factors are integers and 255 times the sum of the kernel's absolute
+ * values is below 2^24, so convolving with the factors one after the other
+ * adds up exactly the same integers as convolving with the whole kernel,
+ * with no rounding on the way.
+ */
+static bool
+FactorIntegerKernel(const float *aKernel, PRInt32 aOrderX, PRInt32 aOrderY,
+                    float *aRow, float *aColumn)
+{
+  PRInt32 length = aOrderX * aOrderY;
+  PRInt32 pivot = -1;
+  float absSum = 0;
+  for (PRInt32 i = 0; i < length; i++) {
+    if (aKernel[i] != floor(aKernel[i]))
+      return false;
+    absSum += fabs(aKernel[i]);
+    if (pivot < 0 && aKernel[i] != 0)
+      pivot = i;
+  }
+  if (pivot < 0 || absSum * 255 >= (1 << 24))
+    return false;
+
+  // Divide the first nonzero row by the gcd of its entries; every other row
+  // of a rank one integer matrix is then an integer multiple of it.
+  const float *pivotRow = aKernel + (pivot / aOrderX) * aOrderX;
+  PRUint32 gcd = 0;
+  for (PRInt32 x = 0; x < aOrderX; x++) {
+    PRUint32 a = PRUint32(fabs(pivotRow[x]));
+    while (a) {
+      PRUint32 t = gcd % a;
+      gcd = a;
+      a = t;
+    }
+  }
+  for (PRInt32 x = 0; x < aOrderX; x++) {
+    aRow[x] = pivotRow[x] / gcd;
+  }
+
+  PRInt32 pivotX = pivot % aOrderX;
+  for (PRInt32 y = 0; y < aOrderY; y++) {
+    aColumn[y] = aKernel[y * aOrderX + pivotX] / aRow[pivotX];
+    if (aColumn[y] != floor(aColumn[y]))
+      return false;
+    for (PRInt32 x = 0; x < aOrderX; x++) {
+      if (aColumn[y] * aRow[x] != aKernel[y * aOrderX + x])
+        return false;
+    }
+  }
+  return true;
+}
+
 nsresult
 nsSVGFEConvolveMatrixElement::Filter(nsSVGFilterInstance *instance,
                                      const nsTArray<const Image*>& aSources,
@@ -4317,8 +4435,50 @@ nsSVGFEConvolveMatrixElement::Filter(nsSVGFilterInstance *instance,
   PRUint8 *sourceData = info.mSource->Data();
   PRUint8 *targetData = info.mTarget->Data();
 
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+  bool useSSE2 = mozilla::supports_sse2();
+  if (useSSE2 && orderX > 1 && orderY > 1) {
+    nsAutoArrayPtr<float> row(new float[orderX]);
+    nsAutoArrayPtr<float> column(new float[orderY]);
+    if (row && column &&
+        FactorIntegerKernel(kernel, orderX, orderY, row, column) &&
+        mozilla::SSE2::ConvolveSeparable(sourceData, targetData,
+                                         width, height, stride, dataRect,
+                                         edgeMode, row, orderX, column, orderY,
+                                         divisor, bias, preserveAlpha,
+                                         targetX, targetY)) {
+      FinishScalingFilter(&info);
+      return NS_OK;
+    }
+  }
+
+  // Pixels whose whole kernel lies inside the source need no edge handling.
+  PRInt32 interiorX0 = NS_MAX(dataRect.x, targetX);
+  PRInt32 interiorX1 = NS_MIN(dataRect.XMost(), width - orderX + targetX + 1);
+  PRInt32 interiorY0 = targetY;
+  PRInt32 interiorY1 = height - orderY + targetY + 1;
+#endif
+
   for (PRInt32 y = dataRect.y; y < dataRect.YMost(); y++) {
-    for (PRInt32 x = dataRect.x; x < dataRect.XMost(); x++) {
+    PRInt32 x = dataRect.x;
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+    if (useSSE2 && interiorX0 < interiorX1 &&
+        y >= interiorY0 && y < interiorY1) {
+      for (; x < interiorX0; x++) {
+        ConvolvePixel(sourceData, targetData,
+                      width, height, stride,
+                      x, y,
+                      edgeMode, kernel, divisor, bias, preserveAlpha,
+                      orderX, orderY, targetX, targetY);
+      }
+      mozilla::SSE2::ConvolveInteriorRow(sourceData, targetData, stride,
+                                         y, interiorX0, interiorX1,
+                                         kernel, divisor, bias, preserveAlpha,
+                                         orderX, orderY, targetX, targetY);
+      x = interiorX1;
+    }
+#endif
+    for (; x < dataRect.XMost(); x++) {
       ConvolvePixel(sourceData, targetData,
                     width, height, stride,
                     x, y,
@@ -0,0 +1,321 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// SSE2 versions of the SVG filter inner loops in nsSVGFilters.cpp. Every
+// function here produces exactly the same bytes as the scalar code it
+// replaces; see the comments at the call sites for why that holds.
+
+#include "nsIDOMSVGFilters.h"
+#include "nsAlgorithm.h"
+#include "nsAutoPtr.h"
+#include "nsRect.h"
+#include "gfxColor.h"
+
+#include <emmintrin.h>
+
+namespace mozilla {
+namespace SSE2 {
+
+static PRInt32
+BoundInterval(PRInt32 aVal, PRInt32 aMax)
+{
+  aVal = NS_MAX(aVal, 0);
+  return NS_MIN(aVal, aMax - 1);
+}
+
+static PRInt32
+WrapInterval(PRInt32 aVal, PRInt32 aMax)
+{
+  aVal = aVal % aMax;
+  return aVal < 0 ? aMax + aVal : aVal;
+}
+
+// Widens one 32-bit pixel to four 32-bit channels.
+static inline __m128i
+LoadPixel(const PRUint8* aPixel)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i px = _mm_cvtsi32_si128(*reinterpret_cast<const PRInt32*>(aPixel));
+  return _mm_unpacklo_epi16(_mm_unpacklo_epi8(px, zero), zero);
+}
+
+// Widens four adjacent 32-bit pixels to four vectors of four channels.
+static inline void
+LoadPixels(const PRUint8* aPixels, __m128i aOut[4])
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aPixels));
+  __m128i lo = _mm_unpacklo_epi8(px, zero);
+  __m128i hi = _mm_unpackhi_epi8(px, zero);
+  aOut[0] = _mm_unpacklo_epi16(lo, zero);
+  aOut[1] = _mm_unpackhi_epi16(lo, zero);
+  aOut[2] = _mm_unpacklo_epi16(hi, zero);
+  aOut[3] = _mm_unpackhi_epi16(hi, zero);
+}
+
+// The low 32 bits of each lane's product; SSE2 has no pmulld.
+static inline __m128i
+MulLo32(__m128i aA, __m128i aB)
+{
+  __m128i even = _mm_mul_epu32(aA, aB);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(aA, 32), _mm_srli_epi64(aB, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// (aSums * aScaledDivisor) >> 24 for each channel, as in the scalar OUTPUT
+// macro. Only the low byte of the result is stored, and those bits are the
+// same whether the shift is arithmetic or logical.
+static inline __m128i
+ScaleSums(__m128i aSums, __m128i aScaledDivisor)
+{
+  return _mm_srli_epi32(MulLo32(aSums, aScaledDivisor), 24);
+}
+
+static inline void
+StorePixel(PRUint8* aPixel, __m128i aChannels)
+{
+  __m128i packed = _mm_packs_epi32(aChannels, aChannels);
+  *reinterpret_cast<PRInt32*>(aPixel) =
+    _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+}
+
+static inline void
+StorePixels(PRUint8* aPixels, const __m128i aChannels[4])
+{
+  __m128i lo = _mm_packs_epi32(aChannels[0], aChannels[1]);
+  __m128i hi = _mm_packs_epi32(aChannels[2], aChannels[3]);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(aPixels),
+                   _mm_packus_epi16(lo, hi));
+}
+
+/**
+ * One running-sum box blur along a line of pixels, all four channels at
+ * once. The sliding window is written in its general form: after emitting
+ * pixel |minor| the window gains the clamped pixel at minor + aRightLobe + 1
+ * and loses the clamped pixel at minor - aLeftLobe, which is what both
+ * branches of the scalar BoxBlur compute.
+ */
+void
+BoxBlur(const PRUint8 *aInput, PRUint8 *aOutput,
+        PRInt32 aStrideMinor, PRInt32 aStartMinor, PRInt32 aEndMinor,
+        PRInt32 aLeftLobe, PRInt32 aRightLobe, PRUint32 aScaledDivisor)
+{
+  PRInt32 boxSize = aLeftLobe + aRightLobe + 1;
+  const __m128i scaledDivisor = _mm_set1_epi32(aScaledDivisor);
+  __m128i sums = _mm_setzero_si128();
+
+  for (PRInt32 i = 0; i < boxSize; i++) {
+    PRInt32 pos = aStartMinor - aLeftLobe + i;
+    pos = NS_MAX(pos, aStartMinor);
+    pos = NS_MIN(pos, aEndMinor - 1);
+    sums = _mm_add_epi32(sums, LoadPixel(aInput + aStrideMinor*pos));
+  }
+
+  aOutput += aStrideMinor*aStartMinor;
+  for (PRInt32 minor = aStartMinor; minor < aEndMinor; minor++) {
+    StorePixel(aOutput, ScaleSums(sums, scaledDivisor));
+    PRInt32 last = NS_MAX(minor - aLeftLobe, aStartMinor);
+    PRInt32 next = NS_MIN(minor + aRightLobe + 1, aEndMinor - 1);
+    sums = _mm_add_epi32(sums, LoadPixel(aInput + aStrideMinor*next));
+    sums = _mm_sub_epi32(sums, LoadPixel(aInput + aStrideMinor*last));
+    aOutput += aStrideMinor;
+  }
+}
+
+/**
+ * The same box blur on four adjacent lines at once: aInput and aOutput
+ * point at the first of four consecutive pixels, and each step along the
+ * minor axis moves all four by aStrideMinor. Used for the vertical passes,
+ * where it turns four strided column walks into one walk over 16-byte rows.
+ */
+void
+BoxBlur4(const PRUint8 *aInput, PRUint8 *aOutput,
+         PRInt32 aStrideMinor, PRInt32 aStartMinor, PRInt32 aEndMinor,
+         PRInt32 aLeftLobe, PRInt32 aRightLobe, PRUint32 aScaledDivisor)
+{
+  PRInt32 boxSize = aLeftLobe + aRightLobe + 1;
+  const __m128i scaledDivisor = _mm_set1_epi32(aScaledDivisor);
+  __m128i sums[4] = { _mm_setzero_si128(), _mm_setzero_si128(),
+                      _mm_setzero_si128(), _mm_setzero_si128() };
+  __m128i px[4];
+
+  for (PRInt32 i = 0; i < boxSize; i++) {
+    PRInt32 pos = aStartMinor - aLeftLobe + i;
+    pos = NS_MAX(pos, aStartMinor);
+    pos = NS_MIN(pos, aEndMinor - 1);
+    LoadPixels(aInput + aStrideMinor*pos, px);
+    for (int c = 0; c < 4; c++) {
+      sums[c] = _mm_add_epi32(sums[c], px[c]);
+    }
+  }
+
+  aOutput += aStrideMinor*aStartMinor;
+  for (PRInt32 minor = aStartMinor; minor < aEndMinor; minor++) {
+    __m128i out[4];
+    for (int c = 0; c < 4; c++) {
+      out[c] = ScaleSums(sums[c], scaledDivisor);
+    }
+    StorePixels(aOutput, out);
+
+    PRInt32 last = NS_MAX(minor - aLeftLobe, aStartMinor);
+    PRInt32 next = NS_MIN(minor + aRightLobe + 1, aEndMinor - 1);
+    LoadPixels(aInput + aStrideMinor*next, px);
+    for (int c = 0; c < 4; c++) {
+      sums[c] = _mm_add_epi32(sums[c], px[c]);
+    }
+    LoadPixels(aInput + aStrideMinor*last, px);
+    for (int c = 0; c < 4; c++) {
+      sums[c] = _mm_sub_epi32(sums[c], px[c]);
+    }
+    aOutput += aStrideMinor;
+  }
+}
+
+static inline __m128
+LoadPixelFloat(const PRUint8* aPixel)
+{
+  return _mm_cvtepi32_ps(LoadPixel(aPixel));
+}
+
+// Converts four channel sums to bytes exactly like ConvolvePixel:
+// BoundInterval(PRInt32(sum / divisor + bias), 256). cvttps truncates like
+// the cast, and the two saturating packs clamp to [0, 255].
+static inline void
+StoreConvolvedPixel(PRUint8* aTarget, __m128 aSum, __m128 aDivisor,
+                    __m128 aBias, bool aPreserveAlpha, const PRUint8* aSource)
+{
+  __m128i value = _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(aSum, aDivisor), aBias));
+  PRUint8 alpha = aSource[GFX_ARGB32_OFFSET_A];
+  StorePixel(aTarget, value);
+  if (aPreserveAlpha) {
+    aTarget[GFX_ARGB32_OFFSET_A] = alpha;
+  }
+}
+
+/**
+ * Convolves the pixels [aX0, aX1) of row aY, all of whose kernel samples lie
+ * inside the source, so no edge mode applies. Each channel is a lane, and
+ * each lane accumulates the products in the same order as ConvolvePixel, so
+ * the float results are identical.
+ */
+void
+ConvolveInteriorRow(const PRUint8 *aSourceData, PRUint8 *aTargetData,
+                    PRInt32 aStride, PRInt32 aY, PRInt32 aX0, PRInt32 aX1,
+                    const float *aKernel, float aDivisor, float aBias,
+                    bool aPreserveAlpha,
+                    PRInt32 aOrderX, PRInt32 aOrderY,
+                    PRInt32 aTargetX, PRInt32 aTargetY)
+{
+  const __m128 divisor = _mm_set1_ps(aDivisor);
+  const __m128 bias = _mm_set1_ps(aBias * 255);
+
+  for (PRInt32 x = aX0; x < aX1; x++) {
+    __m128 sum = _mm_setzero_ps();
+    const PRUint8* row =
+      aSourceData + (aY - aTargetY) * aStride + 4 * (x - aTargetX);
+    const float* k = aKernel;
+    for (PRInt32 y = 0; y < aOrderY; y++, row += aStride, k += aOrderX) {
+      for (PRInt32 i = 0; i < aOrderX; i++) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(LoadPixelFloat(row + 4 * i),
+                                         _mm_set1_ps(k[i])));
+      }
+    }
+    StoreConvolvedPixel(aTargetData + aY * aStride + 4 * x, sum, divisor, bias,
+                        aPreserveAlpha, aSourceData + aY * aStride + 4 * x);
+  }
+}
+
+// Maps a sample coordinate that may lie outside [0, aMax) according to the
+// edge mode. Returns -1 if the sample contributes nothing.
+static inline PRInt32
+MapEdge(PRInt32 aVal, PRInt32 aMax, PRUint16 aEdgeMode)
+{
+  if (aVal >= 0 && aVal < aMax) {
+    return aVal;
+  }
+  switch (aEdgeMode) {
+    case nsIDOMSVGFEConvolveMatrixElement::SVG_EDGEMODE_DUPLICATE:
+      return BoundInterval(aVal, aMax);
+    case nsIDOMSVGFEConvolveMatrixElement::SVG_EDGEMODE_WRAP:
+      return WrapInterval(aVal, aMax);
+    default:
+      return -1;
+  }
+}
+
+/**
+ * Convolution with a kernel that is the outer product aColumn x aRow, as a
+ * horizontal pass over every source row followed by a vertical pass. The
+ * caller guarantees that both factors are integers and that 255 times the
+ * sum of the kernel's absolute values stays below 2^24, so every partial sum
+ * here and in ConvolvePixel is an exactly representable integer and the
+ * result does not depend on the order of the additions.
+ */
+bool
+ConvolveSeparable(const PRUint8 *aSourceData, PRUint8 *aTargetData,
+                  PRInt32 aWidth, PRInt32 aHeight, PRInt32 aStride,
+                  const nsIntRect& aDataRect, PRUint16 aEdgeMode,
+                  const float *aRow, PRInt32 aOrderX,
+                  const float *aColumn, PRInt32 aOrderY,
+                  float aDivisor, float aBias, bool aPreserveAlpha,
+                  PRInt32 aTargetX, PRInt32 aTargetY)
+{
+  // Only the source rows the vertical pass can sample need a horizontal
+  // pass; wrapping past an edge can reach any row.
+  PRInt32 firstRow = aDataRect.y - aTargetY;
+  PRInt32 lastRow = aDataRect.YMost() - 1 - aTargetY + aOrderY - 1;
+  if (aEdgeMode == nsIDOMSVGFEConvolveMatrixElement::SVG_EDGEMODE_WRAP &&
+      (firstRow < 0 || lastRow >= aHeight)) {
+    firstRow = 0;
+    lastRow = aHeight - 1;
+  } else {
+    firstRow = BoundInterval(firstRow, aHeight);
+    lastRow = BoundInterval(lastRow, aHeight);
+  }
+
+  PRInt32 columns = aDataRect.width;
+  nsAutoArrayPtr<float> rows(new float[aHeight * columns * 4]);
+  if (!rows)
+    return false;
+
+  for (PRInt32 y = firstRow; y <= lastRow; y++) {
+    const PRUint8* source = aSourceData + y * aStride;
+    float* out = rows + y * columns * 4;
+    for (PRInt32 x = aDataRect.x; x < aDataRect.XMost(); x++, out += 4) {
+      __m128 sum = _mm_setzero_ps();
+      for (PRInt32 i = 0; i < aOrderX; i++) {
+        PRInt32 sampleX = MapEdge(x + i - aTargetX, aWidth, aEdgeMode);
+        if (sampleX >= 0) {
+          sum = _mm_add_ps(sum, _mm_mul_ps(LoadPixelFloat(source + 4 * sampleX),
+                                           _mm_set1_ps(aRow[i])));
+        }
+      }
+      _mm_storeu_ps(out, sum);
+    }
+  }
+
+  const __m128 divisor = _mm_set1_ps(aDivisor);
+  const __m128 bias = _mm_set1_ps(aBias * 255);
+  for (PRInt32 y = aDataRect.y; y < aDataRect.YMost(); y++) {
+    for (PRInt32 x = 0; x < columns; x++) {
+      __m128 sum = _mm_setzero_ps();
+      for (PRInt32 j = 0; j < aOrderY; j++) {
+        PRInt32 sampleY = MapEdge(y + j - aTargetY, aHeight, aEdgeMode);
+        if (sampleY >= 0) {
+          sum = _mm_add_ps(sum,
+                           _mm_mul_ps(_mm_loadu_ps(rows + (sampleY * columns + x) * 4),
+                                      _mm_set1_ps(aColumn[j])));
+        }
+      }
+      PRInt32 offset = y * aStride + 4 * (aDataRect.x + x);
+      StoreConvolvedPixel(aTargetData + offset, sum, divisor, bias,
+                          aPreserveAlpha, aSourceData + offset);
+    }
+  }
+  return true;
+}
+
+} // namespace SSE2
+} // namespace mozilla
@@ -21,6 +21,13 @@
 
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define JS_STRING_MATCH_SSE2
+# include <emmintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+# endif
+#endif
 #include "jstypes.h"
 #include "jsutil.h"
 #include "jshash.h"
@@ -940,6 +947,125 @@ UnrolledMatch(const jschar *text, uint32_t textlen, const jschar *pat, uint32_t
     return -1;
 }
 
+#ifdef JS_STRING_MATCH_SSE2
+
+/* Each character of a 128-bit compare sets two bits of its movemask. */
+
+static JS_ALWAYS_INLINE unsigned
+LowestMaskChar(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanForward(&bit, mask);
+    return bit / 2;
+#else
+    return __builtin_ctz(mask) / 2;
+#endif
+}
+
+static JS_ALWAYS_INLINE unsigned
+HighestMaskChar(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanReverse(&bit, mask);
+    return bit / 2;
+#else
+    return (31 - __builtin_clz(mask)) / 2;
+#endif
+}
+
+static JS_ALWAYS_INLINE uint32_t
+MatchMask(const jschar *t, __m128i c)
+{
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(t));
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(v, c));
+}
+
+/* Return the index of the first c in text, or -1. */
+static int
+CharMatchSSE2(const jschar *text, uint32_t textlen, jschar c)
+{
+    const __m128i needle = _mm_set1_epi16(c);
+    uint32_t i = 0;
+    for (; textlen - i >= 8; i += 8) {
+        if (uint32_t mask = MatchMask(text + i, needle))
+            return i + LowestMaskChar(mask);
+    }
+    for (; i < textlen; i++) {
+        if (text[i] == c)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Eight candidate positions at a time, keep those where both the first and
+ * the last pattern character match, and only compare the rest of the pattern
+ * there. Checking the last character as well weeds out most of the false
+ * positives a first-character scan stops at, e.g. on the spaces and tag
+ * brackets that usually start short patterns. patlen must be at least 2.
+ */
+template <class InnerMatch>
+static int
+FirstLastMatchSSE2(const jschar *text, uint32_t textlen, const jschar *pat, uint32_t patlen)
+{
+    JS_ASSERT(patlen >= 2 && textlen >= patlen);
+    const __m128i first = _mm_set1_epi16(pat[0]);
+    const __m128i last = _mm_set1_epi16(pat[patlen - 1]);
+    const jschar *const patNext = pat + 1;
+    const typename InnerMatch::Extent extent = InnerMatch::computeExtent(pat, patlen);
+    const uint32_t starts = textlen - patlen + 1;
+
+    uint32_t i = 0;
+    for (; starts - i >= 8; i += 8) {
+        uint32_t mask = MatchMask(text + i, first) & MatchMask(text + i + patlen - 1, last);
+        while (mask) {
+            unsigned k = LowestMaskChar(mask);
+            if (InnerMatch::match(patNext, text + i + k + 1, extent))
+                return i + k;
+            mask &= ~(3U << (2 * k));
+        }
+    }
+    for (; i < starts; i++) {
+        if (text[i] == pat[0] && text[i + patlen - 1] == pat[patlen - 1] &&
+            InnerMatch::match(patNext, text + i + 1, extent)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* As above, but return the last match starting at or before text + start. */
+static int
+FirstLastMatchLastSSE2(const jschar *text, uint32_t start, const jschar *pat, uint32_t patlen)
+{
+    const __m128i first = _mm_set1_epi16(pat[0]);
+    const __m128i last = _mm_set1_epi16(pat[patlen - 1]);
+    const jschar *const patNext = pat + 1;
+    const jschar *const patEnd = pat + patlen;
+
+    /* Candidates are 0 .. start, checked in blocks of eight from the end. */
+    uint32_t end = start + 1;
+    for (; end >= 8; end -= 8) {
+        const jschar *t = text + end - 8;
+        uint32_t mask = MatchMask(t, first) & MatchMask(t + patlen - 1, last);
+        while (mask) {
+            unsigned k = HighestMaskChar(mask);
+            if (ManualCmp::match(patNext, t + k + 1, patEnd))
+                return end - 8 + k;
+            mask &= ~(3U << (2 * k));
+        }
+    }
+    while (end-- > 0) {
+        if (text[end] == pat[0] && ManualCmp::match(patNext, text + end + 1, patEnd))
+            return end;
+    }
+    return -1;
+}
+
+#endif /* JS_STRING_MATCH_SSE2 */
+
 static JS_ALWAYS_INLINE int
 StringMatch(const jschar *text, uint32_t textlen,
             const jschar *pat, uint32_t patlen)
@@ -949,6 +1075,22 @@ StringMatch(const jschar *text, uint32_t textlen,
     if (textlen < patlen)
         return -1;
 
+#ifdef JS_STRING_MATCH_SSE2
+    /*
+     * The first/last filter needs no per-pattern tables, so unlike BMH it
+     * pays off on short texts too, and it keeps up with BMH on the long
+     * patterns BMH is used for below.
+     */
+    if (patlen == 1)
+        return CharMatchSSE2(text, textlen, *pat);
+    return
+#if !defined(__linux__)
+           patlen > 128 ? FirstLastMatchSSE2<MemCmp>(text, textlen, pat, patlen)
+                        :
+#endif
+                          FirstLastMatchSSE2<ManualCmp>(text, textlen, pat, patlen);
+#else
+
 #if defined(__i386__) || defined(_M_IX86) || defined(__i386)
     /*
      * Given enough registers, the unrolled loop below is faster than the
@@ -995,6 +1137,7 @@ StringMatch(const jschar *text, uint32_t textlen,
                         :
 #endif
                           UnrolledMatch<ManualCmp>(text, textlen, pat, patlen);
+#endif /* JS_STRING_MATCH_SSE2 */
 }
 
 static const size_t sRopeMatchThresholdRatioLog2 = 5;
@@ -1214,6 +1357,10 @@ str_lastIndexOf(JSContext *cx, unsigned argc, Value *vp)
         return true;
     }
 
+#ifdef JS_STRING_MATCH_SSE2
+    args.rval() = Int32Value(FirstLastMatchLastSSE2(text, i, pat, patlen));
+    return true;
+#else
     const jschar *t = text + i;
     const jschar *textend = text - 1;
     const jschar p0 = *pat;
@@ -1235,6 +1382,7 @@ str_lastIndexOf(JSContext *cx, unsigned argc, Value *vp)
 
     args.rval() = Int32Value(-1);
     return true;
+#endif /* JS_STRING_MATCH_SSE2 */
 }
 
 static JSBool
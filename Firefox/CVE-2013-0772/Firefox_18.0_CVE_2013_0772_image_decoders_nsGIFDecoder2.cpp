@@ -397,7 +397,14 @@ uint32_t nsGIFDecoder2::OutputRow()
 }
 
 //******************************************************************************
-/* Perform Lempel-Ziv-Welch decoding */
+/* Perform Lempel-Ziv-Welch decoding
+ *
+ * Every dictionary entry records the first byte and the length of the string
+ * it expands to, so a code can be written straight into the scanline from its
+ * last byte backwards instead of being pushed onto a stack and reversed.
+ * Strings that straddle a row boundary are expanded once into the stack and
+ * copied forward row by row.
+ */
 bool
 nsGIFDecoder2::DoLzw(const uint8_t *q)
 {
@@ -416,10 +423,11 @@ nsGIFDecoder2::DoLzw(const uint8_t *q)
   int oldcode     = mGIFStruct.oldcode;
   const int clear_code = ClearCode();
   uint8_t firstchar = mGIFStruct.firstchar;
-  int32_t datum     = mGIFStruct.datum;
+  uint32_t datum    = (uint32_t) mGIFStruct.datum;
   uint16_t *prefix  = mGIFStruct.prefix;
-  uint8_t *stackp   = mGIFStruct.stackp;
   uint8_t *suffix   = mGIFStruct.suffix;
+  uint8_t *first    = mGIFStruct.first;
+  uint16_t *length  = mGIFStruct.length;
   uint8_t *stack    = mGIFStruct.stack;
   uint8_t *rowp     = mGIFStruct.rowp;
 
@@ -436,14 +444,23 @@ nsGIFDecoder2::DoLzw(const uint8_t *q)
     rowend = rowp + mGIFStruct.width;                       \
   PR_END_MACRO
 
-  for (const uint8_t* ch = q; count-- > 0; ch++)
+  const uint8_t *ch = q;
+  for (;;)
   {
-    /* Feed the next byte into the decoder's 32-bit input buffer. */
-    datum += ((int32) *ch) << bits;
-    bits += 8;
+    /* Top up the decoder's 32-bit input buffer with as many whole bytes as
+     * will fit.  Codes are at most 12 bits wide, so every refill yields at
+     * least one code, and narrower codes are drained several at a time.
+     */
+    while (bits <= 24 && count > 0) {
+      datum |= ((uint32_t) *ch++) << bits;
+      bits += 8;
+      count--;
+    }
 
-    /* Check for underflow of decoder's 32-bit input buffer. */
-    while (bits >= codesize)
+    if (bits < codesize)
+      break;
+
+    do
     {
       /* Get the leading variable-length symbol from the data stream */
       int code = datum & codemask;
@@ -476,33 +493,32 @@ nsGIFDecoder2::DoLzw(const uint8_t *q)
         continue;
       }
 
+      /* A code that is not yet in the dictionary (KwKwK) expands to the
+       * previous string followed by that string's own first byte.
+       */
       int incode = code;
+      int extra = 0;
       if (code >= avail) {
-        *stackp++ = firstchar;
         code = oldcode;
-
-        if (stackp >= stack + MAX_BITS)
-          return false;
+        extra = 1;
       }
 
-      while (code >= clear_code)
-      {
-        if ((code >= MAX_BITS) || (code == prefix[code]))
-          return false;
+      if (code >= MAX_BITS)
+        return false;
 
-        *stackp++ = suffix[code];
-        code = prefix[code];
+      const int len = length[code];
+      const int total = len + extra;
+      if (!len || total > MAX_BITS)
+        return false;
 
-        if (stackp == stack + MAX_BITS)
-          return false;
-      }
-
-      *stackp++ = firstchar = suffix[code];
+      firstchar = first[code];
 
       /* Define a new codeword in the dictionary. */
       if (avail < 4096) {
         prefix[avail] = oldcode;
         suffix[avail] = firstchar;
+        first[avail] = first[oldcode];
+        length[avail] = length[oldcode] + 1;
         avail++;
 
         /* If we've used up all the codewords of a given length
@@ -516,13 +532,40 @@ nsGIFDecoder2::DoLzw(const uint8_t *q)
       }
       oldcode = incode;
 
+      /* Expand the string back to front, either directly into the scanline
+       * when it fits or into the stack when it runs over the row end.
+       */
+      const bool direct = (rowend - rowp) >= total;
+      uint8_t *out = direct ? rowp : stack;
+      uint8_t *p = out + len;
+      if (extra)
+        *p = firstchar;
+      for (int i = len; i > 1; i--) {
+        *--p = suffix[code];
+        code = prefix[code];
+      }
+      *--p = suffix[code];
+
+      if (direct) {
+        rowp += total;
+        if (rowp == rowend)
+          OUTPUT_ROW();
+        continue;
+      }
+
       /* Copy the decoded data out to the scanline buffer. */
-      do {
-        *rowp++ = *--stackp;
+      const uint8_t *from = stack;
+      int left = total;
+      while (left > 0) {
+        int n = NS_MIN(left, int(rowend - rowp));
+        memcpy(rowp, from, n);
+        rowp += n;
+        from += n;
+        left -= n;
         if (rowp == rowend)
           OUTPUT_ROW();
-      } while (stackp > stack);
-    }
+      }
+    } while (bits >= codesize);
   }
 
   END:
@@ -535,8 +578,7 @@ nsGIFDecoder2::DoLzw(const uint8_t *q)
   mGIFStruct.count = count;
   mGIFStruct.oldcode = oldcode;
   mGIFStruct.firstchar = firstchar;
-  mGIFStruct.datum = datum;
-  mGIFStruct.stackp = stackp;
+  mGIFStruct.datum = (int32_t) datum;
   mGIFStruct.rowp = rowp;
 
   return true;
@@ -672,8 +714,11 @@ nsGIFDecoder2::WriteInternal(const char *aBuffer, uint32_t aCount)
       mGIFStruct.datum = mGIFStruct.bits = 0;
 
       /* init the tables */
-      for (int i = 0; i < clear_code; i++)
+      for (int i = 0; i < clear_code; i++) {
         mGIFStruct.suffix[i] = i;
+        mGIFStruct.first[i] = i;
+        mGIFStruct.length[i] = 1;
+      }
 
       mGIFStruct.stackp = mGIFStruct.stack;
 
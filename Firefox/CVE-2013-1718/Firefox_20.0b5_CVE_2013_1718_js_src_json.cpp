@@ -8,6 +8,10 @@
 #include "mozilla/FloatingPoint.h"
 
 #include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define JS_JSON_QUOTE_SSE2
+# include <emmintrin.h>
+#endif
 #include "jsapi.h"
 #include "jsarray.h"
 #include "jsatom.h"
@@ -116,6 +120,31 @@ static inline bool IsQuoteSpecialCharacter(jschar c)
     return c == '"' || c == '\\' || c < ' ';
 }
 
+/* Return the index of the first character at or after i that Quote escapes. */
+static inline size_t
+SkipUnescapedCharacters(const jschar *buf, size_t i, size_t len)
+{
+#ifdef JS_JSON_QUOTE_SSE2
+    const __m128i quote = _mm_set1_epi16('"');
+    const __m128i backslash = _mm_set1_epi16('\\');
+    const __m128i control = _mm_set1_epi16(jschar(~0x1F));
+    const __m128i zero = _mm_setzero_si128();
+    for (; len - i >= 8; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(v, quote),
+                                                    _mm_cmpeq_epi16(v, backslash)),
+                                       _mm_cmpeq_epi16(_mm_and_si128(v, control), zero));
+        if (_mm_movemask_epi8(special))
+            break;
+    }
+#endif
+    for (; i < len; ++i) {
+        if (IsQuoteSpecialCharacter(buf[i]))
+            break;
+    }
+    return i;
+}
+
 /* ES5 15.12.3 Quote. */
 static bool
 Quote(JSContext *cx, StringBuffer &sb, JSString *str)
@@ -126,6 +155,10 @@ Quote(JSContext *cx, StringBuffer &sb, JSString *str)
     if (!buf)
         return false;
 
+    /* Most strings need no escapes, so make room for the common case once. */
+    if (!sb.reserve(sb.length() + len + 2))
+        return false;
+
     /* Step 1. */
     if (!sb.append('"'))
         return false;
@@ -134,10 +167,7 @@ Quote(JSContext *cx, StringBuffer &sb, JSString *str)
     for (size_t i = 0; i < len; ++i) {
         /* Batch-append maximal character sequences containing no escapes. */
         size_t mark = i;
-        do {
-            if (IsQuoteSpecialCharacter(buf[i]))
-                break;
-        } while (++i < len);
+        i = SkipUnescapedCharacters(buf, i, len);
         if (i > mark) {
             if (!sb.append(&buf[mark], i - mark))
                 return false;
@@ -186,8 +216,11 @@ class StringifyContext
         replacer(cx, replacer),
         propertyList(propertyList),
         depth(0),
-        objectStack(cx)
-    {}
+        objectStack(cx),
+        codeEpoch(0)
+    {
+        PodArrayZero(toJSONMisses);
+    }
 
     bool init() {
         return objectStack.init(16);
@@ -197,20 +230,88 @@ class StringifyContext
     ~StringifyContext() { JS_ASSERT(objectStack.empty()); }
 #endif
 
+    /*
+     * Called after anything that may have run script: getters, toJSON,
+     * the replacer, valueOf and toString, proxy traps. Script can add and
+     * remove properties anywhere, so everything learned about the shape of
+     * the objects being stringified is forgotten.
+     */
+    void noteCodeMayRun() {
+        codeEpoch++;
+        PodArrayZero(toJSONMisses);
+    }
+
+    bool lacksToJSON(JSContext *cx, JSObject *obj);
+
     StringBuffer &sb;
     const StringBuffer &gap;
     RootedObject replacer;
     const AutoIdVector &propertyList;
     uint32_t depth;
     HashSet<JSObject *> objectStack;
+
+    /* Bumped by noteCodeMayRun. */
+    uint32_t codeEpoch;
+
+  private:
+    /*
+     * Objects with no toJSON property anywhere on their prototype chain, by
+     * shape and prototype. The pointers are only compared, never followed.
+     */
+    struct ToJSONMiss {
+        Shape *shape;
+        JSObject *proto;
+    };
+    ToJSONMiss toJSONMisses[16];
 };
 
+/*
+ * Whether obj is known to have no toJSON property, so that PreprocessValue
+ * can skip the lookup. This only answers for chains of native objects with
+ * no resolve hooks; everything else goes through GetMethod.
+ */
+bool
+StringifyContext::lacksToJSON(JSContext *cx, JSObject *obj)
+{
+    /* Dense arrays have no named properties of their own. */
+    JSObject *start;
+    if (obj->isDenseArray())
+        start = obj->getProto();
+    else if (obj->isNative())
+        start = obj;
+    else
+        return false;
+
+    Shape *shape = obj->lastProperty();
+    JSObject *proto = obj->getProto();
+    ToJSONMiss &entry = toJSONMisses[(uintptr_t(shape) >> 3) % ArrayLength(toJSONMisses)];
+    if (entry.shape == shape && entry.proto == proto)
+        return true;
+
+    jsid id = NameToId(cx->names().toJSON);
+    for (JSObject *pobj = start; pobj; pobj = pobj->getProto()) {
+        if (!pobj->isNative() || pobj->getOps()->lookupGeneric ||
+            pobj->getClass()->resolve != JS_ResolveStub)
+        {
+            return false;
+        }
+        if (pobj->nativeContains(cx, id))
+            return false;
+    }
+
+    entry.shape = shape;
+    entry.proto = proto;
+    return true;
+}
+
 static JSBool Str(JSContext *cx, const Value &v, StringifyContext *scx);
 
 static JSBool
 WriteIndent(JSContext *cx, StringifyContext *scx, uint32_t limit)
 {
     if (!scx->gap.empty()) {
+        if (!scx->sb.reserve(scx->sb.length() + 1 + limit * scx->gap.length()))
+            return JS_FALSE;
         if (!scx->sb.append('\n'))
             return JS_FALSE;
         for (uint32_t i = 0; i < limit; i++) {
@@ -278,12 +379,13 @@ PreprocessValue(JSContext *cx, HandleObject holder, KeyType key, MutableHandleVa
     RootedString keyStr(cx);
 
     /* Step 2. */
-    if (vp.get().isObject()) {
+    if (vp.get().isObject() && !scx->lacksToJSON(cx, &vp.get().toObject())) {
         RootedValue toJSON(cx);
         RootedId id(cx, NameToId(cx->names().toJSON));
         Rooted<JSObject*> obj(cx, &vp.get().toObject());
         if (!GetMethod(cx, obj, id, 0, &toJSON))
             return false;
+        scx->noteCodeMayRun();
 
         if (js_IsCallable(toJSON)) {
             keyStr = KeyStringifier<KeyType>::toString(cx, key);
@@ -324,6 +426,7 @@ PreprocessValue(JSContext *cx, HandleObject holder, KeyType key, MutableHandleVa
         if (!Invoke(cx, args))
             return false;
         vp.set(args.rval());
+        scx->noteCodeMayRun();
     }
 
     /* Step 4. */
@@ -334,11 +437,13 @@ PreprocessValue(JSContext *cx, HandleObject holder, KeyType key, MutableHandleVa
             if (!ToNumber(cx, vp, &d))
                 return false;
             vp.set(NumberValue(d));
+            scx->noteCodeMayRun();
         } else if (ObjectClassIs(obj, ESClass_String, cx)) {
             JSString *str = ToStringSlow(cx, vp);
             if (!str)
                 return false;
             vp.set(StringValue(str));
+            scx->noteCodeMayRun();
         } else if (ObjectClassIs(obj, ESClass_Boolean, cx)) {
             if (!BooleanGetPrimitiveValue(cx, obj, vp.address()))
                 return false;
@@ -362,6 +467,54 @@ IsFilteredValue(const Value &v)
     return v.isUndefined() || js_IsCallable(v) || VALUE_IS_XML(v);
 }
 
+/*
+ * Plain objects have no hooks that could intercept enumerating or getting
+ * their own properties, so JO can take both straight from their shapes.
+ * Objects without a prototype are left out because enumeration hides their
+ * __proto__ property.
+ */
+static inline bool
+IsPlainObject(JSObject *obj)
+{
+    return obj->isNative() && obj->getClass() == &ObjectClass && obj->getProto();
+}
+
+/*
+ * The own enumerable properties of a plain object, in the order
+ * GetPropertyNames gives them, with the slot to read each value from, or
+ * SHAPE_INVALID_SLOT if the property has to be got generically.
+ */
+static bool
+GetPlainObjectProperties(JSContext *cx, HandleObject obj, AutoIdVector &ids,
+                         Vector<uint32_t, 8> &slots)
+{
+    JS_ASSERT(IsPlainObject(obj));
+
+    Shape::Range r = obj->lastProperty()->all();
+    Shape::Range::AutoRooter root(cx, &r);
+    for (; !r.empty(); r.popFront()) {
+        Shape &shape = r.front();
+        if (!shape.enumerable() || JSID_IS_DEFAULT_XML_NAMESPACE(shape.propid()))
+            continue;
+        uint32_t slot = (shape.hasSlot() && shape.hasDefaultGetter())
+                        ? shape.slot()
+                        : SHAPE_INVALID_SLOT;
+        if (!ids.append(shape.propid()) || !slots.append(slot))
+            return false;
+    }
+
+    /* Shapes run from the last property added to the first. */
+    for (size_t i = 0, j = ids.length(); i + 1 < j; i++, j--) {
+        jsid id = ids[i];
+        ids[i] = ids[j - 1];
+        ids[j - 1] = id;
+        uint32_t slot = slots[i];
+        slots[i] = slots[j - 1];
+        slots[j - 1] = slot;
+    }
+    return true;
+}
+
 /* ES5 15.12.3 JO. */
 static JSBool
 JO(JSContext *cx, HandleObject obj, StringifyContext *scx)
@@ -387,17 +540,27 @@ JO(JSContext *cx, HandleObject obj, StringifyContext *scx)
     /* Steps 5-7. */
     Maybe<AutoIdVector> ids;
     const AutoIdVector *props;
+    Vector<uint32_t, 8> slots(cx);
     if (scx->replacer && !scx->replacer->isCallable()) {
         JS_ASSERT(JS_IsArrayObject(cx, scx->replacer));
         props = &scx->propertyList;
     } else {
         JS_ASSERT_IF(scx->replacer, scx->propertyList.length() == 0);
         ids.construct(cx);
-        if (!GetPropertyNames(cx, obj, JSITER_OWNONLY, ids.addr()))
-            return false;
+        if (IsPlainObject(obj)) {
+            if (!GetPlainObjectProperties(cx, obj, *ids.addr(), slots))
+                return false;
+        } else {
+            if (!GetPropertyNames(cx, obj, JSITER_OWNONLY, ids.addr()))
+                return false;
+            scx->noteCodeMayRun();
+        }
         props = ids.addr();
     }
 
+    /* The slots stay valid for as long as no script runs. */
+    uint32_t epoch = scx->codeEpoch;
+
     /* My kingdom for not-quite-initialized-from-the-start references. */
     const AutoIdVector &propertyList = *props;
 
@@ -414,8 +577,13 @@ JO(JSContext *cx, HandleObject obj, StringifyContext *scx)
          */
         id = propertyList[i];
         RootedValue outputValue(cx);
-        if (!JSObject::getGeneric(cx, obj, obj, id, &outputValue))
-            return false;
+        if (i < slots.length() && slots[i] != SHAPE_INVALID_SLOT && scx->codeEpoch == epoch) {
+            outputValue = obj->nativeGetSlot(slots[i]);
+        } else {
+            if (!JSObject::getGeneric(cx, obj, obj, id, &outputValue))
+                return false;
+            scx->noteCodeMayRun();
+        }
         if (!PreprocessValue(cx, obj, HandleId(id), &outputValue, scx))
             return false;
         if (IsFilteredValue(outputValue))
@@ -472,8 +640,13 @@ JA(JSContext *cx, HandleObject obj, StringifyContext *scx)
 
     /* Step 6. */
     uint32_t length;
-    if (!GetLengthProperty(cx, obj, &length))
-        return JS_FALSE;
+    if (obj->isArray()) {
+        length = obj->getArrayLength();
+    } else {
+        if (!GetLengthProperty(cx, obj, &length))
+            return JS_FALSE;
+        scx->noteCodeMayRun();
+    }
 
     /* Steps 7-10. */
     if (length != 0) {
@@ -490,8 +663,15 @@ JA(JSContext *cx, HandleObject obj, StringifyContext *scx)
              * and the replacer and maybe unboxing, and interpreting some
              * values as |null| in separate steps.
              */
-            if (!JSObject::getElement(cx, obj, obj, i, &outputValue))
-                return JS_FALSE;
+            if (obj->isDenseArray() && i < obj->getDenseArrayInitializedLength() &&
+                !obj->getDenseArrayElement(i).isMagic(JS_ARRAY_HOLE))
+            {
+                outputValue = obj->getDenseArrayElement(i);
+            } else {
+                if (!JSObject::getElement(cx, obj, obj, i, &outputValue))
+                    return JS_FALSE;
+                scx->noteCodeMayRun();
+            }
             if (!PreprocessValue(cx, obj, i, &outputValue, scx))
                 return JS_FALSE;
             if (IsFilteredValue(outputValue)) {
@@ -559,11 +739,7 @@ Str(JSContext *cx, const Value &v, StringifyContext *scx)
                 return scx->sb.append("null");
         }
 
-        StringBuffer sb(cx);
-        if (!NumberValueToStringBuffer(cx, v, sb))
-            return false;
-
-        return scx->sb.append(sb.begin(), sb.length());
+        return NumberValueToStringBuffer(cx, v, scx->sb);
     }
 
     /* Step 10. */
@@ -30,19 +30,236 @@
 
 #include "DenormalDisabler.h"
 #include <algorithm>
+#include <cfloat>
 
+#include "mozilla/Casting.h"
 #include "mozilla/FloatingPoint.h"
 #include "mozilla/Constants.h"
+#include "mozilla/SSE.h"
 #include "WebAudioUtils.h"
 
+#ifdef MOZILLA_PRESUME_SSE2
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 using mozilla::dom::WebAudioUtils;
+using mozilla::BitwiseCast;
 using mozilla::IsInfinite;
 using mozilla::IsNaN;
 
 namespace WebCore {
 
+// The per-frame curve math in process() works on blocks of
+// nDivisionFrames frames using the polynomial approximations below, four
+// frames at a time with SSE2 and one at a time otherwise. Both evaluate the
+// same polynomials, so they give the same results.
+//
+// Over the ranges the compressor uses, fastLog2() is within 2.5e-7 of
+// log2f() (so dB values are within 2e-6 dB), fastExp2() is within 4e-7
+// relative error of exp2f(), and fastSinHalfPi() is within 1e-7 of
+// sinf(0.5 * M_PI * x). The detector and envelope state stays in full
+// precision and is still updated frame by frame.
+
+const unsigned nDivisionFrames = 32;
+
+// 20 * log10(2) and its inverse, to go between dB and base 2 exponents.
+const float log2ToDecibels = 6.0205999f;
+const float decibelsToLog2 = 0.16609640f;
+const float log2OfE = 1.4426950f;
+// M_SQRT2 is missing from MSVC's <math.h> unless _USE_MATH_DEFINES is set.
+const double sqrtTwo = 1.41421356237309504880;
+
+// log2(1 + t) ~ t * P(t) for t in [sqrt(1/2) - 1, sqrt(2) - 1].
+#define LOG2_POLYNOMIAL(t) \
+    (1.4426950f + (t) * (-0.72135150f + (t) * (0.48091504f + (t) * (-0.36030874f + \
+    (t) * (0.28739509f + (t) * (-0.24826621f + (t) * (0.23131931f + (t) * -0.14437164f)))))))
+// 2^f for f in [-1/2, 1/2].
+#define EXP2_POLYNOMIAL(f) \
+    (1.0f + (f) * (0.69314718f + (f) * (0.24022211f + (f) * (0.055503406f + \
+    (f) * (0.0096707679f + (f) * 0.0013395286f)))))
+// sin(pi / 2 * x) ~ x * Q(x^2) for x in [-1, 1].
+#define SIN_HALF_PI_POLYNOMIAL(x2) \
+    (1.5707964f + (x2) * (-0.64596385f + (x2) * (0.079690374f + \
+    (x2) * (-0.0046749627f + (x2) * 0.00015212584f))))
+
+// x must be positive and normal.
+static inline float fastLog2(float x)
+{
+    uint32_t bits = BitwiseCast<uint32_t>(x);
+    int32_t exponent = int32_t(bits >> 23) - 127;
+    float m = BitwiseCast<float>((bits & 0x007fffff) | 0x3f800000);
+    if (m > float(sqrtTwo)) {
+        m = m - 0.5f * m;
+        exponent += 1;
+    }
+    float t = m - 1;
+    return float(exponent) + t * LOG2_POLYNOMIAL(t);
+}
+
+static inline float fastExp2(float x)
+{
+    x = min(126.0f, max(-126.0f, x));
+    float n = floorf(x + 0.5f);
+    float f = x - n;
+    float scale = BitwiseCast<float>(uint32_t(int32_t(n) + 127) << 23);
+    return EXP2_POLYNOMIAL(f) * scale;
+}
+
+static inline float fastSinHalfPi(float x)
+{
+    return x * SIN_HALF_PI_POLYNOMIAL(x * x);
+}
+
+#ifdef MOZILLA_PRESUME_SSE2
+static inline __m128 fastLog2(__m128 x)
+{
+    __m128i bits = _mm_castps_si128(x);
+    __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                                             _mm_set1_epi32(0x3f800000)));
+    __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(float(sqrtTwo)));
+    m = _mm_sub_ps(m, _mm_and_ps(big, _mm_mul_ps(_mm_set1_ps(0.5f), m)));
+    // big is all ones, i.e. -1, in the lanes that were halved.
+    exponent = _mm_sub_epi32(exponent, _mm_castps_si128(big));
+    __m128 t = _mm_sub_ps(m, _mm_set1_ps(1));
+
+    __m128 p = _mm_set1_ps(-0.14437164f);
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.23131931f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.24826621f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.28739509f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.36030874f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.48091504f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.72135150f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(1.4426950f));
+    return _mm_add_ps(_mm_cvtepi32_ps(exponent), _mm_mul_ps(t, p));
+}
+
+static inline __m128 fastExp2(__m128 x)
+{
+    x = _mm_min_ps(_mm_set1_ps(126.0f), _mm_max_ps(_mm_set1_ps(-126.0f), x));
+    // floor(x + 0.5), from a truncation corrected for negative values.
+    __m128 y = _mm_add_ps(x, _mm_set1_ps(0.5f));
+    __m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+    n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, y), _mm_set1_ps(1)));
+    __m128 f = _mm_sub_ps(x, n);
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n),
+                                                                 _mm_set1_epi32(127)), 23));
+
+    __m128 p = _mm_set1_ps(0.0013395286f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0096707679f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.055503406f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.24022211f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.69314718f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+    return _mm_mul_ps(p, scale);
+}
+
+static inline __m128 fastSinHalfPi(__m128 x)
+{
+    __m128 x2 = _mm_mul_ps(x, x);
+    __m128 p = _mm_set1_ps(0.00015212584f);
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-0.0046749627f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(0.079690374f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-0.64596385f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.5707964f));
+    return _mm_mul_ps(x, p);
+}
+#endif
+
+// In-place block versions of the above. length must be a multiple of 4.
+
+static void fastLog2Block(float* values, unsigned length)
+{
+#ifdef MOZILLA_PRESUME_SSE2
+    for (unsigned i = 0; i < length; i += 4)
+        _mm_storeu_ps(values + i, fastLog2(_mm_loadu_ps(values + i)));
+#else
+    for (unsigned i = 0; i < length; ++i)
+        values[i] = fastLog2(values[i]);
+#endif
+}
+
+static void fastExp2Block(float* values, unsigned length)
+{
+#ifdef MOZILLA_PRESUME_SSE2
+    for (unsigned i = 0; i < length; i += 4)
+        _mm_storeu_ps(values + i, fastExp2(_mm_loadu_ps(values + i)));
+#else
+    for (unsigned i = 0; i < length; ++i)
+        values[i] = fastExp2(values[i]);
+#endif
+}
+
+static void fastSinHalfPiBlock(float* values, unsigned length)
+{
+#ifdef MOZILLA_PRESUME_SSE2
+    for (unsigned i = 0; i < length; i += 4)
+        _mm_storeu_ps(values + i, fastSinHalfPi(_mm_loadu_ps(values + i)));
+#else
+    for (unsigned i = 0; i < length; ++i)
+        values[i] = fastSinHalfPi(values[i]);
+#endif
+}
+
+// Computes the detector's attenuation and release rate for a block of
+// compressor input levels. This is saturate() followed by the dB math of the
+// per-frame loop; none of it depends on the envelope state, so it can be
+// done for the whole block up front.
+static void computeDetectorBlock(const float* absInput, float* attenuation, float* releaseRate,
+                                 unsigned length, float linearThreshold, float kneeThreshold,
+                                 float kneeThresholdDb, float ykneeThresholdDb, float slope,
+                                 float k, float satReleaseFrames)
+{
+    MOZ_ASSERT(length <= nDivisionFrames && !(length % 4));
+
+    // kneeCurve()
+    float knee[nDivisionFrames];
+    for (unsigned i = 0; i < length; ++i)
+        knee[i] = -k * (absInput[i] - linearThreshold) * log2OfE;
+    fastExp2Block(knee, length);
+    for (unsigned i = 0; i < length; ++i)
+        knee[i] = linearThreshold + (1 - knee[i]) / k;
+
+    // Constant ratio after knee.
+    float ratio[nDivisionFrames];
+    for (unsigned i = 0; i < length; ++i)
+        ratio[i] = max(FLT_MIN, absInput[i]);
+    fastLog2Block(ratio, length);
+    for (unsigned i = 0; i < length; ++i)
+        ratio[i] = (ykneeThresholdDb + slope * (ratio[i] * log2ToDecibels - kneeThresholdDb)) * decibelsToLog2;
+    fastExp2Block(ratio, length);
+
+    for (unsigned i = 0; i < length; ++i) {
+        float x = absInput[i];
+        float y = x < linearThreshold ? x : (x < kneeThreshold ? knee[i] : ratio[i]);
+        attenuation[i] = x <= 0.0001f ? 1 : y / x;
+        releaseRate[i] = max(FLT_MIN, attenuation[i]);
+    }
+    fastLog2Block(releaseRate, length);
+    for (unsigned i = 0; i < length; ++i) {
+        float attenuationDb = max(2.0f, -releaseRate[i] * log2ToDecibels);
+        float dbPerFrame = attenuationDb / satReleaseFrames;
+        releaseRate[i] = dbPerFrame * decibelsToLog2;
+    }
+    fastExp2Block(releaseRate, length);
+    for (unsigned i = 0; i < length; ++i)
+        releaseRate[i] -= 1;
+}
+
+// output[i] = input[i] * gain[i]
+static void multiplyBlock(const float* input, const float* gain, float* output, unsigned length)
+{
+#ifdef MOZILLA_PRESUME_SSE2
+    for (unsigned i = 0; i < length; i += 4)
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_loadu_ps(input + i), _mm_loadu_ps(gain + i)));
+#else
+    for (unsigned i = 0; i < length; ++i)
+        output[i] = input[i] * gain[i];
+#endif
+}
+
 
 // Metering hits peaks instantly, but releases this fast (in seconds).
 const float meteringReleaseTimeConstant = 0.325f;
@@ -277,8 +494,6 @@ void DynamicsCompressorKernel::process(float* sourceChannels[],
 
     setPreDelayTime(preDelayTime);
 
-    const int nDivisionFrames = 32;
-
     const int nDivisions = framesToProcess / nDivisionFrames;
 
     unsigned frameIndex = 0;
@@ -370,45 +585,37 @@ void DynamicsCompressorKernel::process(float* sourceChannels[],
             float detectorAverage = m_detectorAverage;
             float compressorGain = m_compressorGain;
 
-            int loopFrames = nDivisionFrames;
-            while (loopFrames--) {
-                float compressorInput = 0;
-
-                // Predelay signal, computing compression amount from un-delayed version.
-                for (unsigned i = 0; i < numberOfChannels; ++i) {
-                    float* delayBuffer = m_preDelayBuffers[i];
-                    float undelayedSource = sourceChannels[i][frameIndex];
-                    delayBuffer[preDelayWriteIndex] = undelayedSource;
-
-                    float absUndelayedSource = undelayedSource > 0 ? undelayedSource : -undelayedSource;
-                    if (compressorInput < absUndelayedSource)
-                        compressorInput = absUndelayedSource;
+            // Compute the compression amount from the un-delayed signal,
+            // using the loudest channel in each frame.
+            float compressorInput[nDivisionFrames];
+            for (unsigned j = 0; j < nDivisionFrames; ++j)
+                compressorInput[j] = 0;
+            for (unsigned i = 0; i < numberOfChannels; ++i) {
+                const float* source = sourceChannels[i] + frameIndex;
+                for (unsigned j = 0; j < nDivisionFrames; ++j) {
+                    float absUndelayedSource = source[j] > 0 ? source[j] : -source[j];
+                    if (compressorInput[j] < absUndelayedSource)
+                        compressorInput[j] = absUndelayedSource;
                 }
+            }
 
-                // Calculate shaped power on undelayed input.
-
-                float scaledInput = compressorInput;
-                float absInput = scaledInput > 0 ? scaledInput : -scaledInput;
-
-                // Put through shaping curve.
-                // This is linear up to the threshold, then enters a "knee" portion followed by the "ratio" portion.
-                // The transition from the threshold to the knee is smooth (1st derivative matched).
-                // The transition from the knee to the ratio portion is smooth (1st derivative matched).
-                float shapedInput = saturate(absInput, k);
-
-                float attenuation = absInput <= 0.0001f ? 1 : shapedInput / absInput;
-
-                float attenuationDb = -WebAudioUtils::ConvertLinearToDecibels(attenuation, -1000.0f);
-                attenuationDb = max(2.0f, attenuationDb);
-
-                float dbPerFrame = attenuationDb / satReleaseFrames;
-
-                float satReleaseRate = WebAudioUtils::ConvertDecibelsToLinear(dbPerFrame) - 1;
-
-                bool isRelease = (attenuation > detectorAverage);
-                float rate = isRelease ? satReleaseRate : 1;
-
-                detectorAverage += (attenuation - detectorAverage) * rate;
+            // Put through shaping curve.
+            // This is linear up to the threshold, then enters a "knee" portion followed by the "ratio" portion.
+            // The transition from the threshold to the knee is smooth (1st derivative matched).
+            // The transition from the knee to the ratio portion is smooth (1st derivative matched).
+            float attenuation[nDivisionFrames];
+            float satReleaseRate[nDivisionFrames];
+            computeDetectorBlock(compressorInput, attenuation, satReleaseRate, nDivisionFrames,
+                                 m_linearThreshold, m_kneeThreshold, m_kneeThresholdDb,
+                                 m_ykneeThresholdDb, m_slope, k, satReleaseFrames);
+
+            // The envelopes depend on the previous frame, so these stay serial.
+            float totalGain[nDivisionFrames];
+            for (unsigned j = 0; j < nDivisionFrames; ++j) {
+                bool isRelease = (attenuation[j] > detectorAverage);
+                float rate = isRelease ? satReleaseRate[j] : 1;
+
+                detectorAverage += (attenuation[j] - detectorAverage) * rate;
                 detectorAverage = min(1.0f, detectorAverage);
 
                 // Fix gremlins.
@@ -427,30 +634,53 @@ void DynamicsCompressorKernel::process(float* sourceChannels[],
                     compressorGain = min(1.0f, compressorGain);
                 }
 
-                // Warp pre-compression gain to smooth out sharp exponential transition points.
-                float postWarpCompressorGain = sinf(0.5f * M_PI * compressorGain);
-
-                // Calculate total gain using master gain and effect blend.
-                float totalGain = dryMix + wetMix * masterLinearGain * postWarpCompressorGain;
+                totalGain[j] = compressorGain;
+            }
 
-                // Calculate metering.
-                float dbRealGain = 20 * log10(postWarpCompressorGain);
-                if (dbRealGain < m_meteringGain)
-                    m_meteringGain = dbRealGain;
+            // Warp pre-compression gain to smooth out sharp exponential transition points.
+            fastSinHalfPiBlock(totalGain, nDivisionFrames);
+
+            // Calculate metering.
+            float dbRealGain[nDivisionFrames];
+            for (unsigned j = 0; j < nDivisionFrames; ++j)
+                dbRealGain[j] = max(FLT_MIN, totalGain[j]);
+            fastLog2Block(dbRealGain, nDivisionFrames);
+            for (unsigned j = 0; j < nDivisionFrames; ++j) {
+                float db = dbRealGain[j] * log2ToDecibels;
+                if (db < m_meteringGain)
+                    m_meteringGain = db;
                 else
-                    m_meteringGain += (dbRealGain - m_meteringGain) * m_meteringReleaseK;
+                    m_meteringGain += (db - m_meteringGain) * m_meteringReleaseK;
 
-                // Apply final gain.
-                for (unsigned i = 0; i < numberOfChannels; ++i) {
-                    float* delayBuffer = m_preDelayBuffers[i];
-                    destinationChannels[i][frameIndex] = delayBuffer[preDelayReadIndex] * totalGain;
+                // Calculate total gain using master gain and effect blend.
+                totalGain[j] = dryMix + wetMix * masterLinearGain * totalGain[j];
+            }
+
+            // Predelay signal and apply final gain. The first preDelayFrames
+            // frames come out of the delay buffer and the rest straight from
+            // this block's input. Everything is read before anything is
+            // written, so the source and destination may be the same buffer.
+            unsigned preDelayFrames = (preDelayWriteIndex - preDelayReadIndex) & MaxPreDelayFramesMask;
+            for (unsigned i = 0; i < numberOfChannels; ++i) {
+                float* delayBuffer = m_preDelayBuffers[i];
+                const float* source = sourceChannels[i] + frameIndex;
+
+                float delayed[nDivisionFrames];
+                for (unsigned j = 0; j < nDivisionFrames; ++j) {
+                    delayed[j] = j < preDelayFrames ?
+                        delayBuffer[(preDelayReadIndex + j) & MaxPreDelayFramesMask] :
+                        source[j - preDelayFrames];
                 }
+                for (unsigned j = 0; j < nDivisionFrames; ++j)
+                    delayBuffer[(preDelayWriteIndex + j) & MaxPreDelayFramesMask] = source[j];
 
-                frameIndex++;
-                preDelayReadIndex = (preDelayReadIndex + 1) & MaxPreDelayFramesMask;
-                preDelayWriteIndex = (preDelayWriteIndex + 1) & MaxPreDelayFramesMask;
+                multiplyBlock(delayed, totalGain, destinationChannels[i] + frameIndex, nDivisionFrames);
             }
 
+            frameIndex += nDivisionFrames;
+            preDelayReadIndex = (preDelayReadIndex + nDivisionFrames) & MaxPreDelayFramesMask;
+            preDelayWriteIndex = (preDelayWriteIndex + nDivisionFrames) & MaxPreDelayFramesMask;
+
             // Locals back to member variables.
             m_preDelayReadIndex = preDelayReadIndex;
             m_preDelayWriteIndex = preDelayWriteIndex;
@@ -111,6 +111,65 @@ static void speex_free (void *ptr) {free(ptr);}
 #endif
 #endif
 
+/* The AVX2/FMA kernels live in resample_avx2.c, which is compiled with those
+ * instruction sets enabled when _USE_AVX2 is defined. Like the SSE code, they
+ * are only used if we find at runtime that the CPU supports them. */
+#if defined(FLOATING_POINT) && defined(_USE_AVX2)
+#define RESAMPLE_AVX2
+float inner_product_single_avx2(const float *a, const float *b, unsigned int len);
+float interpolate_product_single_avx2(const float *a, const float *b, unsigned int len, const unsigned int oversample, const float *frac);
+double inner_product_double_avx2(const float *a, const float *b, unsigned int len);
+double interpolate_product_double_avx2(const float *a, const float *b, unsigned int len, const unsigned int oversample, const float *frac);
+void inner_product_multi_single_avx2(const float *a, const float *b, unsigned int stride, unsigned int channels, unsigned int len, float *sums);
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static void resampler_cpuid(int leaf, unsigned int regs[4])
+{
+   __cpuidex((int *)regs, leaf, 0);
+}
+static unsigned long long resampler_xgetbv(void)
+{
+   return _xgetbv(0);
+}
+#else
+#include <cpuid.h>
+static void resampler_cpuid(int leaf, unsigned int regs[4])
+{
+   __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+}
+static unsigned long long resampler_xgetbv(void)
+{
+   unsigned int eax, edx;
+   __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+   return ((unsigned long long)edx << 32) | eax;
+}
+#endif
+
+static int moz_has_avx2(void)
+{
+   static int has_avx2 = -1;
+   if (has_avx2 < 0)
+   {
+      unsigned int regs[4];
+      int has = 0;
+      resampler_cpuid(0, regs);
+      if (regs[0] >= 7)
+      {
+         resampler_cpuid(1, regs);
+         /* FMA, OSXSAVE and AVX, with the OS saving the YMM registers */
+         if ((regs[2] & 0x18001000) == 0x18001000 && (resampler_xgetbv() & 6) == 6)
+         {
+            resampler_cpuid(7, regs);
+            has = (regs[1] & 0x20) != 0;
+         }
+      }
+      has_avx2 = has;
+   }
+   return has_avx2;
+}
+#endif
+
 /* Numer of elements to allocate on the stack */
 #ifdef VAR_ARRAYS
 #define FIXED_STACK_ALLOC 8192
@@ -355,11 +414,17 @@ static int resampler_basic_direct_single(SpeexResamplerState *st, spx_uint32_t c
       const spx_word16_t *sinct = & sinc_table[samp_frac_num*N];
       const spx_word16_t *iptr = & in[last_sample];
 
+#ifdef RESAMPLE_AVX2
+    if (moz_has_avx2()) {
+      sum = inner_product_single_avx2(sinct, iptr, N);
+    } else
+#endif
 #ifdef OVERRIDE_INNER_PRODUCT_SINGLE
     if (moz_has_sse()) {
       sum = inner_product_single(sinct, iptr, N);
-    } else {
+    } else
 #endif
+    {
       int j;
       sum = 0;
       for(j=0;j<N;j++) sum += MULT16_16(sinct[j], iptr[j]);
@@ -376,9 +441,7 @@ static int resampler_basic_direct_single(SpeexResamplerState *st, spx_uint32_t c
       }
       sum = accum[0] + accum[1] + accum[2] + accum[3];
 */
-#ifdef OVERRIDE_INNER_PRODUCT_SINGLE
     }
-#endif
 
       out[out_stride * out_sample++] = SATURATE32(PSHR32(sum, 15), 32767);
       last_sample += int_advance;
@@ -416,11 +479,17 @@ static int resampler_basic_direct_double(SpeexResamplerState *st, spx_uint32_t c
       const spx_word16_t *sinct = & sinc_table[samp_frac_num*N];
       const spx_word16_t *iptr = & in[last_sample];
 
+#ifdef RESAMPLE_AVX2
+      if (moz_has_avx2()) {
+        sum = inner_product_double_avx2(sinct, iptr, N);
+      } else
+#endif
 #ifdef OVERRIDE_INNER_PRODUCT_DOUBLE
       if(moz_has_sse2()) {
         sum = inner_product_double(sinct, iptr, N);
-      } else {
+      } else
 #endif
+      {
         int j;
         double accum[4] = {0,0,0,0};
 
@@ -431,9 +500,7 @@ static int resampler_basic_direct_double(SpeexResamplerState *st, spx_uint32_t c
           accum[3] += sinct[j+3]*iptr[j+3];
         }
         sum = accum[0] + accum[1] + accum[2] + accum[3];
-#ifdef OVERRIDE_INNER_PRODUCT_DOUBLE
       }
-#endif
 
       out[out_stride * out_sample++] = PSHR32(sum, 15);
       last_sample += int_advance;
@@ -476,12 +543,19 @@ static int resampler_basic_interpolate_single(SpeexResamplerState *st, spx_uint3
       spx_word16_t interp[4];
 
 
+#ifdef RESAMPLE_AVX2
+      if (moz_has_avx2()) {
+        cubic_coef(frac, interp);
+        sum = interpolate_product_single_avx2(iptr, st->sinc_table + st->oversample + 4 - offset - 2, N, st->oversample, interp);
+      } else
+#endif
 #ifdef OVERRIDE_INTERPOLATE_PRODUCT_SINGLE
       if (moz_has_sse()) {
         cubic_coef(frac, interp);
         sum = interpolate_product_single(iptr, st->sinc_table + st->oversample + 4 - offset - 2, N, st->oversample, interp);
-      } else {
+      } else
 #endif
+      {
         int j;
         spx_word32_t accum[4] = {0,0,0,0};
 
@@ -494,9 +568,7 @@ static int resampler_basic_interpolate_single(SpeexResamplerState *st, spx_uint3
         }
         cubic_coef(frac, interp);
         sum = MULT16_32_Q15(interp[0],SHR32(accum[0], 1)) + MULT16_32_Q15(interp[1],SHR32(accum[1], 1)) + MULT16_32_Q15(interp[2],SHR32(accum[2], 1)) + MULT16_32_Q15(interp[3],SHR32(accum[3], 1));
-#ifdef OVERRIDE_INTERPOLATE_PRODUCT_SINGLE
       }
-#endif
 
       out[out_stride * out_sample++] = SATURATE32(PSHR32(sum, 14), 32767);
       last_sample += int_advance;
@@ -541,12 +613,19 @@ static int resampler_basic_interpolate_double(SpeexResamplerState *st, spx_uint3
       spx_word16_t interp[4];
 
 
+#ifdef RESAMPLE_AVX2
+      if (moz_has_avx2()) {
+        cubic_coef(frac, interp);
+        sum = interpolate_product_double_avx2(iptr, st->sinc_table + st->oversample + 4 - offset - 2, N, st->oversample, interp);
+      } else
+#endif
 #ifdef OVERRIDE_INTERPOLATE_PRODUCT_DOUBLE
       if (moz_has_sse2()) {
         cubic_coef(frac, interp);
         sum = interpolate_product_double(iptr, st->sinc_table + st->oversample + 4 - offset - 2, N, st->oversample, interp);
-      } else {
+      } else
 #endif
+      {
       int j;
       double accum[4] = {0,0,0,0};
 
@@ -560,9 +639,7 @@ static int resampler_basic_interpolate_double(SpeexResamplerState *st, spx_uint3
 
       cubic_coef(frac, interp);
       sum = MULT16_32_Q15(interp[0],accum[0]) + MULT16_32_Q15(interp[1],accum[1]) + MULT16_32_Q15(interp[2],accum[2]) + MULT16_32_Q15(interp[3],accum[3]);
-#ifdef OVERRIDE_INNER_PRODUCT_DOUBLE
       }
-#endif
       out[out_stride * out_sample++] = PSHR32(sum,15);
       last_sample += int_advance;
       samp_frac_num += frac_advance;
@@ -1030,12 +1107,142 @@ SPX_RESAMPLE_EXPORT int speex_resampler_process_int(SpeexResamplerState *st, spx
    return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
 }
 
+#ifdef RESAMPLE_AVX2
+/* Channels processed together by the interleaved path. This covers 7.1. */
+#define MAX_BATCH_CHANNELS 8
+
+/* Like resampler_basic_direct_single, but for all channels at once. The
+   channels advance in lock step, so they all use the same filter phase for
+   each output frame. Output is interleaved. */
+static int resampler_basic_direct_single_multi(SpeexResamplerState *st, spx_uint32_t in_len, float *out, spx_uint32_t out_len)
+{
+   const int N = st->filt_len;
+   const spx_uint32_t nb_channels = st->nb_channels;
+   int out_sample = 0;
+   int last_sample = st->last_sample[0];
+   spx_uint32_t samp_frac_num = st->samp_frac_num[0];
+   const spx_word16_t *sinc_table = st->sinc_table;
+   const int int_advance = st->int_advance;
+   const int frac_advance = st->frac_advance;
+   const spx_uint32_t den_rate = st->den_rate;
+   float sums[MAX_BATCH_CHANNELS];
+   spx_uint32_t c;
+
+   while (!(last_sample >= (spx_int32_t)in_len || out_sample >= (spx_int32_t)out_len))
+   {
+      const spx_word16_t *sinct = & sinc_table[samp_frac_num*N];
+      const spx_word16_t *iptr = & st->mem[last_sample];
+
+      inner_product_multi_single_avx2(sinct, iptr, st->mem_alloc_size, nb_channels, N, sums);
+
+      for (c=0;c<nb_channels;c++)
+         out[nb_channels * out_sample + c] = SATURATE32(PSHR32(sums[c], 15), 32767);
+      out_sample++;
+      last_sample += int_advance;
+      samp_frac_num += frac_advance;
+      if (samp_frac_num >= den_rate)
+      {
+         samp_frac_num -= den_rate;
+         last_sample++;
+      }
+   }
+
+   for (c=0;c<nb_channels;c++)
+   {
+      st->last_sample[c] = last_sample;
+      st->samp_frac_num[c] = samp_frac_num;
+   }
+   return out_sample;
+}
+
+/* Whether speex_resampler_process_interleaved_float can run all channels
+   through resampler_basic_direct_single_multi. That needs every channel to
+   be at the same position with no magic samples pending, which is always the
+   case when the stream is only ever fed through the interleaved API.
+   Without a vector kernel, interleaving the channels in the inner loop is
+   slower than running them one after the other, so only AVX2 batches. */
+static int can_process_batched(SpeexResamplerState *st)
+{
+   spx_uint32_t i;
+   if (!moz_has_avx2())
+      return 0;
+   if (st->nb_channels < 2 || st->nb_channels > MAX_BATCH_CHANNELS)
+      return 0;
+   if (st->resampler_ptr != resampler_basic_direct_single)
+      return 0;
+   for (i=0;i<st->nb_channels;i++)
+   {
+      if (st->magic_samples[i] ||
+          st->last_sample[i] != st->last_sample[0] ||
+          st->samp_frac_num[i] != st->samp_frac_num[0])
+         return 0;
+   }
+   return 1;
+}
+
+/* speex_resampler_process_float and speex_resampler_process_native for all
+   channels at once, with interleaved input and output. */
+static int speex_resampler_process_batched(SpeexResamplerState *st, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
+{
+   const spx_uint32_t nb_channels = st->nb_channels;
+   const int N = st->filt_len;
+   const int filt_offs = N - 1;
+   const spx_uint32_t xlen = st->mem_alloc_size - filt_offs;
+   spx_uint32_t ilen = *in_len;
+   spx_uint32_t olen = *out_len;
+   spx_uint32_t i;
+   int j;
+
+   st->started = 1;
+
+   while (ilen && olen) {
+      spx_uint32_t ichunk = (ilen > xlen) ? xlen : ilen;
+      spx_uint32_t ochunk;
+
+      for (i=0;i<nb_channels;i++) {
+         spx_word16_t *x = st->mem + i * st->mem_alloc_size + filt_offs;
+         if (in) {
+            for(j=0;j<(int)ichunk;++j)
+               x[j]=in[j*nb_channels+i];
+         } else {
+            for(j=0;j<(int)ichunk;++j)
+               x[j]=0;
+         }
+      }
+
+      ochunk = resampler_basic_direct_single_multi(st, ichunk, out, olen);
+
+      if (st->last_sample[0] < (spx_int32_t)ichunk)
+         ichunk = st->last_sample[0];
+      for (i=0;i<nb_channels;i++) {
+         spx_word16_t *mem = st->mem + i * st->mem_alloc_size;
+         st->last_sample[i] -= ichunk;
+         for(j=0;j<N-1;++j)
+            mem[j] = mem[j+ichunk];
+      }
+
+      ilen -= ichunk;
+      olen -= ochunk;
+      out += ochunk * nb_channels;
+      if (in)
+         in += ichunk * nb_channels;
+   }
+   *in_len -= ilen;
+   *out_len -= olen;
+   return RESAMPLER_ERR_SUCCESS;
+}
+#endif
+
 SPX_RESAMPLE_EXPORT int speex_resampler_process_interleaved_float(SpeexResamplerState *st, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
 {
    spx_uint32_t i;
    int istride_save, ostride_save;
    spx_uint32_t bak_out_len = *out_len;
    spx_uint32_t bak_in_len = *in_len;
+#ifdef RESAMPLE_AVX2
+   if (can_process_batched(st))
+      return speex_resampler_process_batched(st, in, in_len, out, out_len);
+#endif
    istride_save = st->in_stride;
    ostride_save = st->out_stride;
    st->in_stride = st->out_stride = st->nb_channels;
@@ -0,0 +1,155 @@
+/* Copyright (C) 2007-2008 Jean-Marc Valin
+ * Copyright (C) 2008 Thorvald Natvig
+ */
+/**
+   @file resample_avx2.c
+   @brief Resampler functions (AVX2 and FMA version)
+
+   This file must be compiled with AVX2 and FMA enabled. resample.c only
+   calls into it after checking at runtime that the CPU supports both.
+*/
+/*
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Xiph.org Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <immintrin.h>
+
+/* All of these take len as a multiple of 8, like the SSE versions; filt_len
+   is always rounded to a multiple of 8. */
+
+static float hsum_ps(__m256 v)
+{
+   __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+   return _mm_cvtss_f32(sum);
+}
+
+float inner_product_single_avx2(const float *a, const float *b, unsigned int len)
+{
+   unsigned int i;
+   __m256 sum = _mm256_setzero_ps();
+   for (i=0;i<len;i+=8)
+      sum = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), sum);
+   return hsum_ps(sum);
+}
+
+float interpolate_product_single_avx2(const float *a, const float *b, unsigned int len, const unsigned int oversample, const float *frac)
+{
+   unsigned int i;
+   __m256 sum = _mm256_setzero_ps();
+   __m128 total;
+   /* Taps i and i+1 go in the low and high halves; each half accumulates
+      the four interpolation points. */
+   for (i=0;i<len;i+=2)
+   {
+      __m256 coef = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(a[i])),
+                                         _mm_set1_ps(a[i+1]), 1);
+      __m256 table = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(b+i*oversample)),
+                                          _mm_loadu_ps(b+(i+1)*oversample), 1);
+      sum = _mm256_fmadd_ps(coef, table, sum);
+   }
+   total = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+   total = _mm_mul_ps(total, _mm_loadu_ps(frac));
+   total = _mm_add_ps(total, _mm_movehl_ps(total, total));
+   total = _mm_add_ss(total, _mm_shuffle_ps(total, total, 0x55));
+   return _mm_cvtss_f32(total);
+}
+
+/* The double versions keep the scalar code's four accumulators and the
+   order of the final sum. The products are exact in double precision here,
+   where the scalar code rounds them to float first. */
+
+double inner_product_double_avx2(const float *a, const float *b, unsigned int len)
+{
+   unsigned int i;
+   double accum[4];
+   __m256d sum = _mm256_setzero_pd();
+   for (i=0;i<len;i+=4)
+      sum = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(a+i)),
+                            _mm256_cvtps_pd(_mm_loadu_ps(b+i)), sum);
+   _mm256_storeu_pd(accum, sum);
+   return accum[0] + accum[1] + accum[2] + accum[3];
+}
+
+double interpolate_product_double_avx2(const float *a, const float *b, unsigned int len, const unsigned int oversample, const float *frac)
+{
+   unsigned int i;
+   double accum[4];
+   __m256d sum = _mm256_setzero_pd();
+   for (i=0;i<len;i++)
+      sum = _mm256_fmadd_pd(_mm256_set1_pd(a[i]),
+                            _mm256_cvtps_pd(_mm_loadu_ps(b+i*oversample)), sum);
+   _mm256_storeu_pd(accum, sum);
+   return frac[0]*accum[0] + frac[1]*accum[1] + frac[2]*accum[2] + frac[3]*accum[3];
+}
+
+/* Inner products of one filter phase with several channels. Channel c
+   starts at b + c*stride. Each block of coefficients is loaded once and used
+   for up to four channels. */
+void inner_product_multi_single_avx2(const float *a, const float *b, unsigned int stride, unsigned int channels, unsigned int len, float *sums)
+{
+   unsigned int c = 0;
+   unsigned int i;
+   for (;c+4<=channels;c+=4)
+   {
+      const float *b0 = b + c*stride;
+      __m256 sum0 = _mm256_setzero_ps();
+      __m256 sum1 = _mm256_setzero_ps();
+      __m256 sum2 = _mm256_setzero_ps();
+      __m256 sum3 = _mm256_setzero_ps();
+      for (i=0;i<len;i+=8)
+      {
+         __m256 coef = _mm256_loadu_ps(a+i);
+         sum0 = _mm256_fmadd_ps(coef, _mm256_loadu_ps(b0+i), sum0);
+         sum1 = _mm256_fmadd_ps(coef, _mm256_loadu_ps(b0+stride+i), sum1);
+         sum2 = _mm256_fmadd_ps(coef, _mm256_loadu_ps(b0+2*stride+i), sum2);
+         sum3 = _mm256_fmadd_ps(coef, _mm256_loadu_ps(b0+3*stride+i), sum3);
+      }
+      sums[c] = hsum_ps(sum0);
+      sums[c+1] = hsum_ps(sum1);
+      sums[c+2] = hsum_ps(sum2);
+      sums[c+3] = hsum_ps(sum3);
+   }
+   for (;c+2<=channels;c+=2)
+   {
+      const float *b0 = b + c*stride;
+      __m256 sum0 = _mm256_setzero_ps();
+      __m256 sum1 = _mm256_setzero_ps();
+      for (i=0;i<len;i+=8)
+      {
+         __m256 coef = _mm256_loadu_ps(a+i);
+         sum0 = _mm256_fmadd_ps(coef, _mm256_loadu_ps(b0+i), sum0);
+         sum1 = _mm256_fmadd_ps(coef, _mm256_loadu_ps(b0+stride+i), sum1);
+      }
+      sums[c] = hsum_ps(sum0);
+      sums[c+1] = hsum_ps(sum1);
+   }
+   if (c<channels)
+      sums[c] = inner_product_single_avx2(a, b + c*stride, len);
+}
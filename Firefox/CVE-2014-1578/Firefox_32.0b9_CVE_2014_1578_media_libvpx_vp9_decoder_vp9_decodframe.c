@@ -32,6 +32,7 @@
 #include "vp9/decoder/vp9_detokenize.h"
 #include "vp9/decoder/vp9_decodemv.h"
 #include "vp9/decoder/vp9_dsubexp.h"
+#include "vp9/decoder/vp9_dthread.h"
 #include "vp9/decoder/vp9_onyxd_int.h"
 #include "vp9/decoder/vp9_read_bit_buffer.h"
 #include "vp9/decoder/vp9_thread.h"
@@ -39,6 +40,7 @@
 
 typedef struct TileWorkerData {
   VP9_COMMON *cm;
+  VP9LfSync *lf_sync;  // NULL when the frame is not filtered inline.
   vp9_reader bit_reader;
   DECLARE_ALIGNED(16, MACROBLOCKD, xd);
   DECLARE_ALIGNED(16, unsigned char, token_cache[1024]);
@@ -778,22 +780,116 @@ static void setup_tile_context(VP9D_COMP *const pbi, MACROBLOCKD *const xd,
   xd->above_seg_context = pbi->above_seg_context;
 }
 
-static void decode_tile(VP9D_COMP *pbi, const TileInfo *const tile,
-                        vp9_reader *r) {
-  const int num_threads = pbi->oxcf.max_threads;
+// Inline loop filtering runs one superblock row behind reconstruction.
+// With more than one thread the rows are filtered by pbi->lf_workers as a
+// wavefront (see vp9_dthread.h), alongside the tile decoding; otherwise the
+// decoding thread filters each row itself once the row below it is done.
+static void start_loop_filter(VP9D_COMP *pbi, int num_decode_threads) {
   VP9_COMMON *const cm = &pbi->common;
-  int mi_row, mi_col;
-  MACROBLOCKD *xd = &pbi->mb;
+  VP9LfSync *const lf_sync = &pbi->lf_row_sync;
+  const int sb_rows = mi_cols_aligned_to_sb(cm->mi_rows) / MI_BLOCK_SIZE;
+  int num_workers = 0;
+  int i;
 
-  if (pbi->do_loopfilter_inline) {
+  vp9_loop_filter_frame_init(cm, cm->lf.filter_level);
+
+  if (lf_sync->rows != sb_rows) {
+    vp9_loop_filter_dealloc(lf_sync);
+    vp9_loop_filter_alloc(cm, lf_sync, sb_rows, cm->width);
+  }
+  vp9_lf_sync_reset(lf_sync, 1 << cm->log2_tile_cols);
+
+#if CONFIG_MULTITHREAD
+  // Use the threads the tile decoding leaves idle, but at least one so that
+  // filtering overlaps with decoding.
+  if (pbi->oxcf.max_threads > 1)
+    num_workers = MIN(MAX(pbi->oxcf.max_threads - num_decode_threads, 1),
+                      sb_rows);
+#else
+  (void)num_decode_threads;
+#endif
+
+  if (num_workers > pbi->num_lf_workers) {
+    CHECK_MEM_ERROR(cm, pbi->lf_workers,
+                    vpx_realloc(pbi->lf_workers,
+                                num_workers * sizeof(*pbi->lf_workers)));
+    for (i = pbi->num_lf_workers; i < num_workers; ++i) {
+      VP9Worker *const worker = &pbi->lf_workers[i];
+      ++pbi->num_lf_workers;
+
+      vp9_worker_init(worker);
+      worker->hook = (VP9WorkerHook)vp9_loop_filter_row_worker;
+      CHECK_MEM_ERROR(cm, worker->data1,
+                      vpx_memalign(32, sizeof(LFRowWorkerData)));
+      if (!vp9_worker_reset(worker)) {
+        vpx_internal_error(&cm->error, VPX_CODEC_ERROR,
+                           "Loop filter thread creation failed");
+      }
+    }
+  }
+
+  for (i = 0; i < num_workers; ++i) {
+    VP9Worker *const worker = &pbi->lf_workers[i];
+    LFRowWorkerData *const lf_data = (LFRowWorkerData*)worker->data1;
+
+    lf_data->frame_buffer = get_frame_new_buffer(cm);
+    lf_data->cm = cm;
+    lf_data->xd = pbi->mb;
+    lf_data->start = i;
+    lf_data->stop = sb_rows;
+    lf_data->step = num_workers;
+    lf_data->y_only = 0;
+    lf_data->lf_sync = lf_sync;
+    vp9_worker_launch(worker);
+  }
+  lf_sync->num_workers = num_workers;
+
+  if (!num_workers) {
     LFWorkerData *const lf_data = (LFWorkerData*)pbi->lf_worker.data1;
     lf_data->frame_buffer = get_frame_new_buffer(cm);
     lf_data->cm = cm;
     lf_data->xd = pbi->mb;
     lf_data->stop = 0;
     lf_data->y_only = 0;
-    vp9_loop_filter_frame_init(cm, cm->lf.filter_level);
   }
+}
+
+// Records that superblock row |mi_row| of one tile column is reconstructed.
+static void loop_filter_row_decoded(VP9D_COMP *pbi, int mi_row) {
+  const int decoded = vp9_lf_sync_row_decoded(&pbi->lf_row_sync,
+                                              mi_row / MI_BLOCK_SIZE);
+
+  if (!pbi->lf_row_sync.num_workers) {
+    LFWorkerData *const lf_data = (LFWorkerData*)pbi->lf_worker.data1;
+    // Stay a row behind; finish_loop_filter() takes the last one.
+    const int stop = (decoded - 1) * MI_BLOCK_SIZE;
+
+    if (stop > lf_data->stop) {
+      lf_data->start = lf_data->stop;
+      lf_data->stop = stop;
+      vp9_worker_execute(&pbi->lf_worker);
+    }
+  }
+}
+
+static void finish_loop_filter(VP9D_COMP *pbi) {
+  VP9_COMMON *const cm = &pbi->common;
+
+  if (pbi->lf_row_sync.num_workers) {
+    vp9_lf_sync_stop_workers(&pbi->lf_row_sync, pbi->lf_workers, 0);
+  } else {
+    LFWorkerData *const lf_data = (LFWorkerData*)pbi->lf_worker.data1;
+    lf_data->start = lf_data->stop;
+    lf_data->stop = cm->mi_rows;
+    vp9_worker_execute(&pbi->lf_worker);
+  }
+}
+
+static void decode_tile(VP9D_COMP *pbi, const TileInfo *const tile,
+                        vp9_reader *r) {
+  VP9_COMMON *const cm = &pbi->common;
+  int mi_row, mi_col;
+  MACROBLOCKD *xd = &pbi->mb;
 
   for (mi_row = tile->mi_row_start; mi_row < tile->mi_row_end;
        mi_row += MI_BLOCK_SIZE) {
@@ -806,34 +902,8 @@ static void decode_tile(VP9D_COMP *pbi, const TileInfo *const tile,
                       pbi->token_cache);
     }
 
-    if (pbi->do_loopfilter_inline) {
-      const int lf_start = mi_row - MI_BLOCK_SIZE;
-      LFWorkerData *const lf_data = (LFWorkerData*)pbi->lf_worker.data1;
-
-      // delay the loopfilter by 1 macroblock row.
-      if (lf_start < 0) continue;
-
-      // decoding has completed: finish up the loop filter in this thread.
-      if (mi_row + MI_BLOCK_SIZE >= tile->mi_row_end) continue;
-
-      vp9_worker_sync(&pbi->lf_worker);
-      lf_data->start = lf_start;
-      lf_data->stop = mi_row;
-      if (num_threads > 1) {
-        vp9_worker_launch(&pbi->lf_worker);
-      } else {
-        vp9_worker_execute(&pbi->lf_worker);
-      }
-    }
-  }
-
-  if (pbi->do_loopfilter_inline) {
-    LFWorkerData *const lf_data = (LFWorkerData*)pbi->lf_worker.data1;
-
-    vp9_worker_sync(&pbi->lf_worker);
-    lf_data->start = lf_data->stop;
-    lf_data->stop = cm->mi_rows;
-    vp9_worker_execute(&pbi->lf_worker);
+    if (pbi->do_loopfilter_inline)
+      loop_filter_row_decoded(pbi, mi_row);
   }
 }
 
@@ -966,6 +1036,9 @@ static int tile_worker_hook(void *arg1, void *arg2) {
                       mi_row, mi_col, &tile_data->bit_reader, BLOCK_64X64,
                       tile_data->token_cache);
     }
+
+    if (tile_data->lf_sync != NULL)
+      vp9_lf_sync_row_decoded(tile_data->lf_sync, mi_row / MI_BLOCK_SIZE);
   }
   return !tile_data->xd.corrupted;
 }
@@ -1021,6 +1094,8 @@ static const uint8_t *decode_tiles_mt(VP9D_COMP *pbi, const uint8_t *data) {
           get_tile(data_end, tile_col == tile_cols - 1, &cm->error, &data);
 
       tile_data->cm = cm;
+      tile_data->lf_sync = pbi->do_loopfilter_inline ? &pbi->lf_row_sync
+                                                     : NULL;
       tile_data->xd = pbi->mb;
       tile_data->xd.corrupted = 0;
       vp9_tile_init(tile, tile_data->cm, 0, tile_col);
@@ -1297,11 +1372,21 @@ int vp9_decode_frame(VP9D_COMP *pbi, const uint8_t **p_data_end) {
   const uint8_t *const data_end = pbi->source + pbi->source_sz;
 
   struct vp9_read_bit_buffer rb = { data, data_end, 0, cm, error_handler };
-  const size_t first_partition_size = read_uncompressed_header(pbi, &rb);
-  const int keyframe = cm->frame_type == KEY_FRAME;
-  const int tile_rows = 1 << cm->log2_tile_rows;
-  const int tile_cols = 1 << cm->log2_tile_cols;
-  YV12_BUFFER_CONFIG *const new_fb = get_frame_new_buffer(cm);
+  size_t first_partition_size;
+  int keyframe, tile_rows, tile_cols;
+  YV12_BUFFER_CONFIG *new_fb;
+  int use_tile_workers;
+
+  // The error path of vp9_receive_compressed_data() stops the loop filter
+  // workers of an abandoned frame; this catches any other way out of the
+  // last frame before the header can resize the frame buffers.
+  vp9_lf_sync_stop_workers(&pbi->lf_row_sync, pbi->lf_workers, 1);
+
+  first_partition_size = read_uncompressed_header(pbi, &rb);
+  keyframe = cm->frame_type == KEY_FRAME;
+  tile_rows = 1 << cm->log2_tile_rows;
+  tile_cols = 1 << cm->log2_tile_cols;
+  new_fb = get_frame_new_buffer(cm);
 
   if (!first_partition_size) {
       // showing a frame directly
@@ -1317,15 +1402,12 @@ int vp9_decode_frame(VP9D_COMP *pbi, const uint8_t **p_data_end) {
     vpx_internal_error(&cm->error, VPX_CODEC_CORRUPT_FRAME,
                        "Truncated packet or corrupt header length");
 
-  pbi->do_loopfilter_inline =
-      (cm->log2_tile_rows | cm->log2_tile_cols) == 0 && cm->lf.filter_level;
+  // Rows are filtered once every tile column has decoded the row below
+  // them, so any tile layout can be filtered inline.
+  pbi->do_loopfilter_inline = cm->lf.filter_level != 0;
   if (pbi->do_loopfilter_inline && pbi->lf_worker.data1 == NULL) {
     CHECK_MEM_ERROR(cm, pbi->lf_worker.data1, vpx_malloc(sizeof(LFWorkerData)));
     pbi->lf_worker.hook = (VP9WorkerHook)vp9_loop_filter_worker;
-    if (pbi->oxcf.max_threads > 1 && !vp9_worker_reset(&pbi->lf_worker)) {
-      vpx_internal_error(&cm->error, VPX_CODEC_ERROR,
-                         "Loop filter thread creation failed");
-    }
   }
 
   alloc_tile_storage(pbi, tile_rows, tile_cols);
@@ -1346,13 +1428,22 @@ int vp9_decode_frame(VP9D_COMP *pbi, const uint8_t **p_data_end) {
 
   // TODO(jzern): remove frame_parallel_decoding_mode restriction for
   // single-frame tile decoding.
-  if (pbi->oxcf.max_threads > 1 && tile_rows == 1 && tile_cols > 1 &&
-      cm->frame_parallel_decoding_mode) {
+  use_tile_workers = pbi->oxcf.max_threads > 1 && tile_rows == 1 &&
+                     tile_cols > 1 && cm->frame_parallel_decoding_mode;
+
+  if (pbi->do_loopfilter_inline)
+    start_loop_filter(pbi, use_tile_workers ?
+                               MIN(pbi->oxcf.max_threads & ~1, tile_cols) : 1);
+
+  if (use_tile_workers) {
     *p_data_end = decode_tiles_mt(pbi, data + first_partition_size);
   } else {
     *p_data_end = decode_tiles(pbi, data + first_partition_size);
   }
 
+  if (pbi->do_loopfilter_inline)
+    finish_loop_filter(pbi);
+
   cm->last_width = cm->width;
   cm->last_height = cm->height;
 
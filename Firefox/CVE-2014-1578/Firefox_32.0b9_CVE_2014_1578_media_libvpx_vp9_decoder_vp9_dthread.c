@@ -0,0 +1,275 @@
+/*
+ *  Copyright (c) 2014 The WebM project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#include "./vpx_config.h"
+#include "vp9/common/vp9_loopfilter.h"
+#include "vp9/common/vp9_reconinter.h"
+#include "vp9/decoder/vp9_dthread.h"
+#include "vpx_mem/vpx_mem.h"
+
+// Waits until superblock row |r| may be filtered. Filtering changes the
+// bottom pixel rows of |r|, which the intra predictors of row r + 1 read
+// unfiltered, so row r + 1 has to be reconstructed in every tile column
+// first. Returns 0 if the frame was abandoned.
+static INLINE int sync_decoded(VP9LfSync *const lf_sync, int r) {
+#if CONFIG_MULTITHREAD
+  const int needed = MIN(r + 2, lf_sync->rows);
+  int ok;
+
+  pthread_mutex_lock(&lf_sync->dec_mutex);
+  while (lf_sync->decoded_rows < needed)
+    pthread_cond_wait(&lf_sync->dec_cond, &lf_sync->dec_mutex);
+  ok = !lf_sync->abort;
+  pthread_mutex_unlock(&lf_sync->dec_mutex);
+  return ok;
+#else
+  (void)r;
+  return !lf_sync->abort;
+#endif
+}
+
+// Filtering superblock (r, c) changes the bottom of (r - 1, c), which
+// (r - 1, c + 1) must have finished with. Waiting for row r - 1 to get
+// sync_range columns ahead, checked once per sync_range columns, covers it.
+static INLINE void sync_read(VP9LfSync *const lf_sync, int r, int c) {
+#if CONFIG_MULTITHREAD
+  const int nsync = lf_sync->sync_range;
+
+  if (r && !(c & (nsync - 1))) {
+    pthread_mutex_t *const mutex = &lf_sync->mutex_[r - 1];
+    pthread_mutex_lock(mutex);
+
+    while (c > lf_sync->cur_sb_col[r - 1] - nsync)
+      pthread_cond_wait(&lf_sync->cond_[r - 1], mutex);
+    pthread_mutex_unlock(mutex);
+  }
+#else
+  (void)lf_sync;
+  (void)r;
+  (void)c;
+#endif
+}
+
+static INLINE void sync_write(VP9LfSync *const lf_sync, int r, int c,
+                              const int sb_cols) {
+#if CONFIG_MULTITHREAD
+  const int nsync = lf_sync->sync_range;
+  int cur;
+  // Only signal when there are enough filtered SB for next row to run.
+  int sig = 1;
+
+  if (c < sb_cols - 1) {
+    cur = c;
+    if (c % nsync)
+      sig = 0;
+  } else {
+    cur = sb_cols + nsync;
+  }
+
+  if (sig) {
+    pthread_mutex_lock(&lf_sync->mutex_[r]);
+
+    lf_sync->cur_sb_col[r] = cur;
+
+    pthread_cond_signal(&lf_sync->cond_[r]);
+    pthread_mutex_unlock(&lf_sync->mutex_[r]);
+  }
+#else
+  (void)lf_sync;
+  (void)r;
+  (void)c;
+  (void)sb_cols;
+#endif
+}
+
+// Filters superblock rows start, start + step, ... below stop. This is
+// vp9_loop_filter_rows() with the row synchronization added.
+static void loop_filter_rows_mt(const YV12_BUFFER_CONFIG *const frame_buffer,
+                                VP9_COMMON *const cm, MACROBLOCKD *const xd,
+                                int start, int stop, int step, int y_only,
+                                VP9LfSync *const lf_sync) {
+  const int num_planes = y_only ? 1 : MAX_MB_PLANE;
+  const int use_420 = y_only || (xd->plane[1].subsampling_y == 1 &&
+                                 xd->plane[1].subsampling_x == 1);
+  const int sb_cols = mi_cols_aligned_to_sb(cm->mi_cols) / MI_BLOCK_SIZE;
+  int r, c;  // SB row and col
+  LOOP_FILTER_MASK lfm;
+
+  for (r = start; r < stop; r += step) {
+    const int mi_row = r * MI_BLOCK_SIZE;
+    MODE_INFO **const mi_8x8 = cm->mi_grid_visible +
+                               mi_row * cm->mode_info_stride;
+
+    if (!sync_decoded(lf_sync, r)) {
+      // Let the row below through without filtering this one.
+      sync_write(lf_sync, r, sb_cols - 1, sb_cols);
+      continue;
+    }
+
+    for (c = 0; c < sb_cols; ++c) {
+      const int mi_col = c * MI_BLOCK_SIZE;
+      int plane;
+
+      sync_read(lf_sync, r, c);
+
+      setup_dst_planes(xd, frame_buffer, mi_row, mi_col);
+
+      if (use_420)
+        vp9_setup_mask(cm, mi_row, mi_col, mi_8x8 + mi_col,
+                       cm->mode_info_stride, &lfm);
+
+      for (plane = 0; plane < num_planes; ++plane) {
+        if (use_420)
+          vp9_filter_block_plane(cm, &xd->plane[plane], mi_row, &lfm);
+        else
+          vp9_filter_block_plane_non420(cm, &xd->plane[plane],
+                                        mi_8x8 + mi_col, mi_row, mi_col);
+      }
+
+      sync_write(lf_sync, r, c, sb_cols);
+    }
+  }
+}
+
+int vp9_loop_filter_row_worker(void *arg1, void *arg2) {
+  LFRowWorkerData *const lf_data = (LFRowWorkerData*)arg1;
+  (void)arg2;
+  loop_filter_rows_mt(lf_data->frame_buffer, lf_data->cm, &lf_data->xd,
+                      lf_data->start, lf_data->stop, lf_data->step,
+                      lf_data->y_only, lf_data->lf_sync);
+  return 1;
+}
+
+// A wider frame gives a row more columns to run ahead of the next one, so
+// it can afford to signal less often.
+static int get_sync_range(int width) {
+  if (width < 640)
+    return 1;
+  else if (width <= 1280)
+    return 2;
+  else if (width <= 4096)
+    return 4;
+  else
+    return 8;
+}
+
+void vp9_loop_filter_alloc(VP9_COMMON *cm, VP9LfSync *lf_sync, int rows,
+                           int width) {
+  lf_sync->rows = rows;
+#if CONFIG_MULTITHREAD
+  {
+    int i;
+
+    pthread_mutex_init(&lf_sync->dec_mutex, NULL);
+    pthread_cond_init(&lf_sync->dec_cond, NULL);
+
+    CHECK_MEM_ERROR(cm, lf_sync->mutex_,
+                    vpx_malloc(sizeof(*lf_sync->mutex_) * rows));
+    for (i = 0; i < rows; ++i)
+      pthread_mutex_init(&lf_sync->mutex_[i], NULL);
+
+    CHECK_MEM_ERROR(cm, lf_sync->cond_,
+                    vpx_malloc(sizeof(*lf_sync->cond_) * rows));
+    for (i = 0; i < rows; ++i)
+      pthread_cond_init(&lf_sync->cond_[i], NULL);
+  }
+#endif  // CONFIG_MULTITHREAD
+
+  CHECK_MEM_ERROR(cm, lf_sync->cur_sb_col,
+                  vpx_malloc(sizeof(*lf_sync->cur_sb_col) * rows));
+  CHECK_MEM_ERROR(cm, lf_sync->row_tiles_left,
+                  vpx_malloc(sizeof(*lf_sync->row_tiles_left) * rows));
+
+  lf_sync->sync_range = get_sync_range(width);
+}
+
+void vp9_loop_filter_dealloc(VP9LfSync *lf_sync) {
+  if (lf_sync != NULL && lf_sync->rows > 0) {
+#if CONFIG_MULTITHREAD
+    int i;
+
+    if (lf_sync->mutex_ != NULL) {
+      for (i = 0; i < lf_sync->rows; ++i)
+        pthread_mutex_destroy(&lf_sync->mutex_[i]);
+      vpx_free(lf_sync->mutex_);
+    }
+    if (lf_sync->cond_ != NULL) {
+      for (i = 0; i < lf_sync->rows; ++i)
+        pthread_cond_destroy(&lf_sync->cond_[i]);
+      vpx_free(lf_sync->cond_);
+    }
+    pthread_mutex_destroy(&lf_sync->dec_mutex);
+    pthread_cond_destroy(&lf_sync->dec_cond);
+#endif  // CONFIG_MULTITHREAD
+    vpx_free(lf_sync->cur_sb_col);
+    vpx_free(lf_sync->row_tiles_left);
+    // A resize follows this with vp9_loop_filter_alloc(), which may fail
+    // part way; leave nothing behind for the next dealloc to free twice.
+    vp9_zero(*lf_sync);
+  }
+}
+
+void vp9_lf_sync_reset(VP9LfSync *lf_sync, int tile_cols) {
+  int i;
+  for (i = 0; i < lf_sync->rows; ++i) {
+    lf_sync->cur_sb_col[i] = -1;
+    lf_sync->row_tiles_left[i] = tile_cols;
+  }
+  lf_sync->decoded_rows = 0;
+  lf_sync->abort = 0;
+}
+
+int vp9_lf_sync_row_decoded(VP9LfSync *lf_sync, int sb_row) {
+  int decoded;
+#if CONFIG_MULTITHREAD
+  pthread_mutex_lock(&lf_sync->dec_mutex);
+#endif
+  decoded = lf_sync->decoded_rows;
+  --lf_sync->row_tiles_left[sb_row];
+  // Tile columns run independently, so the rows complete in every column
+  // are those before the first row some column has not finished.
+  while (lf_sync->decoded_rows < lf_sync->rows &&
+         lf_sync->row_tiles_left[lf_sync->decoded_rows] == 0)
+    ++lf_sync->decoded_rows;
+#if CONFIG_MULTITHREAD
+  if (lf_sync->decoded_rows != decoded)
+    pthread_cond_broadcast(&lf_sync->dec_cond);
+#endif
+  decoded = lf_sync->decoded_rows;
+#if CONFIG_MULTITHREAD
+  pthread_mutex_unlock(&lf_sync->dec_mutex);
+#endif
+  return decoded;
+}
+
+void vp9_lf_sync_release(VP9LfSync *lf_sync, int abort) {
+#if CONFIG_MULTITHREAD
+  pthread_mutex_lock(&lf_sync->dec_mutex);
+#endif
+  lf_sync->decoded_rows = lf_sync->rows;
+  lf_sync->abort = abort;
+#if CONFIG_MULTITHREAD
+  pthread_cond_broadcast(&lf_sync->dec_cond);
+  pthread_mutex_unlock(&lf_sync->dec_mutex);
+#endif
+}
+
+void vp9_lf_sync_stop_workers(VP9LfSync *lf_sync, VP9Worker *workers,
+                              int abort) {
+  int i;
+
+  if (!lf_sync->num_workers)
+    return;
+
+  vp9_lf_sync_release(lf_sync, abort);
+  for (i = 0; i < lf_sync->num_workers; ++i)
+    vp9_worker_sync(&workers[i]);
+  lf_sync->num_workers = 0;
+}
@@ -0,0 +1,94 @@
+/*
+ *  Copyright (c) 2014 The WebM project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#ifndef VP9_DECODER_VP9_DTHREAD_H_
+#define VP9_DECODER_VP9_DTHREAD_H_
+
+#include "./vpx_config.h"
+#include "vp9/common/vp9_blockd.h"
+#include "vp9/common/vp9_onyxc_int.h"
+#include "vp9/decoder/vp9_thread.h"
+#include "vpx_scale/yv12config.h"
+
+// Loop filter row synchronization.
+//
+// The loop filter runs one superblock row behind reconstruction. Each filter
+// worker takes every num_workers'th superblock row, and a row is filtered
+// left to right as a wavefront: superblock column c of row r waits until row
+// r - 1 has been filtered up to column c + sync_range.
+typedef struct VP9LfSyncData {
+#if CONFIG_MULTITHREAD
+  pthread_mutex_t *mutex_;
+  pthread_cond_t *cond_;
+  // Guards decoded_rows and row_tiles_left.
+  pthread_mutex_t dec_mutex;
+  pthread_cond_t dec_cond;
+#endif
+  // The last filtered superblock column of each row.
+  int *cur_sb_col;
+  // The number of tile columns that have not yet reconstructed each row.
+  int *row_tiles_left;
+  // Superblock rows reconstructed in every tile column.
+  int decoded_rows;
+  // Set when a frame is abandoned; the workers then skip the rows left.
+  int abort;
+  // Power of two, so that sync_read() only checks at multiples of it.
+  int sync_range;
+  int rows;
+  // Filter workers running on the current frame, or 0 if the decoding
+  // thread filters the rows itself.
+  int num_workers;
+} VP9LfSync;
+
+typedef struct LFRowWorkerData {
+  const YV12_BUFFER_CONFIG *frame_buffer;
+  VP9_COMMON *cm;
+  MACROBLOCKD xd;  // A private copy: filtering moves the plane pointers.
+  // Superblock rows start, start + step, ... below stop.
+  int start;
+  int stop;
+  int step;
+  int y_only;
+  VP9LfSync *lf_sync;
+} LFRowWorkerData;
+
+// Allocates the synchronization state for |rows| superblock rows of a frame
+// |width| pixels wide.
+void vp9_loop_filter_alloc(VP9_COMMON *cm, VP9LfSync *lf_sync, int rows,
+                           int width);
+
+// Deallocates the synchronization state. Safe to call on a partially
+// allocated or zeroed VP9LfSync.
+void vp9_loop_filter_dealloc(VP9LfSync *lf_sync);
+
+// Prepares for a frame whose superblock rows are each split across
+// |tile_cols| tile columns. No filter worker may be running.
+void vp9_lf_sync_reset(VP9LfSync *lf_sync, int tile_cols);
+
+// Records that one tile column has reconstructed superblock row |sb_row|.
+// Returns the number of rows reconstructed in every tile column.
+int vp9_lf_sync_row_decoded(VP9LfSync *lf_sync, int sb_row);
+
+// Releases the filter workers once decoding stops. If |abort| is set the
+// rows not yet filtered are skipped.
+void vp9_lf_sync_release(VP9LfSync *lf_sync, int abort);
+
+// Releases the filter workers running on the current frame, if any, and
+// waits for them to finish. If |abort| is set they skip the rows they have
+// not started. Besides ending each frame, this must be called with |abort|
+// set wherever a frame can be abandoned through vpx_internal_error(), and
+// before the workers are ended with vp9_worker_end(): until then they may be
+// waiting for rows that will never be decoded.
+void vp9_lf_sync_stop_workers(VP9LfSync *lf_sync, VP9Worker *workers,
+                              int abort);
+
+int vp9_loop_filter_row_worker(void *arg1, void *arg2);
+
+#endif  // VP9_DECODER_VP9_DTHREAD_H_
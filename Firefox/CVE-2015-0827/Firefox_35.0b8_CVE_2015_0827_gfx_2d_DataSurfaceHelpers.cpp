@@ -9,6 +9,7 @@
 #include "DataSurfaceHelpers.h"
 #include "Logging.h"
 #include "mozilla/MathAlgorithms.h"
+#include "Swizzle.h"
 #include "Tools.h"
 
 namespace mozilla {
@@ -17,18 +18,8 @@ namespace gfx {
 void
 ConvertBGRXToBGRA(uint8_t* aData, const IntSize &aSize, int32_t aStride)
 {
-  uint32_t* pixel = reinterpret_cast<uint32_t*>(aData);
-
-  for (int row = 0; row < aSize.height; ++row) {
-    for (int column = 0; column < aSize.width; ++column) {
-#ifdef IS_BIG_ENDIAN
-      pixel[column] |= 0x000000FF;
-#else
-      pixel[column] |= 0xFF000000;
-#endif
-    }
-    pixel += (aStride/4);
-  }
+  SwizzleData(aData, aStride, SurfaceFormat::B8G8R8X8,
+              aData, aStride, SurfaceFormat::B8G8R8A8, aSize);
 }
 
 void
@@ -61,21 +52,9 @@ CopyBGRXSurfaceDataToPackedBGRArray(uint8_t* aSrc, uint8_t* aDst,
 {
   int packedStride = aSrcSize.width * 3;
 
-  uint8_t* srcPx = aSrc;
-  uint8_t* dstPx = aDst;
-
-  for (int row = 0; row < aSrcSize.height; ++row) {
-    for (int col = 0; col < aSrcSize.height; ++col) {
-      dstPx[0] = srcPx[0];
-      dstPx[1] = srcPx[1];
-      dstPx[2] = srcPx[2];
-      // srcPx[3] (unused or alpha component) dropped on floor
-      srcPx += 4;
-      dstPx += 3;
-    }
-    srcPx = aSrc += aSrcStride;
-    dstPx = aDst += packedStride;
-  }
+  // The unused or alpha byte of each source pixel is dropped on the floor.
+  PackToRGB24(aSrc, aSrcStride, SurfaceFormat::B8G8R8X8,
+              aDst, packedStride, PackedFormat::B8G8R8, aSrcSize);
 }
 
 uint8_t*
@@ -99,16 +78,19 @@ SurfaceToPackedBGRA(DataSourceSurface *aSurface)
     return nullptr;
   }
 
-  CopySurfaceDataToPackedArray(map.mData, imageBuffer, size,
-                               map.mStride, 4 * sizeof(uint8_t));
-
-  aSurface->Unmap();
-
   if (format == SurfaceFormat::B8G8R8X8) {
-    // Convert BGRX to BGRA by setting a to 255.
-    ConvertBGRXToBGRA(reinterpret_cast<uint8_t *>(imageBuffer), size, size.width * sizeof(uint32_t));
+    // Convert BGRX to BGRA by setting a to 255 while packing, rather than in
+    // a second pass over the copy.
+    SwizzleData(map.mData, map.mStride, format,
+                imageBuffer, size.width * sizeof(uint32_t),
+                SurfaceFormat::B8G8R8A8, size);
+  } else {
+    CopySurfaceDataToPackedArray(map.mData, imageBuffer, size,
+                                 map.mStride, 4 * sizeof(uint8_t));
   }
 
+  aSurface->Unmap();
+
   return imageBuffer;
 }
 
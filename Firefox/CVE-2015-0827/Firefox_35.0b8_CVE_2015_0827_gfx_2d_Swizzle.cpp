@@ -0,0 +1,430 @@
+/* -*- Mode: C++; tab-width: 20; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cstring>
+
+#include "Swizzle.h"
+#include "mozilla/Atomics.h"
+#include "mozilla/SSE.h"
+
+#if defined(USE_AVX2) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace mozilla {
+namespace gfx {
+
+// Reciprocals used to unpremultiply: round(0xFF00 / a), with 0 for a == 0.
+// A channel c becomes ((c << 8) * gUnpremultiplyTable[a] + 0x8000) >> 16,
+// which both the scalar and the SIMD row loops compute exactly.
+extern const uint16_t gUnpremultiplyTable[256] = {
+      0, 65280, 32640, 21760, 16320, 13056, 10880,  9326,
+   8160,  7253,  6528,  5935,  5440,  5022,  4663,  4352,
+   4080,  3840,  3627,  3436,  3264,  3109,  2967,  2838,
+   2720,  2611,  2511,  2418,  2331,  2251,  2176,  2106,
+   2040,  1978,  1920,  1865,  1813,  1764,  1718,  1674,
+   1632,  1592,  1554,  1518,  1484,  1451,  1419,  1389,
+   1360,  1332,  1306,  1280,  1255,  1232,  1209,  1187,
+   1166,  1145,  1126,  1106,  1088,  1070,  1053,  1036,
+   1020,  1004,   989,   974,   960,   946,   933,   919,
+    907,   894,   882,   870,   859,   848,   837,   826,
+    816,   806,   796,   787,   777,   768,   759,   750,
+    742,   733,   725,   717,   710,   702,   694,   687,
+    680,   673,   666,   659,   653,   646,   640,   634,
+    628,   622,   616,   610,   604,   599,   593,   588,
+    583,   578,   573,   568,   563,   558,   553,   549,
+    544,   540,   535,   531,   526,   522,   518,   514,
+    510,   506,   502,   498,   495,   491,   487,   484,
+    480,   476,   473,   470,   466,   463,   460,   457,
+    453,   450,   447,   444,   441,   438,   435,   432,
+    429,   427,   424,   421,   418,   416,   413,   411,
+    408,   405,   403,   400,   398,   396,   393,   391,
+    389,   386,   384,   382,   380,   377,   375,   373,
+    371,   369,   367,   365,   363,   361,   359,   357,
+    355,   353,   351,   349,   347,   345,   344,   342,
+    340,   338,   336,   335,   333,   331,   330,   328,
+    326,   325,   323,   322,   320,   318,   317,   315,
+    314,   312,   311,   309,   308,   306,   305,   304,
+    302,   301,   299,   298,   297,   295,   294,   293,
+    291,   290,   289,   288,   286,   285,   284,   283,
+    281,   280,   279,   278,   277,   275,   274,   273,
+    272,   271,   270,   269,   268,   266,   265,   264,
+    263,   262,   261,   260,   259,   258,   257,   256
+};
+
+// Row loops for the vector units.  Each converts as many whole vectors as
+// fit in aLength pixels and returns how many pixels it converted; the
+// remainder is left to the next narrower implementation.
+#ifdef USE_SSSE3
+int32_t SwizzleRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                         bool aSwapRB, bool aOpaque);
+int32_t PremultiplyRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst,
+                             int32_t aLength, bool aSwapRB, bool aOpaque);
+int32_t UnpremultiplyRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst,
+                               int32_t aLength, bool aSwapRB, bool aOpaque);
+int32_t PackRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                      bool aSwapRB);
+int32_t UnpackRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                        bool aSwapRB);
+#endif
+
+#ifdef USE_AVX2
+int32_t SwizzleRow_AVX2(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                        bool aSwapRB, bool aOpaque);
+int32_t PremultiplyRow_AVX2(const uint8_t* aSrc, uint8_t* aDst,
+                            int32_t aLength, bool aSwapRB, bool aOpaque);
+int32_t UnpremultiplyRow_AVX2(const uint8_t* aSrc, uint8_t* aDst,
+                              int32_t aLength, bool aSwapRB, bool aOpaque);
+
+static bool
+DetectAVX2()
+{
+#if defined(_MSC_VER)
+  int regs[4];
+  __cpuid(regs, 0);
+  if (regs[0] < 7) {
+    return false;
+  }
+  __cpuid(regs, 1);
+  // The OS must save the YMM registers for AVX to be usable at all.
+  bool osxsave = (regs[2] & (1 << 27)) != 0;
+  if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) {
+    return false;
+  }
+  __cpuidex(regs, 7, 0);
+  return (regs[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// -1 until the first swizzle on any thread asks. Threads that race to fill
+// it in all store the same answer, so an atomic store is all it needs. It
+// lives at file scope because MSVC before 2015 does not make function-local
+// statics thread-safe.
+static Atomic<int> sHasAVX2(-1);
+
+static bool
+HasAVX2()
+{
+  int hasAVX2 = sHasAVX2;
+  if (hasAVX2 < 0) {
+    hasAVX2 = DetectAVX2();
+    sHasAVX2 = hasAVX2;
+  }
+  return hasAVX2 != 0;
+}
+#endif
+
+static bool
+GetChannelOrder(SurfaceFormat aFormat, bool& aIsBGR, bool& aHasAlpha)
+{
+  switch (aFormat) {
+  case SurfaceFormat::B8G8R8A8:
+    aIsBGR = true;
+    aHasAlpha = true;
+    return true;
+  case SurfaceFormat::B8G8R8X8:
+    aIsBGR = true;
+    aHasAlpha = false;
+    return true;
+  case SurfaceFormat::R8G8B8A8:
+    aIsBGR = false;
+    aHasAlpha = true;
+    return true;
+  case SurfaceFormat::R8G8B8X8:
+    aIsBGR = false;
+    aHasAlpha = false;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static inline uint8_t
+PremultiplyChannel(uint32_t aColor, uint32_t aAlpha)
+{
+  // Exact round(aColor * aAlpha / 255) without a division.
+  uint32_t t = aColor * aAlpha + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static inline uint8_t
+UnpremultiplyChannel(uint32_t aColor, uint32_t aAlpha)
+{
+  uint32_t v = ((aColor << 8) * gUnpremultiplyTable[aAlpha] + 0x8000) >> 16;
+  return v > 0xFF ? 0xFF : v;
+}
+
+// The scalar row loops read a whole pixel before writing it, so they are
+// safe to run in place.
+
+static void
+SwizzleRow_Scalar(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                  bool aSwapRB, bool aOpaque)
+{
+  for (int32_t i = 0; i < aLength; ++i, aSrc += 4, aDst += 4) {
+    uint8_t c0 = aSrc[0], c1 = aSrc[1], c2 = aSrc[2], a = aSrc[3];
+    aDst[0] = aSwapRB ? c2 : c0;
+    aDst[1] = c1;
+    aDst[2] = aSwapRB ? c0 : c2;
+    aDst[3] = aOpaque ? 0xFF : a;
+  }
+}
+
+static void
+PremultiplyRow_Scalar(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                      bool aSwapRB, bool aOpaque)
+{
+  for (int32_t i = 0; i < aLength; ++i, aSrc += 4, aDst += 4) {
+    uint8_t c0 = aSrc[0], c1 = aSrc[1], c2 = aSrc[2], a = aSrc[3];
+    aDst[0] = PremultiplyChannel(aSwapRB ? c2 : c0, a);
+    aDst[1] = PremultiplyChannel(c1, a);
+    aDst[2] = PremultiplyChannel(aSwapRB ? c0 : c2, a);
+    aDst[3] = aOpaque ? 0xFF : a;
+  }
+}
+
+static void
+UnpremultiplyRow_Scalar(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                        bool aSwapRB, bool aOpaque)
+{
+  for (int32_t i = 0; i < aLength; ++i, aSrc += 4, aDst += 4) {
+    uint8_t c0 = aSrc[0], c1 = aSrc[1], c2 = aSrc[2], a = aSrc[3];
+    aDst[0] = UnpremultiplyChannel(aSwapRB ? c2 : c0, a);
+    aDst[1] = UnpremultiplyChannel(c1, a);
+    aDst[2] = UnpremultiplyChannel(aSwapRB ? c0 : c2, a);
+    aDst[3] = aOpaque ? 0xFF : a;
+  }
+}
+
+static void
+PackRow_Scalar(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+               bool aSwapRB)
+{
+  for (int32_t i = 0; i < aLength; ++i, aSrc += 4, aDst += 3) {
+    aDst[0] = aSwapRB ? aSrc[2] : aSrc[0];
+    aDst[1] = aSrc[1];
+    aDst[2] = aSwapRB ? aSrc[0] : aSrc[2];
+  }
+}
+
+static void
+UnpackRow_Scalar(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                 bool aSwapRB)
+{
+  for (int32_t i = 0; i < aLength; ++i, aSrc += 3, aDst += 4) {
+    aDst[0] = aSwapRB ? aSrc[2] : aSrc[0];
+    aDst[1] = aSrc[1];
+    aDst[2] = aSwapRB ? aSrc[0] : aSrc[2];
+    aDst[3] = 0xFF;
+  }
+}
+
+static void
+SwizzleRow(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+           bool aSwapRB, bool aOpaque)
+{
+  int32_t done = 0;
+#ifdef USE_AVX2
+  if (HasAVX2()) {
+    done += SwizzleRow_AVX2(aSrc, aDst, aLength, aSwapRB, aOpaque);
+  }
+#endif
+#ifdef USE_SSSE3
+  if (mozilla::supports_ssse3()) {
+    done += SwizzleRow_SSSE3(aSrc + 4 * done, aDst + 4 * done,
+                             aLength - done, aSwapRB, aOpaque);
+  }
+#endif
+  SwizzleRow_Scalar(aSrc + 4 * done, aDst + 4 * done, aLength - done,
+                    aSwapRB, aOpaque);
+}
+
+static void
+PremultiplyRow(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+               bool aSwapRB, bool aOpaque)
+{
+  int32_t done = 0;
+#ifdef USE_AVX2
+  if (HasAVX2()) {
+    done += PremultiplyRow_AVX2(aSrc, aDst, aLength, aSwapRB, aOpaque);
+  }
+#endif
+#ifdef USE_SSSE3
+  if (mozilla::supports_ssse3()) {
+    done += PremultiplyRow_SSSE3(aSrc + 4 * done, aDst + 4 * done,
+                                 aLength - done, aSwapRB, aOpaque);
+  }
+#endif
+  PremultiplyRow_Scalar(aSrc + 4 * done, aDst + 4 * done, aLength - done,
+                        aSwapRB, aOpaque);
+}
+
+static void
+UnpremultiplyRow(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                 bool aSwapRB, bool aOpaque)
+{
+  int32_t done = 0;
+#ifdef USE_AVX2
+  if (HasAVX2()) {
+    done += UnpremultiplyRow_AVX2(aSrc, aDst, aLength, aSwapRB, aOpaque);
+  }
+#endif
+#ifdef USE_SSSE3
+  if (mozilla::supports_ssse3()) {
+    done += UnpremultiplyRow_SSSE3(aSrc + 4 * done, aDst + 4 * done,
+                                   aLength - done, aSwapRB, aOpaque);
+  }
+#endif
+  UnpremultiplyRow_Scalar(aSrc + 4 * done, aDst + 4 * done, aLength - done,
+                          aSwapRB, aOpaque);
+}
+
+static void
+PackRow(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength, bool aSwapRB)
+{
+  int32_t done = 0;
+#ifdef USE_SSSE3
+  if (mozilla::supports_ssse3()) {
+    done = PackRow_SSSE3(aSrc, aDst, aLength, aSwapRB);
+  }
+#endif
+  PackRow_Scalar(aSrc + 4 * done, aDst + 3 * done, aLength - done, aSwapRB);
+}
+
+static void
+UnpackRow(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength, bool aSwapRB)
+{
+  int32_t done = 0;
+#ifdef USE_SSSE3
+  if (mozilla::supports_ssse3()) {
+    done = UnpackRow_SSSE3(aSrc, aDst, aLength, aSwapRB);
+  }
+#endif
+  UnpackRow_Scalar(aSrc + 3 * done, aDst + 4 * done, aLength - done, aSwapRB);
+}
+
+bool
+SwizzleData(const uint8_t* aSrc, int32_t aSrcStride, SurfaceFormat aSrcFormat,
+            uint8_t* aDst, int32_t aDstStride, SurfaceFormat aDstFormat,
+            const IntSize& aSize)
+{
+  bool srcBGR, srcAlpha, dstBGR, dstAlpha;
+  if (!GetChannelOrder(aSrcFormat, srcBGR, srcAlpha) ||
+      !GetChannelOrder(aDstFormat, dstBGR, dstAlpha)) {
+    return false;
+  }
+
+  bool swapRB = srcBGR != dstBGR;
+  bool opaque = !srcAlpha || !dstAlpha;
+
+  for (int row = 0; row < aSize.height; ++row) {
+    if (!swapRB && !opaque) {
+      if (aSrc != aDst) {
+        memcpy(aDst, aSrc, aSize.width * 4);
+      }
+    } else {
+      SwizzleRow(aSrc, aDst, aSize.width, swapRB, opaque);
+    }
+    aSrc += aSrcStride;
+    aDst += aDstStride;
+  }
+  return true;
+}
+
+bool
+PremultiplyData(const uint8_t* aSrc, int32_t aSrcStride,
+                SurfaceFormat aSrcFormat,
+                uint8_t* aDst, int32_t aDstStride, SurfaceFormat aDstFormat,
+                const IntSize& aSize)
+{
+  bool srcBGR, srcAlpha, dstBGR, dstAlpha;
+  if (!GetChannelOrder(aSrcFormat, srcBGR, srcAlpha) ||
+      !GetChannelOrder(aDstFormat, dstBGR, dstAlpha)) {
+    return false;
+  }
+
+  if (!srcAlpha) {
+    // Opaque pixels are their own premultiplied form.
+    return SwizzleData(aSrc, aSrcStride, aSrcFormat, aDst, aDstStride,
+                       aDstFormat, aSize);
+  }
+
+  for (int row = 0; row < aSize.height; ++row) {
+    PremultiplyRow(aSrc, aDst, aSize.width, srcBGR != dstBGR, !dstAlpha);
+    aSrc += aSrcStride;
+    aDst += aDstStride;
+  }
+  return true;
+}
+
+bool
+UnpremultiplyData(const uint8_t* aSrc, int32_t aSrcStride,
+                  SurfaceFormat aSrcFormat,
+                  uint8_t* aDst, int32_t aDstStride, SurfaceFormat aDstFormat,
+                  const IntSize& aSize)
+{
+  bool srcBGR, srcAlpha, dstBGR, dstAlpha;
+  if (!GetChannelOrder(aSrcFormat, srcBGR, srcAlpha) ||
+      !GetChannelOrder(aDstFormat, dstBGR, dstAlpha)) {
+    return false;
+  }
+
+  if (!srcAlpha) {
+    return SwizzleData(aSrc, aSrcStride, aSrcFormat, aDst, aDstStride,
+                       aDstFormat, aSize);
+  }
+
+  for (int row = 0; row < aSize.height; ++row) {
+    UnpremultiplyRow(aSrc, aDst, aSize.width, srcBGR != dstBGR, !dstAlpha);
+    aSrc += aSrcStride;
+    aDst += aDstStride;
+  }
+  return true;
+}
+
+bool
+PackToRGB24(const uint8_t* aSrc, int32_t aSrcStride, SurfaceFormat aSrcFormat,
+            uint8_t* aDst, int32_t aDstStride, PackedFormat aDstFormat,
+            const IntSize& aSize)
+{
+  bool srcBGR, srcAlpha;
+  if (!GetChannelOrder(aSrcFormat, srcBGR, srcAlpha)) {
+    return false;
+  }
+
+  bool swapRB = srcBGR != (aDstFormat == PackedFormat::B8G8R8);
+  for (int row = 0; row < aSize.height; ++row) {
+    PackRow(aSrc, aDst, aSize.width, swapRB);
+    aSrc += aSrcStride;
+    aDst += aDstStride;
+  }
+  return true;
+}
+
+bool
+UnpackFromRGB24(const uint8_t* aSrc, int32_t aSrcStride,
+                PackedFormat aSrcFormat,
+                uint8_t* aDst, int32_t aDstStride, SurfaceFormat aDstFormat,
+                const IntSize& aSize)
+{
+  bool dstBGR, dstAlpha;
+  if (!GetChannelOrder(aDstFormat, dstBGR, dstAlpha)) {
+    return false;
+  }
+
+  bool swapRB = dstBGR != (aSrcFormat == PackedFormat::B8G8R8);
+  for (int row = 0; row < aSize.height; ++row) {
+    UnpackRow(aSrc, aDst, aSize.width, swapRB);
+    aSrc += aSrcStride;
+    aDst += aDstStride;
+  }
+  return true;
+}
+
+}
+}
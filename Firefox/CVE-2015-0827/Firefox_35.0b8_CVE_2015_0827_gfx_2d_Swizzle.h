@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 20; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef MOZILLA_GFX_SWIZZLE_H_
+#define MOZILLA_GFX_SWIZZLE_H_
+
+#include "Point.h"
+#include "Types.h"
+
+namespace mozilla {
+namespace gfx {
+
+/**
+ * Byte orders of 3-byte packed pixels, which SurfaceFormat has no values for.
+ */
+MOZ_BEGIN_ENUM_CLASS(PackedFormat, int8_t)
+  B8G8R8,
+  R8G8B8
+MOZ_END_ENUM_CLASS(PackedFormat)
+
+/**
+ * Pixel format conversions between the 32-bit B8G8R8A8, B8G8R8X8, R8G8B8A8
+ * and R8G8B8X8 formats, and to and from 24-bit packed pixels.
+ *
+ * All of these work row by row, so aSrcStride and aDstStride may include
+ * padding.  Converting in place (aSrc == aDst with equal strides) is allowed
+ * between 32-bit formats.  Each returns false if a format is not supported,
+ * in which case nothing has been written.
+ *
+ * SSSE3 and AVX2 versions of the row loops are picked at runtime when the
+ * build and the CPU support them; they produce exactly the same bytes as the
+ * scalar versions.
+ */
+
+/**
+ * Reorders the color channels of each pixel.  Converting to an A format from
+ * an X format sets alpha to 0xFF, as does converting to an X format.
+ */
+bool SwizzleData(const uint8_t* aSrc, int32_t aSrcStride,
+                 SurfaceFormat aSrcFormat,
+                 uint8_t* aDst, int32_t aDstStride,
+                 SurfaceFormat aDstFormat,
+                 const IntSize& aSize);
+
+/**
+ * Multiplies the color channels by alpha (rounded to nearest) while
+ * swizzling.  An X source format is treated as opaque.
+ */
+bool PremultiplyData(const uint8_t* aSrc, int32_t aSrcStride,
+                     SurfaceFormat aSrcFormat,
+                     uint8_t* aDst, int32_t aDstStride,
+                     SurfaceFormat aDstFormat,
+                     const IntSize& aSize);
+
+/**
+ * Divides the color channels by alpha while swizzling.  Pixels with zero
+ * alpha become transparent black and channels larger than alpha saturate.
+ */
+bool UnpremultiplyData(const uint8_t* aSrc, int32_t aSrcStride,
+                       SurfaceFormat aSrcFormat,
+                       uint8_t* aDst, int32_t aDstStride,
+                       SurfaceFormat aDstFormat,
+                       const IntSize& aSize);
+
+/**
+ * Drops the fourth byte of each 32-bit pixel, writing 3-byte pixels in
+ * aDstFormat order.  Alpha is dropped as is, without unpremultiplying.
+ */
+bool PackToRGB24(const uint8_t* aSrc, int32_t aSrcStride,
+                 SurfaceFormat aSrcFormat,
+                 uint8_t* aDst, int32_t aDstStride,
+                 PackedFormat aDstFormat,
+                 const IntSize& aSize);
+
+/**
+ * Expands 3-byte pixels into 32-bit pixels with alpha set to 0xFF.
+ */
+bool UnpackFromRGB24(const uint8_t* aSrc, int32_t aSrcStride,
+                     PackedFormat aSrcFormat,
+                     uint8_t* aDst, int32_t aDstStride,
+                     SurfaceFormat aDstFormat,
+                     const IntSize& aSize);
+
+}
+}
+
+#endif /* MOZILLA_GFX_SWIZZLE_H_ */
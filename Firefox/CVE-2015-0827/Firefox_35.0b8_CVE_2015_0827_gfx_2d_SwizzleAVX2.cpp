@@ -0,0 +1,144 @@
+/* -*- Mode: C++; tab-width: 20; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdint.h>
+#include <immintrin.h>
+
+// This file is compiled with AVX2 enabled; Swizzle.cpp only calls into it
+// after checking the CPU supports AVX2.  The byte shuffles and the 8-to-16
+// bit unpacks work within each 128-bit lane, which is all a pixel needs, so
+// these are the SSSE3 loops on eight pixels at a time.
+
+namespace mozilla {
+namespace gfx {
+
+extern const uint16_t gUnpremultiplyTable[256];
+
+static inline __m256i
+SwizzleMask(bool aSwapRB)
+{
+  return aSwapRB ? _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                    10, 9, 8, 11, 14, 13, 12, 15,
+                                    2, 1, 0, 3, 6, 5, 4, 7,
+                                    10, 9, 8, 11, 14, 13, 12, 15)
+                 : _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                    8, 9, 10, 11, 12, 13, 14, 15,
+                                    0, 1, 2, 3, 4, 5, 6, 7,
+                                    8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+int32_t
+SwizzleRow_AVX2(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                bool aSwapRB, bool aOpaque)
+{
+  const __m256i shuffle = SwizzleMask(aSwapRB);
+  const __m256i fill = aOpaque ? _mm256_set1_epi32(0xFF000000)
+                               : _mm256_setzero_si256();
+
+  int32_t i = 0;
+  for (; i + 8 <= aLength; i += 8) {
+    __m256i px =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aSrc + 4 * i));
+    px = _mm256_or_si256(_mm256_shuffle_epi8(px, shuffle), fill);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(aDst + 4 * i), px);
+  }
+  return i;
+}
+
+static inline __m256i
+PremultiplyWords(__m256i aColor, __m256i aAlpha)
+{
+  __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(aColor, aAlpha),
+                               _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+int32_t
+PremultiplyRow_AVX2(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                    bool aSwapRB, bool aOpaque)
+{
+  const __m256i shuffle = SwizzleMask(aSwapRB);
+  const __m256i alphaMask = _mm256_set1_epi32(0xFF000000);
+  const __m256i fill = aOpaque ? alphaMask : _mm256_setzero_si256();
+  const __m256i zero = _mm256_setzero_si256();
+
+  int32_t i = 0;
+  for (; i + 8 <= aLength; i += 8) {
+    __m256i px =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aSrc + 4 * i));
+    px = _mm256_shuffle_epi8(px, shuffle);
+
+    __m256i lo = _mm256_unpacklo_epi8(px, zero);
+    __m256i hi = _mm256_unpackhi_epi8(px, zero);
+    __m256i alphaLo =
+      _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, 0xFF), 0xFF);
+    __m256i alphaHi =
+      _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, 0xFF), 0xFF);
+    __m256i color = _mm256_packus_epi16(PremultiplyWords(lo, alphaLo),
+                                        PremultiplyWords(hi, alphaHi));
+
+    px = _mm256_or_si256(_mm256_andnot_si256(alphaMask, color),
+                         _mm256_and_si256(alphaMask, px));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(aDst + 4 * i),
+                        _mm256_or_si256(px, fill));
+  }
+  return i;
+}
+
+static inline __m256i
+UnpremultiplyWords(__m256i aColorShifted, __m256i aRecip)
+{
+  const __m256i clamp = _mm256_set1_epi16(int16_t(0xFF00));
+  __m256i hi = _mm256_mulhi_epu16(aColorShifted, aRecip);
+  __m256i lo = _mm256_mullo_epi16(aColorShifted, aRecip);
+  // Round by adding the top bit of the low half of the 32-bit product.
+  __m256i v = _mm256_add_epi16(hi, _mm256_srli_epi16(lo, 15));
+  return _mm256_subs_epu16(_mm256_adds_epu16(v, clamp), clamp);
+}
+
+int32_t
+UnpremultiplyRow_AVX2(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                      bool aSwapRB, bool aOpaque)
+{
+  const __m256i shuffle = SwizzleMask(aSwapRB);
+  const __m256i alphaMask = _mm256_set1_epi32(0xFF000000);
+  const __m256i fill = aOpaque ? alphaMask : _mm256_setzero_si256();
+  const __m256i zero = _mm256_setzero_si256();
+
+  int32_t i = 0;
+  for (; i + 8 <= aLength; i += 8) {
+    const uint8_t* src = aSrc + 4 * i;
+    uint16_t r[8];
+    for (int p = 0; p < 8; ++p) {
+      r[p] = gUnpremultiplyTable[src[4 * p + 3]];
+    }
+    // Pixels 0-1 and 4-5 unpack into the low half of each lane, pixels 2-3
+    // and 6-7 into the high half.
+    __m256i recipLo = _mm256_setr_epi16(r[0], r[0], r[0], r[0],
+                                        r[1], r[1], r[1], r[1],
+                                        r[4], r[4], r[4], r[4],
+                                        r[5], r[5], r[5], r[5]);
+    __m256i recipHi = _mm256_setr_epi16(r[2], r[2], r[2], r[2],
+                                        r[3], r[3], r[3], r[3],
+                                        r[6], r[6], r[6], r[6],
+                                        r[7], r[7], r[7], r[7]);
+
+    __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+    px = _mm256_shuffle_epi8(px, shuffle);
+
+    __m256i color = _mm256_packus_epi16(
+      UnpremultiplyWords(_mm256_unpacklo_epi8(zero, px), recipLo),
+      UnpremultiplyWords(_mm256_unpackhi_epi8(zero, px), recipHi));
+
+    px = _mm256_or_si256(_mm256_andnot_si256(alphaMask, color),
+                         _mm256_and_si256(alphaMask, px));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(aDst + 4 * i),
+                        _mm256_or_si256(px, fill));
+  }
+  return i;
+}
+
+}
+}
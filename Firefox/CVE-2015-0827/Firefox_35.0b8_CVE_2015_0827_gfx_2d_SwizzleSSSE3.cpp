@@ -0,0 +1,204 @@
+/* -*- Mode: C++; tab-width: 20; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cstring>
+#include <stdint.h>
+#include <tmmintrin.h>
+
+// This file is compiled with SSSE3 enabled; Swizzle.cpp only calls into it
+// after checking mozilla::supports_ssse3().
+
+namespace mozilla {
+namespace gfx {
+
+extern const uint16_t gUnpremultiplyTable[256];
+
+// Byte shuffles for four 32-bit pixels, with and without an R/B swap.
+static inline __m128i
+SwizzleMask(bool aSwapRB)
+{
+  return aSwapRB ? _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                 10, 9, 8, 11, 14, 13, 12, 15)
+                 : _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                 8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+static inline __m128i
+AlphaMask()
+{
+  return _mm_set1_epi32(0xFF000000);
+}
+
+int32_t
+SwizzleRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                 bool aSwapRB, bool aOpaque)
+{
+  const __m128i shuffle = SwizzleMask(aSwapRB);
+  const __m128i fill = aOpaque ? AlphaMask() : _mm_setzero_si128();
+
+  int32_t i = 0;
+  for (; i + 4 <= aLength; i += 4) {
+    __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aSrc + 4 * i));
+    px = _mm_or_si128(_mm_shuffle_epi8(px, shuffle), fill);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(aDst + 4 * i), px);
+  }
+  return i;
+}
+
+// Computes round(c * a / 255) for the eight 16-bit channels in aColor,
+// with the matching alpha of each pixel broadcast in aAlpha.
+static inline __m128i
+PremultiplyWords(__m128i aColor, __m128i aAlpha)
+{
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(aColor, aAlpha),
+                            _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+int32_t
+PremultiplyRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                     bool aSwapRB, bool aOpaque)
+{
+  const __m128i shuffle = SwizzleMask(aSwapRB);
+  const __m128i alphaMask = AlphaMask();
+  const __m128i fill = aOpaque ? alphaMask : _mm_setzero_si128();
+  const __m128i zero = _mm_setzero_si128();
+
+  int32_t i = 0;
+  for (; i + 4 <= aLength; i += 4) {
+    __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aSrc + 4 * i));
+    px = _mm_shuffle_epi8(px, shuffle);
+
+    __m128i lo = _mm_unpacklo_epi8(px, zero);
+    __m128i hi = _mm_unpackhi_epi8(px, zero);
+    __m128i alphaLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+    __m128i alphaHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+    __m128i color = _mm_packus_epi16(PremultiplyWords(lo, alphaLo),
+                                     PremultiplyWords(hi, alphaHi));
+
+    // Keep the original alpha bytes.
+    px = _mm_or_si128(_mm_andnot_si128(alphaMask, color),
+                      _mm_and_si128(alphaMask, px));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(aDst + 4 * i),
+                     _mm_or_si128(px, fill));
+  }
+  return i;
+}
+
+// Computes min(((c << 8) * r + 0x8000) >> 16, 255) for eight 16-bit channels,
+// where aColorShifted already holds c << 8.
+static inline __m128i
+UnpremultiplyWords(__m128i aColorShifted, __m128i aRecip)
+{
+  const __m128i clamp = _mm_set1_epi16(int16_t(0xFF00));
+  __m128i hi = _mm_mulhi_epu16(aColorShifted, aRecip);
+  __m128i lo = _mm_mullo_epi16(aColorShifted, aRecip);
+  // Round by adding the top bit of the low half of the 32-bit product.
+  __m128i v = _mm_add_epi16(hi, _mm_srli_epi16(lo, 15));
+  return _mm_subs_epu16(_mm_adds_epu16(v, clamp), clamp);
+}
+
+int32_t
+UnpremultiplyRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                       bool aSwapRB, bool aOpaque)
+{
+  const __m128i shuffle = SwizzleMask(aSwapRB);
+  const __m128i alphaMask = AlphaMask();
+  const __m128i fill = aOpaque ? alphaMask : _mm_setzero_si128();
+  const __m128i zero = _mm_setzero_si128();
+
+  int32_t i = 0;
+  for (; i + 4 <= aLength; i += 4) {
+    const uint8_t* src = aSrc + 4 * i;
+    // There is no division, so look up each pixel's reciprocal.
+    uint16_t r0 = gUnpremultiplyTable[src[3]];
+    uint16_t r1 = gUnpremultiplyTable[src[7]];
+    uint16_t r2 = gUnpremultiplyTable[src[11]];
+    uint16_t r3 = gUnpremultiplyTable[src[15]];
+    __m128i recipLo = _mm_setr_epi16(r0, r0, r0, r0, r1, r1, r1, r1);
+    __m128i recipHi = _mm_setr_epi16(r2, r2, r2, r2, r3, r3, r3, r3);
+
+    __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    px = _mm_shuffle_epi8(px, shuffle);
+
+    __m128i color =
+      _mm_packus_epi16(UnpremultiplyWords(_mm_unpacklo_epi8(zero, px), recipLo),
+                       UnpremultiplyWords(_mm_unpackhi_epi8(zero, px), recipHi));
+
+    px = _mm_or_si128(_mm_andnot_si128(alphaMask, color),
+                      _mm_and_si128(alphaMask, px));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(aDst + 4 * i),
+                     _mm_or_si128(px, fill));
+  }
+  return i;
+}
+
+// Sixteen pixels go in and out at a time so that every load and store of
+// the 3-byte side is a full, non-overlapping 16 bytes.
+
+int32_t
+PackRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+              bool aSwapRB)
+{
+  const __m128i shuffle =
+    aSwapRB ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                            -1, -1, -1, -1)
+            : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                            -1, -1, -1, -1);
+
+  int32_t i = 0;
+  for (; i + 16 <= aLength; i += 16) {
+    const __m128i* src = reinterpret_cast<const __m128i*>(aSrc + 4 * i);
+    __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128(src), shuffle);
+    __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128(src + 1), shuffle);
+    __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128(src + 2), shuffle);
+    __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128(src + 3), shuffle);
+
+    __m128i* dst = reinterpret_cast<__m128i*>(aDst + 3 * i);
+    _mm_storeu_si128(dst, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+    _mm_storeu_si128(dst + 1, _mm_or_si128(_mm_srli_si128(p1, 4),
+                                           _mm_slli_si128(p2, 8)));
+    _mm_storeu_si128(dst + 2, _mm_or_si128(_mm_srli_si128(p2, 8),
+                                           _mm_slli_si128(p3, 4)));
+  }
+  return i;
+}
+
+int32_t
+UnpackRow_SSSE3(const uint8_t* aSrc, uint8_t* aDst, int32_t aLength,
+                bool aSwapRB)
+{
+  const __m128i shuffle =
+    aSwapRB ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                            8, 7, 6, -1, 11, 10, 9, -1)
+            : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                            6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alphaMask = AlphaMask();
+
+  int32_t i = 0;
+  for (; i + 16 <= aLength; i += 16) {
+    const __m128i* src = reinterpret_cast<const __m128i*>(aSrc + 3 * i);
+    __m128i s0 = _mm_loadu_si128(src);
+    __m128i s1 = _mm_loadu_si128(src + 1);
+    __m128i s2 = _mm_loadu_si128(src + 2);
+
+    __m128i* dst = reinterpret_cast<__m128i*>(aDst + 4 * i);
+    _mm_storeu_si128(dst, _mm_or_si128(_mm_shuffle_epi8(s0, shuffle),
+                                       alphaMask));
+    _mm_storeu_si128(dst + 1,
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(s1, s0, 12),
+                                                   shuffle), alphaMask));
+    _mm_storeu_si128(dst + 2,
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(s2, s1, 8),
+                                                   shuffle), alphaMask));
+    _mm_storeu_si128(dst + 3,
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(s2, 4),
+                                                   shuffle), alphaMask));
+  }
+  return i;
+}
+
+}
+}
@@ -13,8 +13,14 @@
 
 #ifdef XP_WIN
 #include <winsock2.h>
+#include <io.h>
 #else
 #include <netinet/in.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 
@@ -54,6 +60,37 @@ static int mar_insert_item(MarFile *mar, const char *name, int namelen,
       root = root->next;
     root->next = item;
   }
+  ++mar->item_count;
+  return 0;
+}
+
+static int mar_compare_items(const void *a, const void *b) {
+  const MarItem *x = *(const MarItem * const *) a;
+  const MarItem *y = *(const MarItem * const *) b;
+
+  if (x->offset != y->offset)
+    return x->offset < y->offset ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+/* Builds mar->index, the items in the order they are stored in the file. */
+static int mar_build_index(MarFile *mar) {
+  MarItem *item;
+  uint32_t i, n = 0;
+
+  if (!mar->item_count)
+    return 0;
+
+  mar->index = (MarItem **) malloc(mar->item_count * sizeof(MarItem *));
+  if (!mar->index)
+    return -1;
+
+  for (i = 0; i < TABLESIZE; ++i) {
+    for (item = mar->item_table[i]; item; item = item->next)
+      mar->index[n++] = item;
+  }
+
+  qsort(mar->index, n, sizeof(MarItem *), mar_compare_items);
   return 0;
 }
 
@@ -89,12 +126,10 @@ static int mar_consume_index(MarFile *mar, char **buf, const char *buf_end) {
   flags = ntohl(flags);
 
   name = *buf;
-  /* find namelen; must take care not to read beyond buf_end */
-  while (**buf) {
-    if (*buf == buf_end)
-      return -1;
+  /* find namelen; must take care not to read beyond buf_end, which may be
+     the end of the mapping */
+  while (*buf != buf_end && **buf)
     ++(*buf);
-  }
   namelen = (*buf - name);
   /* consume null byte */
   if (*buf == buf_end)
@@ -104,10 +139,46 @@ static int mar_consume_index(MarFile *mar, char **buf, const char *buf_end) {
   return mar_insert_item(mar, name, namelen, offset, length, flags);
 }
 
+/* Reads the index straight out of the mapping. */
+static int mar_read_mapped_index(MarFile *mar) {
+  char *bufptr, *bufend;
+  uint32_t offset_to_index, size_of_index;
+
+  /* verify MAR ID */
+  if (mar->size < MAR_ID_SIZE + sizeof(uint32_t))
+    return -1;
+  if (memcmp(mar->data, MAR_ID, MAR_ID_SIZE) != 0)
+    return -1;
+
+  memcpy(&offset_to_index, mar->data + MAR_ID_SIZE, sizeof(uint32_t));
+  offset_to_index = ntohl(offset_to_index);
+
+  if (offset_to_index > mar->size - sizeof(uint32_t))
+    return -1;
+  memcpy(&size_of_index, mar->data + offset_to_index, sizeof(uint32_t));
+  size_of_index = ntohl(size_of_index);
+  if (size_of_index > mar->size - offset_to_index - sizeof(uint32_t))
+    return -1;
+
+  /* mar_consume_index only reads through bufptr, and never at or past
+     bufend, which may be the end of the mapping. */
+  bufptr = (char *) mar->data + offset_to_index + sizeof(uint32_t);
+  bufend = bufptr + size_of_index;
+  while (bufptr < bufend) {
+    if (mar_consume_index(mar, &bufptr, bufend) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
 static int mar_read_index(MarFile *mar) {
   char id[MAR_ID_SIZE], *buf, *bufptr, *bufend;
   uint32_t offset_to_index, size_of_index;
 
+  if (mar->data)
+    return mar_read_mapped_index(mar);
+
   /* verify MAR ID */
   if (fread(id, MAR_ID_SIZE, 1, mar->fp) != 1)
     return -1;
@@ -134,10 +205,40 @@ static int mar_read_index(MarFile *mar) {
 
   bufptr = buf;
   bufend = buf + size_of_index;
-  while (bufptr < bufend && mar_consume_index(mar, &bufptr, bufend) == 0);
+  while (bufptr < bufend) {
+    if (mar_consume_index(mar, &bufptr, bufend) != 0) {
+      free(buf);
+      return -1;
+    }
+  }
 
   free(buf);
-  return (bufptr == bufend) ? 0 : -1;
+  return 0;
+}
+
+/**
+ * Maps the whole file if it can, so that items can be read without going
+ * through fp and from several threads at once. Reading falls back to fp
+ * when this fails.
+ */
+static void mar_map(MarFile *mar)
+{
+#ifndef XP_WIN
+  struct stat st;
+  void *data;
+
+  if (fstat(fileno(mar->fp), &st) || !S_ISREG(st.st_mode) ||
+      st.st_size <= 0 || (uint64_t) st.st_size > SIZE_MAX)
+    return;
+
+  data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+              fileno(mar->fp), 0);
+  if (data == MAP_FAILED)
+    return;
+
+  mar->data = (const char *) data;
+  mar->size = (size_t) st.st_size;
+#endif
 }
 
 /**
@@ -155,8 +256,13 @@ static MarFile *mar_fpopen(FILE *fp)
   }
 
   mar->fp = fp;
+  mar->data = NULL;
+  mar->size = 0;
+  mar->index = NULL;
+  mar->item_count = 0;
   memset(mar->item_table, 0, sizeof(mar->item_table));
-  if (mar_read_index(mar)) {
+  mar_map(mar);
+  if (mar_read_index(mar) || mar_build_index(mar)) {
     mar_close(mar);
     return NULL;
   }
@@ -197,6 +303,11 @@ void mar_close(MarFile *mar) {
   int i;
 
   fclose(mar->fp);
+#ifndef XP_WIN
+  if (mar->data)
+    munmap((void *) mar->data, mar->size);
+#endif
+  free(mar->index);
 
   for (i = 0; i < TABLESIZE; ++i) {
     item = mar->item_table[i];
@@ -492,18 +603,14 @@ const MarItem *mar_find_item(MarFile *mar, const char *name) {
   return item;
 }
 
+/* Items are enumerated in the order they are stored in the file. */
 int mar_enum_items(MarFile *mar, MarItemCallback callback, void *closure) {
-  MarItem *item;
-  int i;
+  uint32_t i;
 
-  for (i = 0; i < TABLESIZE; ++i) {
-    item = mar->item_table[i];
-    while (item) {
-      int rv = callback(mar, item, closure);
-      if (rv)
-        return rv;
-      item = item->next;
-    }
+  for (i = 0; i < mar->item_count; ++i) {
+    int rv = callback(mar, mar->index[i], closure);
+    if (rv)
+      return rv;
   }
 
   return 0;
@@ -522,12 +629,255 @@ int mar_read(MarFile *mar, const MarItem *item, int offset, char *buf,
   if (nr > bufsize)
     nr = bufsize;
 
+  if (mar->data) {
+    /* Like fread, stop short at the end of the file. */
+    uint64_t pos = (uint64_t) item->offset + offset;
+    if (pos >= mar->size)
+      return 0;
+    if ((uint64_t) nr > mar->size - pos)
+      nr = (int) (mar->size - pos);
+    memcpy(buf, mar->data + pos, nr);
+    return nr;
+  }
+
   if (fseek(mar->fp, item->offset + offset, SEEK_SET))
     return -1;
 
   return fread(buf, 1, nr, mar->fp);
 }
 
+/* Writes the whole item to fd one block at a time through mar_read. */
+static int mar_extract_item(MarFile *mar, const MarItem *item, int fd) {
+  char buf[BLOCKSIZE];
+  int offset = 0, nr;
+
+  while ((nr = mar_read(mar, item, offset, buf, sizeof(buf))) > 0) {
+#ifdef XP_WIN
+    if (_write(fd, buf, nr) != nr)
+      return -1;
+#else
+    const char *p = buf;
+    int left = nr;
+    while (left) {
+      ssize_t nw = write(fd, p, left);
+      if (nw < 0 && errno == EINTR)
+        continue;
+      if (nw <= 0)
+        return -1;
+      p += nw;
+      left -= nw;
+    }
+#endif
+    offset += nr;
+  }
+
+  return (nr == 0 && offset == (int) item->length) ? 0 : -1;
+}
+
+#ifndef XP_WIN
+/* Items are copied in chunks of this size so that a large item is spread
+   over the threads too. */
+#define MAR_EXTRACT_CHUNK (1024 * 1024)
+
+typedef struct {
+  const MarItem *item;
+  int fd;
+} MarExtractJob;
+
+typedef struct {
+  MarFile *mar;
+  MarExtractJob *jobs;
+  int count;
+  /* The next chunk to copy is chunk next_chunk of jobs[next_job]. */
+  int next_job;
+  uint32_t next_chunk;
+  int failed;
+  pthread_mutex_t lock;
+} MarExtractQueue;
+
+typedef struct {
+  MarFile *mar;
+  MarVerifyCallback verify;
+  void *closure;
+  int rv;
+} MarVerifyJob;
+
+static int mar_compare_jobs(const void *a, const void *b) {
+  const MarExtractJob *x = (const MarExtractJob *) a;
+  const MarExtractJob *y = (const MarExtractJob *) b;
+
+  if (x->item->offset != y->item->offset)
+    return x->item->offset < y->item->offset ? -1 : 1;
+  return 0;
+}
+
+static int mar_pwrite_all(int fd, const char *buf, uint32_t len,
+                          uint32_t offset) {
+  while (len) {
+    ssize_t nw = pwrite(fd, buf, len, (off_t) offset);
+    if (nw < 0 && errno == EINTR)
+      continue;
+    if (nw <= 0)
+      return -1;
+    buf += nw;
+    len -= nw;
+    offset += nw;
+  }
+  return 0;
+}
+
+static void *mar_extract_thread(void *arg) {
+  MarExtractQueue *queue = (MarExtractQueue *) arg;
+
+  for (;;) {
+    const MarExtractJob *job;
+    uint32_t start, len;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->next_job < queue->count &&
+           (uint64_t) queue->next_chunk * MAR_EXTRACT_CHUNK >=
+           queue->jobs[queue->next_job].item->length) {
+      ++queue->next_job;
+      queue->next_chunk = 0;
+    }
+    if (queue->failed || queue->next_job == queue->count) {
+      pthread_mutex_unlock(&queue->lock);
+      return NULL;
+    }
+    job = &queue->jobs[queue->next_job];
+    start = queue->next_chunk++ * MAR_EXTRACT_CHUNK;
+    pthread_mutex_unlock(&queue->lock);
+
+    len = job->item->length - start;
+    if (len > MAR_EXTRACT_CHUNK)
+      len = MAR_EXTRACT_CHUNK;
+    if (mar_pwrite_all(job->fd, queue->mar->data + job->item->offset + start,
+                       len, start)) {
+      pthread_mutex_lock(&queue->lock);
+      queue->failed = 1;
+      pthread_mutex_unlock(&queue->lock);
+    }
+  }
+}
+
+static void *mar_verify_thread(void *arg) {
+  MarVerifyJob *job = (MarVerifyJob *) arg;
+  job->rv = job->verify(job->mar, job->closure);
+  return NULL;
+}
+
+static int mar_extract_mapped(MarFile *mar, const MarItem **items,
+                              const int *fds, int count, int threads,
+                              MarVerifyCallback verify, void *closure) {
+  MarExtractQueue queue;
+  MarVerifyJob verify_job;
+  pthread_t verifier, *workers = NULL;
+  uintptr_t page_mask = (uintptr_t) sysconf(_SC_PAGESIZE) - 1;
+  int i, started = 0, verifying = 0;
+
+  queue.jobs = (MarExtractJob *) malloc((count ? count : 1) *
+                                        sizeof(MarExtractJob));
+  if (!queue.jobs)
+    return -1;
+
+  for (i = 0; i < count; ++i) {
+    if (items[i]->offset > mar->size ||
+        items[i]->length > mar->size - items[i]->offset) {
+      free(queue.jobs);
+      return -1;
+    }
+    queue.jobs[i].item = items[i];
+    queue.jobs[i].fd = fds[i];
+  }
+
+  /* Copy in file order and have the kernel start reading ahead of us. */
+  qsort(queue.jobs, count, sizeof(MarExtractJob), mar_compare_jobs);
+  for (i = 0; i < count; ++i) {
+    uintptr_t start = (uintptr_t) (mar->data + queue.jobs[i].item->offset);
+    uintptr_t end = start + queue.jobs[i].item->length;
+    if (end > start)
+      madvise((void *) (start & ~page_mask), end - (start & ~page_mask),
+              MADV_WILLNEED);
+  }
+
+  queue.mar = mar;
+  queue.count = count;
+  queue.next_job = 0;
+  queue.next_chunk = 0;
+  queue.failed = 0;
+  pthread_mutex_init(&queue.lock, NULL);
+
+  /* Verification reads through fp, which extraction doesn't touch. */
+  if (verify) {
+    verify_job.mar = mar;
+    verify_job.verify = verify;
+    verify_job.closure = closure;
+    verify_job.rv = -1;
+    if (!pthread_create(&verifier, NULL, mar_verify_thread, &verify_job))
+      verifying = 1;
+    else
+      verify_job.rv = verify(mar, closure);
+  }
+
+  if (threads > 1)
+    workers = (pthread_t *) malloc((threads - 1) * sizeof(pthread_t));
+  for (i = 0; workers && i < threads - 1; ++i) {
+    if (pthread_create(&workers[i], NULL, mar_extract_thread, &queue))
+      break;
+    ++started;
+  }
+
+  mar_extract_thread(&queue);
+
+  for (i = 0; i < started; ++i)
+    pthread_join(workers[i], NULL);
+  if (verifying)
+    pthread_join(verifier, NULL);
+
+  pthread_mutex_destroy(&queue.lock);
+  free(workers);
+  free(queue.jobs);
+
+  return (queue.failed || (verify && verify_job.rv)) ? -1 : 0;
+}
+#endif
+
+/**
+ * Writes the contents of items[i] to fds[i], an empty file opened for
+ * writing, for each of the count items, using up to threads threads.
+ * verify, if not NULL, is run on the MAR while the items are written; it
+ * is passed closure and returns 0 if the MAR is good. It may use mar->fp.
+ *
+ * The output is only good if this returns 0. When verify is given, the
+ * items are written before it has finished, so on failure the caller must
+ * discard everything written.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int mar_extract_items(MarFile *mar, const MarItem **items, const int *fds,
+                      int count, int threads, MarVerifyCallback verify,
+                      void *closure) {
+  int i;
+
+  if (count < 0)
+    return -1;
+
+#ifndef XP_WIN
+  if (mar->data)
+    return mar_extract_mapped(mar, items, fds, count, threads, verify,
+                              closure);
+#endif
+
+  /* Reading goes through fp, which verification needs too. */
+  if (verify && verify(mar, closure))
+    return -1;
+  for (i = 0; i < count; ++i) {
+    if (mar_extract_item(mar, items[i], fds[i]))
+      return -1;
+  }
+  return 0;
+}
+
 /**
  * Determines the MAR file information.
  *
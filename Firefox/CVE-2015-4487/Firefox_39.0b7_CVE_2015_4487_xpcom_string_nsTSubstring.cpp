@@ -5,6 +5,7 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "mozilla/double-conversion.h"
+#include "mozilla/MathAlgorithms.h"
 #include "mozilla/MemoryReporting.h"
 
 using double_conversion::DoubleToStringConverter;
@@ -35,6 +36,31 @@ AsFixedString(const nsTSubstring_CharT* aStr)
 }
 
 
+/* hack to make sure we define StringBufferStorageSize only once */
+#ifdef CharT_is_PRUnichar
+/**
+ * Given the storage size wanted for an nsStringBuffer, returns the largest
+ * storage size that costs the same.  The allocator rounds each request up
+ * to a size class (jemalloc: 16 byte steps up to 512 bytes, powers of two up
+ * to 2KB, then whole pages), and any slack past the characters is usable
+ * capacity we would otherwise throw away.
+ */
+static size_t
+StringBufferStorageSize(size_t aStorageSize)
+{
+  size_t size = sizeof(nsStringBuffer) + aStorageSize;
+  if (size <= 512) {
+    size = (size + 15) & ~size_t(15);
+  } else if (size <= 2048) {
+    size = mozilla::RoundUpPow2(size);
+  } else if (size <= 1024 * 1024) {
+    size = (size + 4095) & ~size_t(4095);
+  }
+  // Past 1MB the buffers are sized by the growth policy in MutatePrep.
+  return size - sizeof(nsStringBuffer);
+}
+#endif /* CharT_is_PRUnichar */
+
 /**
  * this function is called to prepare mData for writing.  the given capacity
  * indicates the required minimum storage size for mData, in sizeof(char_type)
@@ -75,10 +101,22 @@ nsTSubstring_CharT::MutatePrep(size_type aCapacity, char_type** aOldData,
       return true;
     }
 
-    // Use doubling algorithm when forced to increase available capacity.
-    size_type temp = curCapacity;
-    while (temp < aCapacity) {
-      temp <<= 1;
+    // Grow exponentially so that appending is amortized O(1).  Below the
+    // threshold the whole allocation (nsStringBuffer header, characters and
+    // null terminator) goes to the next power of two, which is exactly a
+    // size class.  Above it we grow by at least 1/8th, rounded up to whole
+    // MB, so that huge strings don't carry up to 100% slack.
+    const size_type kSlowGrowthThreshold = 8 * 1024 * 1024;
+    const size_type kExtraSpace =
+      sizeof(nsStringBuffer) / sizeof(char_type) + 1;
+    size_type temp;
+    if (aCapacity >= kSlowGrowthThreshold) {
+      size_type minNewCapacity = curCapacity + (curCapacity >> 3);
+      temp = XPCOM_MAX(aCapacity, minNewCapacity) + kExtraSpace;
+      const size_type kMiB = 1 << 20;
+      temp = kMiB * ((temp + kMiB - 1) / kMiB) - kExtraSpace;
+    } else {
+      temp = mozilla::RoundUpPow2(aCapacity + kExtraSpace) - kExtraSpace;
     }
     NS_ASSERTION(XPCOM_MIN(temp, kMaxCapacity) >= aCapacity,
                  "should have hit the early return at the top");
@@ -97,13 +135,21 @@ nsTSubstring_CharT::MutatePrep(size_type aCapacity, char_type** aOldData,
   // a new buffer complicates things just a bit ;-)
   //
 
+  // a heap buffer also gets whatever slack its size class leaves, so that
+  // short strings can take a few appends without reallocating.  the result
+  // is a whole number of characters, and never less than we asked for.
   size_type storageSize = (aCapacity + 1) * sizeof(char_type);
+  size_type heapStorageSize =
+    StringBufferStorageSize(storageSize) / sizeof(char_type) * sizeof(char_type);
+  if (heapStorageSize / sizeof(char_type) - 1 > kMaxCapacity) {
+    heapStorageSize = storageSize;
+  }
 
   // case #1
   if (mFlags & F_SHARED) {
     nsStringBuffer* hdr = nsStringBuffer::FromData(mData);
     if (!hdr->IsReadonly()) {
-      nsStringBuffer* newHdr = nsStringBuffer::Realloc(hdr, storageSize);
+      nsStringBuffer* newHdr = nsStringBuffer::Realloc(hdr, heapStorageSize);
       if (!newHdr) {
         return false;  // out-of-memory (original header left intact)
       }
@@ -130,7 +176,7 @@ nsTSubstring_CharT::MutatePrep(size_type aCapacity, char_type** aOldData,
     // large enough.
 
     nsStringBuffer* newHdr =
-      nsStringBuffer::Alloc(storageSize).take();
+      nsStringBuffer::Alloc(heapStorageSize).take();
     if (!newHdr) {
       return false;  // we are still in a consistent state
     }
@@ -321,6 +321,45 @@ struct block_additional {
   struct block_additional * next;
 };
 
+/* A CueTrackPositions flattened for binary search.  cue is the ordinal of
+   the CuePoint it belongs to. */
+struct cue_entry {
+  uint64_t time;
+  uint64_t cluster_position;
+  size_t cue;
+};
+
+/* The cue points as sorted arrays.  Built on the first lookup and rebuilt if
+   more cue points have been parsed since (tail has changed).  If the cues are
+   out of order or incomplete, usable is 0 and lookups walk the lists. */
+struct cue_index {
+  struct ebml_list_node * tail;
+  int usable;
+  /* Every CueTrackPositions, in file order. */
+  struct cue_entry * positions;
+  size_t position_count;
+  /* Per track, the first CueTrackPositions for it in each CuePoint. */
+  struct cue_entry * track_positions;
+  size_t * track_counts;
+  size_t cue_count;
+  unsigned int track_count;
+};
+
+/* Clusters seen so far, sorted by offset.  Filled in as clusters are parsed
+   during playback and by seeks in files without cues. */
+struct cluster_entry {
+  int64_t offset;
+  uint64_t timecode;
+};
+
+struct cluster_index {
+  struct cluster_entry * entries;
+  size_t count;
+  size_t capacity;
+  /* Set if timecodes were found not to increase with offset. */
+  int unordered;
+};
+
 /* Public (opaque) Structures */
 struct nestegg {
   nestegg_io * io;
@@ -328,12 +367,17 @@ struct nestegg {
   struct pool_ctx * alloc_pool;
   uint64_t last_id;
   uint64_t last_size;
+  uint64_t last_header_length;
   int last_valid;
   struct list_node * ancestor;
   struct ebml ebml;
   struct segment segment;
   int64_t segment_offset;
   unsigned int track_count;
+  /* Offset of the Cluster being parsed, until its Timecode is indexed. */
+  int64_t cluster_offset;
+  struct cue_index cue_index;
+  struct cluster_index cluster_index;
 };
 
 struct nestegg_packet {
@@ -891,6 +935,7 @@ static int
 ne_peek_element(nestegg * ctx, uint64_t * id, uint64_t * size)
 {
   int r;
+  uint64_t id_length, size_length;
 
   if (ctx->last_valid) {
     if (id)
@@ -900,14 +945,16 @@ ne_peek_element(nestegg * ctx, uint64_t * id, uint64_t * size)
     return 1;
   }
 
-  r = ne_read_id(ctx->io, &ctx->last_id, NULL);
+  r = ne_read_id(ctx->io, &ctx->last_id, &id_length);
   if (r != 1)
     return r;
 
-  r = ne_read_vint(ctx->io, &ctx->last_size, NULL);
+  r = ne_read_vint(ctx->io, &ctx->last_size, &size_length);
   if (r != 1)
     return r;
 
+  ctx->last_header_length = id_length + size_length;
+
   if (id)
     *id = ctx->last_id;
   if (size)
@@ -1030,6 +1077,46 @@ ne_read_simple(nestegg * ctx, struct ebml_element_desc * desc, size_t length)
   return r;
 }
 
+static int
+ne_index_cluster(nestegg * ctx, int64_t offset, uint64_t timecode)
+{
+  struct cluster_index * index = &ctx->cluster_index;
+  struct cluster_entry * entries;
+  size_t lo = 0, hi = index->count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (index->entries[mid].offset < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo < index->count && index->entries[lo].offset == offset)
+    return 0;
+
+  if ((lo > 0 && index->entries[lo - 1].timecode > timecode) ||
+      (lo < index->count && index->entries[lo].timecode < timecode))
+    index->unordered = 1;
+
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 64;
+    entries = realloc(index->entries, capacity * sizeof(*entries));
+    if (!entries)
+      return -1;
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+
+  memmove(&index->entries[lo + 1], &index->entries[lo],
+          (index->count - lo) * sizeof(*index->entries));
+  index->entries[lo].offset = offset;
+  index->entries[lo].timecode = timecode;
+  index->count += 1;
+
+  return 0;
+}
+
 static int
 ne_parse(nestegg * ctx, struct ebml_element_desc * top_level, int64_t max_offset)
 {
@@ -1066,6 +1153,12 @@ ne_parse(nestegg * ctx, struct ebml_element_desc * top_level, int64_t max_offset
         break;
       assert(id == peeked_id);
 
+      if (id == ID_CLUSTER) {
+        ctx->cluster_offset = ne_io_tell(ctx->io);
+        if (ctx->cluster_offset >= 0)
+          ctx->cluster_offset -= ctx->last_header_length;
+      }
+
       if (element->flags & DESC_FLAG_OFFSET) {
         data_offset = (int64_t *) (ctx->ancestor->data + element->data_offset);
         *data_offset = ne_io_tell(ctx->io);
@@ -1088,6 +1181,15 @@ ne_parse(nestegg * ctx, struct ebml_element_desc * top_level, int64_t max_offset
         r = ne_read_simple(ctx, element, size);
         if (r < 0)
           break;
+
+        if (id == ID_TIMECODE && ctx->cluster_offset >= 0 &&
+            ctx->ancestor->node == ne_cluster_elements) {
+          uint64_t timecode;
+          struct cluster * cluster = (struct cluster *) ctx->ancestor->data;
+          if (ne_get_uint(cluster->timecode, &timecode) == 0)
+            ne_index_cluster(ctx, ctx->cluster_offset, timecode);
+          ctx->cluster_offset = -1;
+        }
       }
     } else if (ne_is_ancestor_element(id, ctx->ancestor->previous)) {
       ctx->log(ctx, NESTEGG_LOG_DEBUG, "parent element %llx", id);
@@ -1704,6 +1806,239 @@ ne_find_cue_point_for_tstamp(nestegg * ctx, struct ebml_list_node * cue_point, u
   return prev;
 }
 
+static void
+ne_free_cue_index(struct cue_index * index)
+{
+  free(index->positions);
+  free(index->track_positions);
+  free(index->track_counts);
+  memset(index, 0, sizeof(*index));
+}
+
+/* Builds ctx->cue_index from the parsed cue points.  The index is only usable
+   if it gives the same answers as walking the lists, which needs every cue
+   point to have a time, the times to be in order, and every
+   CueTrackPositions to have a known track and a cluster position. */
+static struct cue_index *
+ne_get_cue_index(nestegg * ctx)
+{
+  struct cue_index * index = &ctx->cue_index;
+  struct ebml_list_node * node, * pos_node;
+  struct cue_point * c;
+  struct cue_track_positions * pos;
+  struct cue_entry * entry, * track_entries;
+  uint64_t time, prev_time = 0, track_number, cluster_position;
+  size_t cue_count = 0, position_count = 0, n;
+  unsigned int t;
+
+  if (index->tail == ctx->segment.cues.cue_point.tail)
+    return index->usable ? index : NULL;
+
+  ne_free_cue_index(index);
+  index->tail = ctx->segment.cues.cue_point.tail;
+
+  for (node = ctx->segment.cues.cue_point.head; node; node = node->next) {
+    c = node->data;
+    cue_count += 1;
+    for (pos_node = c->cue_track_positions.head; pos_node; pos_node = pos_node->next)
+      position_count += 1;
+  }
+
+  if (position_count == 0 || ctx->track_count == 0)
+    return NULL;
+
+  index->cue_count = cue_count;
+  index->track_count = ctx->track_count;
+  index->positions = ne_alloc(position_count * sizeof(*index->positions));
+  index->track_positions = ne_alloc(cue_count * ctx->track_count *
+                                    sizeof(*index->track_positions));
+  index->track_counts = ne_alloc(ctx->track_count * sizeof(*index->track_counts));
+  if (!index->positions || !index->track_positions || !index->track_counts)
+    return NULL;
+
+  for (node = ctx->segment.cues.cue_point.head, n = 0; node; node = node->next, ++n) {
+    assert(node->id == ID_CUE_POINT);
+    c = node->data;
+
+    if (ne_get_uint(c->time, &time) != 0 || time < prev_time)
+      return NULL;
+    prev_time = time;
+
+    for (pos_node = c->cue_track_positions.head; pos_node; pos_node = pos_node->next) {
+      assert(pos_node->id == ID_CUE_TRACK_POSITIONS);
+      pos = pos_node->data;
+
+      if (ne_get_uint(pos->track, &track_number) != 0 ||
+          ne_map_track_number_to_index(ctx, track_number, &t) != 0 ||
+          ne_get_uint(pos->cluster_position, &cluster_position) != 0)
+        return NULL;
+
+      entry = &index->positions[index->position_count++];
+      entry->time = time;
+      entry->cluster_position = cluster_position;
+      entry->cue = n;
+
+      track_entries = &index->track_positions[t * cue_count];
+      if (index->track_counts[t] == 0 ||
+          track_entries[index->track_counts[t] - 1].cue != n)
+        track_entries[index->track_counts[t]++] = *entry;
+    }
+  }
+
+  index->usable = 1;
+  return index;
+}
+
+/* The binary search equivalent of ne_find_cue_point_for_tstamp() followed by
+   ne_find_cue_position_for_track(). */
+static struct cue_entry *
+ne_find_cue_entry_for_tstamp(struct cue_index * index, unsigned int track, uint64_t scale, uint64_t tstamp)
+{
+  struct cue_entry * entries;
+  size_t lo = 0, hi, mid;
+
+  if (track >= index->track_count)
+    return NULL;
+
+  entries = &index->track_positions[track * index->cue_count];
+  hi = index->track_counts[track];
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (entries[mid].time * scale > tstamp)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  if (lo > 0)
+    return &entries[lo - 1];
+
+  /* Every cue point for the track is later than tstamp.  The list walk then
+     settles on the first cue point, which only helps if it has the track. */
+  if (index->track_counts[track] > 0 && entries[0].cue == 0)
+    return &entries[0];
+
+  return NULL;
+}
+
+/* Reads the Timecode of the Cluster whose data starts at the current
+   position and ends at end.  Timecode comes before any blocks. */
+static int
+ne_read_cluster_timecode(nestegg_io * io, int64_t end, uint64_t * timecode)
+{
+  int r;
+  int64_t offset;
+  uint64_t id, size;
+
+  for (;;) {
+    offset = ne_io_tell(io);
+    if (offset < 0 || offset >= end)
+      return -1;
+
+    r = ne_read_id(io, &id, NULL);
+    if (r != 1)
+      return -1;
+    r = ne_read_vint(io, &size, NULL);
+    if (r != 1)
+      return -1;
+
+    if (id == ID_TIMECODE)
+      return ne_read_uint(io, timecode, size) == 1 ? 0 : -1;
+
+    if (id == ID_BLOCK_GROUP || id == ID_SIMPLE_BLOCK)
+      return -1;
+
+    if (ne_io_seek(io, size, NESTEGG_SEEK_CUR) != 0)
+      return -1;
+  }
+}
+
+/* Extends the cluster index past its last entry until it reaches a cluster
+   starting after tstamp, reading only Cluster headers and Timecodes.  Stops
+   early at the end of the stream, at a Cluster of unknown size, or at an
+   element it can't read. */
+static void
+ne_index_clusters_to(nestegg * ctx, uint64_t scale, uint64_t tstamp)
+{
+  struct cluster_index * index = &ctx->cluster_index;
+  struct saved_state state;
+  int64_t offset, data_offset;
+  uint64_t id, size, id_length, size_length, timecode;
+  int r;
+
+  if (index->count == 0 ||
+      index->entries[index->count - 1].timecode * scale > tstamp)
+    return;
+
+  if (ne_ctx_save(ctx, &state) != 0)
+    return;
+
+  offset = index->entries[index->count - 1].offset;
+  for (;;) {
+    if (ne_io_seek(ctx->io, offset, NESTEGG_SEEK_SET) != 0)
+      break;
+
+    r = ne_read_id(ctx->io, &id, &id_length);
+    if (r != 1)
+      break;
+    r = ne_read_vint(ctx->io, &size, &size_length);
+    if (r != 1)
+      break;
+
+    /* An unknown size has every bit of the value set. */
+    if (size == (1ULL << (7 * size_length)) - 1)
+      break;
+    if (id == ID_EBML || id == ID_SEGMENT)
+      break;
+
+    data_offset = offset + id_length + size_length;
+    if (id == ID_CLUSTER && offset > index->entries[index->count - 1].offset) {
+      if (ne_read_cluster_timecode(ctx->io, data_offset + size, &timecode) != 0)
+        break;
+      if (ne_index_cluster(ctx, offset, timecode) != 0)
+        break;
+      if (timecode * scale > tstamp)
+        break;
+    }
+
+    if (size > (uint64_t) (INT64_MAX - data_offset))
+      break;
+    offset = data_offset + size;
+  }
+
+  ne_ctx_restore(ctx, &state);
+}
+
+/* Seeks to the last cluster starting at or before tstamp, or to the first
+   cluster if tstamp is earlier than every cluster. */
+static int
+ne_cluster_index_seek(nestegg * ctx, uint64_t tstamp)
+{
+  struct cluster_index * index = &ctx->cluster_index;
+  uint64_t scale;
+  size_t lo = 0, hi, mid;
+
+  if (index->unordered)
+    return -1;
+
+  scale = ne_get_timecode_scale(ctx);
+  ne_index_clusters_to(ctx, scale, tstamp);
+
+  if (index->count == 0 || index->unordered)
+    return -1;
+
+  hi = index->count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (index->entries[mid].timecode * scale > tstamp)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  return nestegg_offset_seek(ctx, index->entries[lo > 0 ? lo - 1 : 0].offset);
+}
+
 static int
 ne_is_suspend_element(uint64_t id)
 {
@@ -1921,6 +2256,7 @@ nestegg_init(nestegg ** context, nestegg_io io, nestegg_log callback, int64_t ma
   }
   *ctx->io = io;
   ctx->log = callback;
+  ctx->cluster_offset = -1;
   ctx->alloc_pool = ne_pool_init();
   if (!ctx->alloc_pool) {
     nestegg_destroy(ctx);
@@ -1997,6 +2333,8 @@ nestegg_destroy(nestegg * ctx)
   while (ctx->ancestor)
     ne_ctx_pop(ctx);
   ne_pool_destroy(ctx->alloc_pool);
+  ne_free_cue_index(&ctx->cue_index);
+  free(ctx->cluster_index.entries);
   free(ctx->io);
   free(ctx);
 }
@@ -2038,6 +2376,7 @@ nestegg_get_cue_point(nestegg * ctx, unsigned int cluster_num, int64_t max_offse
   unsigned int cluster_count = 0;
   struct cue_point * cue_point;
   struct cue_track_positions * pos;
+  struct cue_index * index;
   uint64_t seek_pos, track_number, tc_scale, time;
   struct ebml_list_node * cues_node = ctx->segment.cues.cue_point.head;
   struct ebml_list_node * cue_pos_node = NULL;
@@ -2063,6 +2402,17 @@ nestegg_get_cue_point(nestegg * ctx, unsigned int cluster_num, int64_t max_offse
 
   tc_scale = ne_get_timecode_scale(ctx);
 
+  index = ne_get_cue_index(ctx);
+  if (index) {
+    if (cluster_num < index->position_count) {
+      *start_pos = ctx->segment_offset + index->positions[cluster_num].cluster_position;
+      *tstamp = index->positions[cluster_num].time * tc_scale;
+    }
+    if (cluster_num + 1 < index->position_count)
+      *end_pos = ctx->segment_offset + index->positions[cluster_num + 1].cluster_position - 1;
+    return 0;
+  }
+
   while (cues_node && !range_obtained) {
     assert(cues_node->id == ID_CUE_POINT);
     cue_point = cues_node->data;
@@ -2135,29 +2485,43 @@ nestegg_track_seek(nestegg * ctx, unsigned int track, uint64_t tstamp)
   int r;
   struct cue_point * cue_point;
   struct cue_track_positions * pos;
+  struct cue_index * index;
+  struct cue_entry * entry;
   uint64_t seek_pos, tc_scale;
 
   /* If there are no cues loaded, check for cues element in the seek head
-     and load it. */
+     and load it.  Without cues, fall back to the clusters seen so far. */
   if (!ctx->segment.cues.cue_point.head) {
     r = ne_init_cue_points(ctx, -1);
-    if (r != 0)
-      return -1;
+    if (r != 0) {
+      r = ne_cluster_index_seek(ctx, tstamp);
+      if (r != 0 || !ne_is_suspend_element(ctx->last_id))
+        return -1;
+      return 0;
+    }
   }
 
   tc_scale = ne_get_timecode_scale(ctx);
 
-  cue_point = ne_find_cue_point_for_tstamp(ctx, ctx->segment.cues.cue_point.head,
-                                           track, tc_scale, tstamp);
-  if (!cue_point)
-    return -1;
+  index = ne_get_cue_index(ctx);
+  if (index) {
+    entry = ne_find_cue_entry_for_tstamp(index, track, tc_scale, tstamp);
+    if (!entry)
+      return -1;
+    seek_pos = entry->cluster_position;
+  } else {
+    cue_point = ne_find_cue_point_for_tstamp(ctx, ctx->segment.cues.cue_point.head,
+                                             track, tc_scale, tstamp);
+    if (!cue_point)
+      return -1;
 
-  pos = ne_find_cue_position_for_track(ctx, cue_point->cue_track_positions.head, track);
-  if (pos == NULL)
-    return -1;
+    pos = ne_find_cue_position_for_track(ctx, cue_point->cue_track_positions.head, track);
+    if (pos == NULL)
+      return -1;
 
-  if (ne_get_uint(pos->cluster_position, &seek_pos) != 0)
-    return -1;
+    if (ne_get_uint(pos->cluster_position, &seek_pos) != 0)
+      return -1;
+  }
 
   /* Seek and set up parser state for segment-level element (Cluster). */
   r = nestegg_offset_seek(ctx, ctx->segment_offset + seek_pos);
@@ -148,6 +148,8 @@ namespace mozilla {
 namespace SSE2 {
 
 void Convert_ascii_run(const char *&src, char16_t *&dst, int32_t len);
+bool Convert_utf8_run(const char *&src, char16_t *&dst, int32_t srclen,
+                      int32_t dstlen);
 
 }
 }
@@ -172,6 +174,24 @@ Convert_ascii_run (const char *&src,
 
 #endif
 
+// Decodes well-formed one to three octet sequences a block at a time,
+// starting at the beginning of a sequence. It stops in front of anything
+// the state machine below has to look at (malformed input, four octet
+// sequences, an incomplete sequence at the end of the buffer). Returns
+// false if nothing was decoded.
+static inline bool
+Convert_utf8_run (const char *&src,
+                  char16_t *&dst,
+                  int32_t srclen,
+                  int32_t dstlen)
+{
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+  if (srclen >= 16 && dstlen >= 16 && mozilla::supports_sse2())
+    return mozilla::SSE2::Convert_utf8_run(src, dst, srclen, dstlen);
+#endif
+  return false;
+}
+
 NS_IMETHODIMP nsUTF8ToUnicode::Convert(const char * aSrc,
                                        int32_t * aSrcLength,
                                        char16_t * aDest,
@@ -218,7 +238,13 @@ NS_IMETHODIMP nsUTF8ToUnicode::Convert(const char * aSrc,
     uint8_t c = *in;
     if (0 == mState) {
       // When mState is zero we expect either a US-ASCII character or a
-      // multi-octet sequence.
+      // multi-octet sequence. A BOM still has to be looked at, so the block
+      // decoder only runs once the first character is out.
+      if (c >= 0xC2 && c < 0xF0 && !mFirst &&
+          Convert_utf8_run(in, out, inend - in, outend - out)) {
+        --in; // match the rest of the cases
+        continue;
+      }
       if (c < 0x80) {  // 00..7F
         int32_t max_loops = std::min(inend - in, outend - out);
         Convert_ascii_run(in, out, max_loops);
@@ -0,0 +1,221 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// SSE2 block converters used by nsUTF8ToUnicode and nsUnicodeToUTF8. They
+// only ever consume input the scalar converters would accept without
+// complaint and stop in front of anything else (malformed input,
+// supplementary characters, surrogates), so the scalar state machines still
+// own every error and every buffer boundary.
+
+#include "nscore.h"
+#include "mozilla/MathAlgorithms.h"
+
+#include <emmintrin.h>
+#include <string.h>
+
+namespace mozilla {
+namespace SSE2 {
+
+// Decodes blocks of 16 octets that hold one to three octet sequences. src
+// must be at the start of a sequence. Returns true if anything was decoded.
+bool
+Convert_utf8_run(const char *&src, char16_t *&dst, int32_t srclen,
+                 int32_t dstlen)
+{
+  const char *start = src;
+  const __m128i zero = _mm_setzero_si128();
+
+  while (srclen >= 16 && dstlen >= 16) {
+    __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    uint32_t nonascii = _mm_movemask_epi8(b0);
+
+    if (!nonascii) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst),
+                       _mm_unpacklo_epi8(b0, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8),
+                       _mm_unpackhi_epi8(b0, zero));
+      src += 16;
+      dst += 16;
+      srclen -= 16;
+      dstlen -= 16;
+      continue;
+    }
+
+    // Classify every octet with signed compares; 0x80..0xFF are negative.
+    __m128i b1 = _mm_srli_si128(b0, 1);
+    __m128i b2 = _mm_srli_si128(b0, 2);
+    __m128i cont = _mm_cmplt_epi8(b0, _mm_set1_epi8(-64));          // 80..BF
+    __m128i lead2 = _mm_and_si128(_mm_cmpgt_epi8(b0, _mm_set1_epi8(-63)),
+                                  _mm_cmplt_epi8(b0, _mm_set1_epi8(-32)));
+    __m128i lead3 = _mm_and_si128(_mm_cmpgt_epi8(b0, _mm_set1_epi8(-33)),
+                                  _mm_cmplt_epi8(b0, _mm_set1_epi8(-16)));
+    // E0 80..9F is overlong, ED A0..BF encodes a surrogate.
+    __m128i range = _mm_or_si128(
+      _mm_and_si128(_mm_cmpeq_epi8(b0, _mm_set1_epi8(char(0xE0))),
+                    _mm_cmplt_epi8(b1, _mm_set1_epi8(-96))),
+      _mm_and_si128(_mm_cmpeq_epi8(b0, _mm_set1_epi8(char(0xED))),
+                    _mm_cmpgt_epi8(b1, _mm_set1_epi8(-97))));
+
+    uint32_t contMask = _mm_movemask_epi8(cont);
+    uint32_t lead2Mask = _mm_movemask_epi8(lead2);
+    uint32_t lead3Mask = _mm_movemask_epi8(lead3);
+    uint32_t expected = (lead2Mask << 1) | (lead3Mask << 1) | (lead3Mask << 2);
+    uint32_t errors = ((expected ^ contMask) |
+                       (nonascii & ~(contMask | lead2Mask | lead3Mask)) |
+                       _mm_movemask_epi8(range)) & 0xFFFF;
+    // Sequences running past the block are left for the next one.
+    uint32_t split = (lead2Mask & 0x8000) | (lead3Mask & 0xC000);
+    uint32_t starts = ~contMask & 0xFFFF;
+
+    int32_t n = 16;
+    bool stop = false;
+    // An error at the split itself means the sequence before it is short.
+    if (errors && (!split || CountTrailingZeroes32(errors) <=
+                             CountTrailingZeroes32(split))) {
+      // Keep only the sequences that start before the sequence the first
+      // error belongs to; the scalar decoder reports it.
+      uint32_t before = starts & ((1u << CountTrailingZeroes32(errors)) - 1);
+      n = before ? 31 - int32_t(CountLeadingZeroes32(before)) : 0;
+      stop = true;
+    } else if (split) {
+      n = CountTrailingZeroes32(split);
+    }
+
+    if (n > 0) {
+      __m128i lo0 = _mm_unpacklo_epi8(b0, zero);
+      __m128i hi0 = _mm_unpackhi_epi8(b0, zero);
+      __m128i lo1 = _mm_and_si128(_mm_unpacklo_epi8(b1, zero),
+                                  _mm_set1_epi16(0x3F));
+      __m128i hi1 = _mm_and_si128(_mm_unpackhi_epi8(b1, zero),
+                                  _mm_set1_epi16(0x3F));
+      __m128i lo2 = _mm_and_si128(_mm_unpacklo_epi8(b2, zero),
+                                  _mm_set1_epi16(0x3F));
+      __m128i hi2 = _mm_and_si128(_mm_unpackhi_epi8(b2, zero),
+                                  _mm_set1_epi16(0x3F));
+
+      // Every lane gets the character a sequence starting there would
+      // decode to; lanes holding continuation octets are skipped below.
+      __m128i units[2];
+      for (int half = 0; half < 2; ++half) {
+        __m128i v0 = half ? hi0 : lo0;
+        __m128i v1 = half ? hi1 : lo1;
+        __m128i v2 = half ? hi2 : lo2;
+        __m128i is2 = half ? _mm_unpackhi_epi8(lead2, lead2)
+                           : _mm_unpacklo_epi8(lead2, lead2);
+        __m128i is3 = half ? _mm_unpackhi_epi8(lead3, lead3)
+                           : _mm_unpacklo_epi8(lead3, lead3);
+        __m128i two = _mm_or_si128(
+          _mm_slli_epi16(_mm_and_si128(v0, _mm_set1_epi16(0x1F)), 6), v1);
+        __m128i three = _mm_or_si128(
+          _mm_or_si128(_mm_slli_epi16(v0, 12), _mm_slli_epi16(v1, 6)), v2);
+        __m128i u = _mm_or_si128(_mm_andnot_si128(_mm_or_si128(is2, is3), v0),
+                                 _mm_and_si128(is2, two));
+        units[half] = _mm_or_si128(u, _mm_and_si128(is3, three));
+      }
+
+      char16_t decoded[16];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(decoded), units[0]);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(decoded + 8), units[1]);
+
+      char16_t *out = dst;
+      for (uint32_t m = starts & ((1u << n) - 1); m; m &= m - 1)
+        *out++ = decoded[CountTrailingZeroes32(m)];
+
+      src += n;
+      srclen -= n;
+      dstlen -= out - dst;
+      dst = out;
+    }
+
+    if (stop || n == 0)
+      break;
+  }
+
+  return src != start;
+}
+
+// Encodes blocks of 8 code units below U+D800 or above U+DFFF. Every unit
+// becomes a little-endian word holding its one to three octets, and the
+// words are stored overlapping, each advancing dst by its length.
+bool
+Convert_utf16_run(const char16_t *&src, char *&dst, int32_t srclen,
+                  int32_t dstlen)
+{
+  const char16_t *start = src;
+  const __m128i zero = _mm_setzero_si128();
+
+  // The last word of a block is stored at most 21 octets in.
+  while (srclen >= 8 && dstlen >= 25) {
+    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    // Flip the sign bit so the signed compares order the units unsigned.
+    __m128i biased = _mm_xor_si128(in, _mm_set1_epi16(-0x8000));
+    __m128i surrogate = _mm_and_si128(
+      _mm_cmpgt_epi16(biased, _mm_set1_epi16(0xD7FF - 0x8000)),
+      _mm_cmplt_epi16(biased, _mm_set1_epi16(0xE000 - 0x8000)));
+    uint32_t surrogates = _mm_movemask_epi8(surrogate);
+    int32_t count = surrogates ? CountTrailingZeroes32(surrogates) / 2 : 8;
+
+    if (!_mm_movemask_epi8(_mm_cmpgt_epi16(biased,
+                                           _mm_set1_epi16(0x7F - 0x8000)))) {
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(dst),
+                       _mm_packus_epi16(in, in));
+      src += 8;
+      dst += 8;
+      srclen -= 8;
+      dstlen -= 8;
+      continue;
+    }
+
+    if (count == 0)
+      break;
+
+    uint32_t words[8];
+    uint32_t lengths[8];
+    for (int half = 0; half < 2; ++half) {
+      __m128i x = half ? _mm_unpackhi_epi16(in, zero)
+                       : _mm_unpacklo_epi16(in, zero);
+      __m128i is2 = _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7F));
+      __m128i is3 = _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7FF));
+      __m128i low = _mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(0x3F)),
+                                 _mm_set1_epi32(0x80));
+      __m128i mid = _mm_or_si128(
+        _mm_and_si128(_mm_srli_epi32(x, 6), _mm_set1_epi32(0x3F)),
+        _mm_set1_epi32(0x80));
+      __m128i two = _mm_or_si128(
+        _mm_or_si128(_mm_srli_epi32(x, 6), _mm_set1_epi32(0xC0)),
+        _mm_slli_epi32(low, 8));
+      __m128i three = _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(_mm_srli_epi32(x, 12), _mm_set1_epi32(0xE0)),
+                     _mm_slli_epi32(mid, 8)),
+        _mm_slli_epi32(low, 16));
+      // is3 implies is2, so each unit takes exactly one of the three forms.
+      __m128i w = _mm_or_si128(_mm_andnot_si128(is2, x),
+                               _mm_andnot_si128(is3, _mm_and_si128(is2, two)));
+      w = _mm_or_si128(w, _mm_and_si128(is3, three));
+      __m128i len = _mm_sub_epi32(_mm_sub_epi32(_mm_set1_epi32(1), is2), is3);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(words + 4 * half), w);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lengths + 4 * half), len);
+    }
+
+    char *out = dst;
+    for (int32_t i = 0; i < count; ++i) {
+      memcpy(out, &words[i], 4);
+      out += lengths[i];
+    }
+
+    src += count;
+    srclen -= count;
+    dstlen -= out - dst;
+    dst = out;
+
+    if (count < 8)
+      break;
+  }
+
+  return src != start;
+}
+
+} // namespace SSE2
+} // namespace mozilla
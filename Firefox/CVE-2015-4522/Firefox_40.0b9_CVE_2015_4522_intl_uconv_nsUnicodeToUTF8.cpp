@@ -6,9 +6,35 @@
 //----------------------------------------------------------------------
 // Global functions and data [declaration]
 #include "nsUnicodeToUTF8.h"
+#include "mozilla/SSE.h"
 
 NS_IMPL_ISUPPORTS(nsUnicodeToUTF8, nsIUnicodeEncoder)
 
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+namespace mozilla {
+namespace SSE2 {
+
+bool Convert_utf16_run(const char16_t *&src, char *&dst, int32_t srclen,
+                       int32_t dstlen);
+
+}
+}
+#endif
+
+// Encodes code units outside the surrogate range a block at a time and
+// stops in front of the first surrogate. Returns false if nothing was
+// encoded.
+static inline bool
+Convert_utf16_run(const char16_t *&src, char *&dst, int32_t srclen,
+                  int32_t dstlen)
+{
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+  if (srclen >= 8 && dstlen >= 25 && mozilla::supports_sse2())
+    return mozilla::SSE2::Convert_utf16_run(src, dst, srclen, dstlen);
+#endif
+  return false;
+}
+
 //----------------------------------------------------------------------
 // nsUnicodeToUTF8 class [implementation]
 
@@ -66,6 +92,11 @@ NS_IMETHODIMP nsUnicodeToUTF8::Convert(const char16_t * aSrc,
   }
 
   while (src < srcEnd) {
+    char * runStart = dest;
+    if (Convert_utf16_run(src, dest, srcEnd - src, destLen)) {
+      destLen -= dest - runStart;
+      continue;
+    }
     if ( *src <= 0x007f) {
       if (destLen < 1)
         goto error_more_output;
@@ -25,13 +25,18 @@
 #include "nsWildCard.h"
 #include "nsZipArchive.h"
 #include "nsString.h"
+#include "nsTArray.h"
 #include "prenv.h"
+#include "prsystem.h"
+#include "prthread.h"
+#include "mozilla/Atomics.h"
 #if defined(XP_WIN)
 #include <windows.h>
 #endif
 
 // For placement new used for arena allocations of zip file list
 #include <new>
+#include <algorithm>
 #define ZIP_ARENABLOCKSIZE (1*1024)
 
 #ifdef XP_UNIX
@@ -467,6 +472,142 @@ nsresult nsZipArchive::ExtractFile(nsZipItem *item, const char *outname,
   return rv;
 }
 
+// Items of an ExtractFiles batch. The workers take them in archive order
+// so that the pages come in roughly sequentially.
+struct ZipExtractJob {
+  nsZipItem*   item;
+  const char*  outname;
+  PRFileDesc*  fd;
+  uint32_t     offset;
+  nsresult     rv;
+};
+
+class ZipExtractJobComparator {
+public:
+  bool Equals(const ZipExtractJob* a, const ZipExtractJob* b) const {
+    return a->offset == b->offset;
+  }
+  bool LessThan(const ZipExtractJob* a, const ZipExtractJob* b) const {
+    return a->offset < b->offset;
+  }
+};
+
+struct ZipExtractQueue {
+  nsZipArchive*               zip;
+  nsTArray<ZipExtractJob*>*   jobs;
+  Atomic<uint32_t>            next;
+};
+
+static void ZipExtractThreadMain(void* arg)
+{
+  ZipExtractQueue* queue = static_cast<ZipExtractQueue*>(arg);
+  uint32_t i;
+  while ((i = queue->next++) < queue->jobs->Length()) {
+    ZipExtractJob* job = queue->jobs->ElementAt(i);
+    job->rv = queue->zip->ExtractFile(job->item, job->outname, job->fd);
+  }
+}
+
+//---------------------------------------------
+// nsZipArchive::ExtractFiles
+// Extracts aCount items like ExtractFile, aItems[i] to aFds[i] (which is
+// closed, and aOutnames[i] deleted on error). The data of all the items is
+// paged in ahead of time and up to aThreads items are inflated at once.
+// ExtractFile only reads the archive, so it is safe to run concurrently.
+// Returns the first error in aItems order; every item is attempted.
+//---------------------------------------------
+nsresult nsZipArchive::ExtractFiles(nsZipItem** aItems, const char** aOutnames,
+                                    PRFileDesc** aFds, uint32_t aCount,
+                                    uint32_t aThreads)
+{
+  if (!mFd)
+    return NS_ERROR_FAILURE;
+  for (uint32_t i = 0; i < aCount; i++) {
+    if (!aItems[i])
+      return NS_ERROR_ILLEGAL_VALUE;
+  }
+
+  nsTArray<ZipExtractJob> jobs;
+  nsTArray<ZipExtractJob*> order;
+  if (!jobs.SetLength(aCount, fallible) || !order.SetCapacity(aCount, fallible))
+    return NS_ERROR_OUT_OF_MEMORY;
+
+MOZ_WIN_MEM_TRY_BEGIN
+  for (uint32_t i = 0; i < aCount; i++) {
+    ZipExtractJob& job = jobs[i];
+    job.item = aItems[i];
+    job.outname = aOutnames ? aOutnames[i] : nullptr;
+    job.fd = aFds ? aFds[i] : nullptr;
+    job.offset = job.item->LocalOffset();
+    job.rv = NS_OK;
+    order.AppendElement(&job);
+  }
+MOZ_WIN_MEM_TRY_CATCH(return NS_ERROR_FAILURE)
+  order.Sort(ZipExtractJobComparator());
+
+#if defined(XP_UNIX)
+  // Ask for the items' local headers and data, merging ranges less than
+  // kReadaheadGap apart into one request. The local extra field can differ
+  // from the central one, so allow for the largest one there can be.
+  const uint32_t kReadaheadGap = 64 * 1024;
+  const uintptr_t pageMask = uintptr_t(PR_GetPageSize()) - 1;
+  uint32_t start = 0, end = 0;
+  for (uint32_t i = 0; i <= aCount; i++) {
+    uint32_t itemStart = 0, itemEnd = 0;
+    if (i < aCount) {
+      nsZipItem* item = order[i]->item;
+      uint64_t itemLen = uint64_t(ZIPLOCAL_SIZE) + item->nameLength +
+                         UINT16_MAX + item->Size();
+      itemStart = std::min(order[i]->offset, mFd->mLen);
+      itemEnd = itemStart + uint32_t(std::min(uint64_t(mFd->mLen - itemStart),
+                                              itemLen));
+      if (end > start && itemStart <= end + kReadaheadGap) {
+        end = std::max(end, itemEnd);
+        continue;
+      }
+    }
+    if (end > start) {
+      uintptr_t first = uintptr_t(mFd->mFileData + start) & ~pageMask;
+      uintptr_t last = uintptr_t(mFd->mFileData + end);
+      madvise(reinterpret_cast<void*>(first), last - first, MADV_WILLNEED);
+    }
+    start = itemStart;
+    end = itemEnd;
+  }
+#endif
+
+  ZipExtractQueue queue;
+  queue.zip = this;
+  queue.jobs = &order;
+  queue.next = 0;
+
+  // The calling thread does its share, and if a thread can't be started
+  // the ones we have do its share too.
+  nsTArray<PRThread*> threads;
+  uint32_t helpers = aThreads > 1 ? std::min(aThreads, aCount) - 1 : 0;
+  for (uint32_t i = 0; i < helpers; i++) {
+    PRThread* thread = PR_CreateThread(PR_USER_THREAD, ZipExtractThreadMain,
+                                       &queue, PR_PRIORITY_NORMAL,
+                                       PR_GLOBAL_THREAD, PR_JOINABLE_THREAD, 0);
+    if (!thread || !threads.AppendElement(thread, fallible)) {
+      if (thread)
+        PR_JoinThread(thread);
+      break;
+    }
+  }
+
+  ZipExtractThreadMain(&queue);
+
+  for (uint32_t i = 0; i < threads.Length(); i++)
+    PR_JoinThread(threads[i]);
+
+  for (uint32_t i = 0; i < aCount; i++) {
+    if (jobs[i].rv != NS_OK)
+      return jobs[i].rv;
+  }
+  return NS_OK;
+}
+
 //---------------------------------------------
 // nsZipArchive::FindInit
 //---------------------------------------------
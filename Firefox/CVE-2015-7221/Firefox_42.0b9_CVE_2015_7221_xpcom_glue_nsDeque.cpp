@@ -5,6 +5,7 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "nsDeque.h"
+#include "nsAlgorithm.h"
 #include "nsISupportsImpl.h"
 #include <string.h>
 #ifdef DEBUG_rickg
@@ -12,36 +13,12 @@
 #endif
 
 /**
- * 07/02/2001  09:17p 509,104 clangref.pdf from openwatcom's site
- * Watcom C Language Reference Edition 11.0c
- * page 118 of 297
- *
- * The % symbol yields the remainder from the division of the first operand
- * by the second operand. The operands of % must have integral type.
- *
- * When both operands of % are positive, the result is a positive value
- * smaller than the second operand. When one or both operands is negative,
- * whether the result is positive or negative is implementation-defined.
- *
- */
-/* Ok, so first of all, C is underspecified. joy.
- * The following functions do not provide a correct implementation of modulus
- * They provide functionality for x>-y.
- * There are risks of 2*y being greater than max int, which is part of the
- * reason no multiplication is used and other operations are avoided.
- *
- * modasgn
- * @param x variable
- * @param y expression
- * approximately equivalent to x %= y
- *
- * modulus
- * @param x expression
- * @param y expression
- * approximately equivalent to x % y
+ * The capacity is always a power of two: it starts at the size of mBuffer
+ * and GrowCapacity quadruples it.  So a position in the ring is taken
+ * modulo the capacity by masking, which also gives the right answer for
+ * the -1 that PushFront steps back to.
  */
-#define modasgn(x,y) if (x<0) x+=y; x%=y
-#define modulus(x,y) ((x<0)?(x+y)%(y):(x)%(y))
+#define ringindex(x,capacity) ((x) & ((capacity) - 1))
 
 /**
  * Standard constructor
@@ -54,6 +31,9 @@ nsDeque::nsDeque(nsDequeFunctor* aDeallocator)
   mOrigin = mSize = 0;
   mData = mBuffer; // don't allocate space until you must
   mCapacity = sizeof(mBuffer) / sizeof(mBuffer[0]);
+  static_assert(!((sizeof(mBuffer) / sizeof(mBuffer[0])) &
+                  ((sizeof(mBuffer) / sizeof(mBuffer[0])) - 1)),
+                "nsDeque's inline buffer must hold a power of two items");
   memset(mData, 0, mCapacity * sizeof(mBuffer[0]));
 }
 
@@ -205,11 +185,40 @@ nsDeque::Push(void* aItem, const fallible_t&)
   if (mSize == mCapacity && !GrowCapacity()) {
     return false;
   }
-  mData[modulus(mOrigin + mSize, mCapacity)] = aItem;
+  mData[ringindex(mOrigin + mSize, mCapacity)] = aItem;
   mSize++;
   return true;
 }
 
+/**
+ * This method adds aCount items to the end of the deque, in order.
+ * This operation has the potential to cause the
+ * underlying buffer to resize.
+ *
+ * @param   aItems: the items to be added
+ * @param   aCount: how many there are
+ */
+bool
+nsDeque::PushElements(void* const* aItems, int32_t aCount, const fallible_t&)
+{
+  NS_ASSERTION(aCount >= 0, "Bad count");
+  if (aCount <= 0) {
+    return true;
+  }
+  while (mCapacity - mSize < aCount) {
+    if (!GrowCapacity()) {
+      return false;
+    }
+  }
+  // the free space may wrap, so copy in up to two blocks
+  int32_t start = ringindex(mOrigin + mSize, mCapacity);
+  int32_t first = XPCOM_MIN(aCount, mCapacity - start);
+  memcpy(mData + start, aItems, sizeof(void*) * first);
+  memcpy(mData, aItems + first, sizeof(void*) * (aCount - first));
+  mSize += aCount;
+  return true;
+}
+
 /**
  * This method adds an item to the front of the deque.
  * This operation has the potential to cause the
@@ -245,8 +254,7 @@ nsDeque::Push(void* aItem, const fallible_t&)
 bool
 nsDeque::PushFront(void* aItem, const fallible_t&)
 {
-  mOrigin--;
-  modasgn(mOrigin, mCapacity);
+  mOrigin = ringindex(mOrigin - 1, mCapacity);
   if (mSize == mCapacity) {
     if (!GrowCapacity()) {
       return false;
@@ -270,7 +278,7 @@ nsDeque::Pop()
   void* result = 0;
   if (mSize > 0) {
     --mSize;
-    int32_t offset = modulus(mSize + mOrigin, mCapacity);
+    int32_t offset = ringindex(mSize + mOrigin, mCapacity);
     result = mData[offset];
     mData[offset] = 0;
     if (!mSize) {
@@ -293,17 +301,41 @@ nsDeque::PopFront()
   if (mSize > 0) {
     NS_ASSERTION(mOrigin < mCapacity, "Error: Bad origin");
     result = mData[mOrigin];
-    mData[mOrigin++] = 0;   //zero it out for debugging purposes.
+    mData[mOrigin] = 0;   //zero it out for debugging purposes.
     mSize--;
     // Cycle around if we pop off the end
     // and reset origin if when we pop the last element
-    if (mCapacity == mOrigin || !mSize) {
-      mOrigin = 0;
-    }
+    mOrigin = mSize ? ringindex(mOrigin + 1, mCapacity) : 0;
   }
   return result;
 }
 
+/**
+ * Remove up to aCount items from the front of the container, storing
+ * them in order in aItems.
+ *
+ * @param   aItems: where to put the items
+ * @param   aCount: how many items to remove at most
+ * @return  the number of items removed
+ */
+int32_t
+nsDeque::PopFrontElements(void** aItems, int32_t aCount)
+{
+  int32_t count = XPCOM_MIN(aCount, mSize);
+  if (count <= 0) {
+    return 0;
+  }
+  // the items may wrap, so copy and clear in up to two blocks
+  int32_t first = XPCOM_MIN(count, mCapacity - mOrigin);
+  memcpy(aItems, mData + mOrigin, sizeof(void*) * first);
+  memset(mData + mOrigin, 0, sizeof(void*) * first);
+  memcpy(aItems + first, mData, sizeof(void*) * (count - first));
+  memset(mData, 0, sizeof(void*) * (count - first));
+  mSize -= count;
+  mOrigin = mSize ? ringindex(mOrigin + count, mCapacity) : 0;
+  return count;
+}
+
 /**
  * This method gets called you want to peek at the bottom
  * member without removing it.
@@ -315,7 +347,7 @@ nsDeque::Peek()
 {
   void* result = 0;
   if (mSize > 0) {
-    result = mData[modulus(mSize - 1 + mOrigin, mCapacity)];
+    result = mData[ringindex(mSize - 1 + mOrigin, mCapacity)];
   }
   return result;
 }
@@ -350,7 +382,7 @@ nsDeque::ObjectAt(int32_t aIndex) const
 {
   void* result = 0;
   if (aIndex >= 0 && aIndex < mSize) {
-    result = mData[modulus(mOrigin + aIndex, mCapacity)];
+    result = mData[ringindex(mOrigin + aIndex, mCapacity)];
   }
   return result;
 }
@@ -361,13 +393,13 @@ nsDeque::RemoveObjectAt(int32_t aIndex)
   if (aIndex < 0 || aIndex >= mSize) {
     return 0;
   }
-  void* result = mData[modulus(mOrigin + aIndex, mCapacity)];
+  void* result = mData[ringindex(mOrigin + aIndex, mCapacity)];
 
   // "Shuffle down" all elements in the array by 1, overwritting the element
   // being removed.
   for (int32_t i = aIndex; i < mSize; ++i) {
-    mData[modulus(mOrigin + i, mCapacity)] =
-      mData[modulus(mOrigin + i + 1, mCapacity)];
+    mData[ringindex(mOrigin + i, mCapacity)] =
+      mData[ringindex(mOrigin + i + 1, mCapacity)];
   }
   mSize--;
 
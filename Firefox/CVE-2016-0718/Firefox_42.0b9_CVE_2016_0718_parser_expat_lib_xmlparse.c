@@ -88,6 +88,12 @@ typedef char ICHAR;
 #include "xmltok.h"
 #include "xmlrole.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XML_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
 typedef const XML_Char *KEY;
 
 typedef struct {
@@ -2188,6 +2194,68 @@ externalEntityContentProcessor(XML_Parser parser,
   return result;
 }
 
+/* Contexts for scanPlainData(). */
+#define PLAIN_CONTENT 0
+#define PLAIN_ATTRIBUTE 1
+
+/* Plain bytes are ASCII characters that the tokenizer, for an encoding
+   with isUtf8 set, passes over as character data in the given context
+   without a second look: everything printable but '<' and '&', and also
+   ']' in content, where it may start "]]>".  Content allows tabs and
+   spaces; in attribute values they are normalized, so they stop a run. */
+static int
+isPlainByte(unsigned char c, int context)
+{
+  if (c < 0x20)
+    return c == '\t' && context == PLAIN_CONTENT;
+  if (c >= 0x80)
+    return 0;
+  switch (c) {
+  case '<':
+  case '&':
+    return 0;
+  case ']':
+    return context != PLAIN_CONTENT;
+  case ' ':
+    return context != PLAIN_ATTRIBUTE;
+  }
+  return 1;
+}
+
+/* Returns the end of the run of plain bytes at ptr. Every run the
+   tokenizer would return as XML_TOK_DATA_CHARS starts with such a run, so
+   the callers can report it as one without asking the tokenizer; whatever
+   follows is left to the tokenizer. The scan never looks past end, so a
+   run cut short by the end of the buffer just continues in the next one. */
+static const char *
+scanPlainData(const char *ptr, const char *end, int context)
+{
+#ifdef XML_SCAN_SSE2
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i extra = _mm_set1_epi8(context == PLAIN_CONTENT ? ']' : ' ');
+  while (end - ptr >= 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)ptr);
+    /* The signed compare catches the control characters and every byte
+       of 0x80 and above. */
+    __m128i stop = _mm_cmplt_epi8(b, space);
+    if (context == PLAIN_CONTENT)
+      stop = _mm_andnot_si128(_mm_cmpeq_epi8(b, tab), stop);
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, lt));
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, amp));
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, extra));
+    if (_mm_movemask_epi8(stop))
+      break;
+    ptr += 16;
+  }
+#endif
+  while (ptr != end && isPlainByte((unsigned char)*ptr, context))
+    ptr++;
+  return ptr;
+}
+
 static enum XML_Error
 doContent(XML_Parser parser,
           int startTagLevel,
@@ -2214,7 +2282,11 @@ doContent(XML_Parser parser,
 
   for (;;) {
     const char *next = s; /* XmlContentTok doesn't always set the last arg */
-    int tok = XmlContentTok(enc, s, end, &next);
+    int tok;
+    if (enc->isUtf8 && (next = scanPlainData(s, end, PLAIN_CONTENT)) != s)
+      tok = XML_TOK_DATA_CHARS;
+    else
+      tok = XmlContentTok(enc, s, end, &next);
     *eventEndPP = next;
     switch (tok) {
     case XML_TOK_TRAILING_CR:
@@ -4977,8 +5049,13 @@ appendAttributeValue(XML_Parser parser, const ENCODING *enc, XML_Bool isCdata,
 {
   DTD * const dtd = _dtd;  /* save one level of indirection */
   for (;;) {
-    const char *next;
-    int tok = XmlAttributeValueTok(enc, ptr, end, &next);
+    const char *next = ptr;
+    int tok;
+    if (enc->isUtf8
+        && (next = scanPlainData(ptr, end, PLAIN_ATTRIBUTE)) != ptr)
+      tok = XML_TOK_DATA_CHARS;
+    else
+      tok = XmlAttributeValueTok(enc, ptr, end, &next);
     switch (tok) {
     case XML_TOK_NONE:
       return XML_ERROR_NONE;
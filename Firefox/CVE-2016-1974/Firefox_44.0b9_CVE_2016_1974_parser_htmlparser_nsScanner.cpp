@@ -7,6 +7,7 @@
 //#define __INCREMENTAL 1
 
 #include "mozilla/DebugOnly.h"
+#include "mozilla/SSE.h"
 
 #include "nsScanner.h"
 #include "nsDebug.h"
@@ -44,6 +45,97 @@ nsReadEndCondition::nsReadEndCondition(const char16_t* aTerminateChars) :
   }
 }
 
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+namespace mozilla {
+namespace SSE2 {
+
+const char16_t* FindCharInSet(const char16_t* aStart, const char16_t* aEnd,
+                              const char16_t* aChars);
+const char16_t* SkipSpacesAndTabs(const char16_t* aStart,
+                                  const char16_t* aEnd);
+
+} // namespace SSE2
+} // namespace mozilla
+#endif
+
+// The characters that end a tag identifier in ReadTagIdentifier.
+static const char16_t sTagIdentifierTerminators[] =
+  { '\n', '\r', ' ', '\t', '\v', '\f', '<', '>', '/', 0 };
+
+/**
+ *  Moves aPosition forward to the first character before aEnd that is NUL
+ *  or one of aEndCondition's characters, or to aEnd. The search runs over
+ *  one contiguous fragment of the buffer list at a time.
+ */
+static void
+FindEndCondition(nsScannerIterator& aPosition,
+                 const nsScannerIterator& aEnd,
+                 const nsReadEndCondition& aEndCondition)
+{
+  while (aPosition != aEnd) {
+    const char16_t* start = aPosition.get();
+    const char16_t* end = start + aPosition.size_forward();
+    const char16_t* pos = start;
+
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+    if (mozilla::supports_sse2()) {
+      pos = mozilla::SSE2::FindCharInSet(pos, end, aEndCondition.mChars);
+    }
+#endif
+
+    for (; pos != end; ++pos) {
+      char16_t ch = *pos;
+      // NUL always gets past the filter.
+      if (!(ch & aEndCondition.mFilter)) {
+        if (!ch) {
+          break;
+        }
+        const char16_t* setcurrent = aEndCondition.mChars;
+        while (*setcurrent && *setcurrent != ch) {
+          ++setcurrent;
+        }
+        if (*setcurrent) {
+          break;
+        }
+      }
+    }
+
+    aPosition.advance(pos - start);
+    if (pos != end) {
+      return;
+    }
+  }
+}
+
+/**
+ *  Moves aPosition forward past any spaces and tabs, up to aEnd.
+ */
+static void
+SkipSpacesAndTabs(nsScannerIterator& aPosition,
+                  const nsScannerIterator& aEnd)
+{
+  while (aPosition != aEnd) {
+    const char16_t* start = aPosition.get();
+    const char16_t* end = start + aPosition.size_forward();
+    const char16_t* pos = start;
+
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+    if (mozilla::supports_sse2()) {
+      pos = mozilla::SSE2::SkipSpacesAndTabs(pos, end);
+    }
+#endif
+
+    while (pos != end && (*pos == ' ' || *pos == '\t')) {
+      ++pos;
+    }
+
+    aPosition.advance(pos - start);
+    if (pos != end) {
+      return;
+    }
+  }
+}
+
 /**
  *  Use this constructor if you want i/o to be based on 
  *  a single string you hand in during construction.
@@ -514,6 +606,7 @@ nsresult nsScanner::ReadTagIdentifier(nsScannerSharedSubstring& aString) {
   nsresult          result=Peek(theChar);
   nsScannerIterator current, end;
   bool              found=false;  
+  nsReadEndCondition endCondition(sTagIdentifierTerminators);
   
   current = mCurrentPosition;
   end = mEndPosition;
@@ -521,6 +614,10 @@ nsresult nsScanner::ReadTagIdentifier(nsScannerSharedSubstring& aString) {
   // Loop until we find an illegal character. Everything is then appended
   // later.
   while(current != end && !found) {
+    FindEndCondition(current, end, endCondition);
+    if (current == end) {
+      break;
+    }
     theChar=*current;
 
     switch(theChar) {
@@ -730,7 +827,8 @@ nsresult nsScanner::ReadWhitespace(nsScannerSharedSubstring& aString,
         break;
       case ' ' :
       case '\t':
-        theChar = (++current != end) ? *current : '\0';
+        SkipSpacesAndTabs(current, end);
+        theChar = (current != end) ? *current : '\0';
         break;
       default:
         done = true;
@@ -776,10 +874,9 @@ nsresult nsScanner::ReadWhitespace(nsScannerIterator& aStart,
   while(!done && current != end) {
     switch(theChar) {
       case '\n':
-      case '\r': ++aNewlinesSkipped;
-      case ' ' :
-      case '\t':
+      case '\r':
         {
+          ++aNewlinesSkipped;
           char16_t thePrevChar = theChar;
           theChar = (++current != end) ? *current : '\0';
           if ((thePrevChar == '\r' && theChar == '\n') ||
@@ -788,6 +885,11 @@ nsresult nsScanner::ReadWhitespace(nsScannerIterator& aStart,
           }
         }
         break;
+      case ' ' :
+      case '\t':
+        SkipSpacesAndTabs(current, end);
+        theChar = (current != end) ? *current : '\0';
+        break;
       default:
         done = true;
         aStart = origin;
@@ -839,6 +941,11 @@ nsresult nsScanner::ReadUntil(nsAString& aString,
   }
   
   while (current != mEndPosition) {
+    FindEndCondition(current, mEndPosition, aEndCondition);
+    if (current == mEndPosition) {
+      break;
+    }
+
     theChar = *current;
     if (theChar == '\0') {
       ReplaceCharacter(current, sInvalid);
@@ -899,6 +1006,11 @@ nsresult nsScanner::ReadUntil(nsScannerSharedSubstring& aString,
   }
   
   while (current != mEndPosition) {
+    FindEndCondition(current, mEndPosition, aEndCondition);
+    if (current == mEndPosition) {
+      break;
+    }
+
     theChar = *current;
     if (theChar == '\0') {
       ReplaceCharacter(current, sInvalid);
@@ -961,6 +1073,11 @@ nsresult nsScanner::ReadUntil(nsScannerIterator& aStart,
   }
   
   while (current != mEndPosition) {
+    FindEndCondition(current, mEndPosition, aEndCondition);
+    if (current == mEndPosition) {
+      break;
+    }
+
     theChar = *current;
     if (theChar == '\0') {
       ReplaceCharacter(current, sInvalid);
@@ -1024,7 +1141,15 @@ nsresult nsScanner::ReadUntil(nsAString& aString,
     return result;
   }
 
+  char16_t terminal[] = { aTerminalChar, 0 };
+  nsReadEndCondition endCondition(terminal);
+
   while (current != mEndPosition) {
+    FindEndCondition(current, mEndPosition, endCondition);
+    if (current == mEndPosition) {
+      break;
+    }
+
     theChar = *current;
     if (theChar == '\0') {
       ReplaceCharacter(current, sInvalid);
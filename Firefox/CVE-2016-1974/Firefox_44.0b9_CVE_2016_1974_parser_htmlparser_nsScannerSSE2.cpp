@@ -0,0 +1,74 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// SSE2 scanning loops used by nsScanner. They work on one contiguous
+// fragment of the scanner's buffer list at a time and leave the last few
+// characters of a fragment to the scalar loops in nsScanner.cpp.
+
+#include "nscore.h"
+#include "mozilla/MathAlgorithms.h"
+
+#include <emmintrin.h>
+
+namespace mozilla {
+namespace SSE2 {
+
+// Sets larger than this are left to the scalar loop.
+static const int kMaxSetChars = 16;
+
+// Returns the first character in [aStart, aEnd) that is NUL or one of the
+// NUL-terminated aChars, or the start of the last, shorter than eight
+// characters, stretch of the range.
+const char16_t*
+FindCharInSet(const char16_t* aStart, const char16_t* aEnd,
+              const char16_t* aChars)
+{
+  __m128i set[kMaxSetChars];
+  int count = 0;
+  for (; aChars[count]; ++count) {
+    if (count == kMaxSetChars) {
+      return aStart;
+    }
+    set[count] = _mm_set1_epi16(aChars[count]);
+  }
+
+  const __m128i zero = _mm_setzero_si128();
+  while (aEnd - aStart >= 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aStart));
+    __m128i hit = _mm_cmpeq_epi16(v, zero);
+    for (int i = 0; i < count; ++i) {
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi16(v, set[i]));
+    }
+    uint32_t mask = _mm_movemask_epi8(hit);
+    if (mask) {
+      return aStart + CountTrailingZeroes32(mask) / 2;
+    }
+    aStart += 8;
+  }
+  return aStart;
+}
+
+// Returns the first character in [aStart, aEnd) that is neither a space
+// nor a tab, or the start of the last, shorter than eight characters,
+// stretch of the range.
+const char16_t*
+SkipSpacesAndTabs(const char16_t* aStart, const char16_t* aEnd)
+{
+  const __m128i space = _mm_set1_epi16(' ');
+  const __m128i tab = _mm_set1_epi16('\t');
+  while (aEnd - aStart >= 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aStart));
+    uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(v, space),
+                                                   _mm_cmpeq_epi16(v, tab)));
+    if (mask != 0xFFFF) {
+      return aStart + CountTrailingZeroes32(~mask) / 2;
+    }
+    aStart += 8;
+  }
+  return aStart;
+}
+
+} // namespace SSE2
+} // namespace mozilla
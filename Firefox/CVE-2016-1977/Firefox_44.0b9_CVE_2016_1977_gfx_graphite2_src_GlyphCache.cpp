@@ -33,6 +33,11 @@ of the License or (at your option) any later version.
 #include "inc/Endian.h"
 #include "inc/bits.h"
 
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 using namespace graphite2;
 
 namespace
@@ -76,11 +81,174 @@ namespace
 
     typedef _glat_iterator<uint8>   glat_iterator;
     typedef _glat_iterator<uint16>  glat2_iterator;
+
+    // The number of glyphs all the faces with an LRU may hold between them
+    // (0 for no limit), how many they hold now, and how many such faces
+    // there are. Faces on different threads share these, so the counts are
+    // only changed atomically.
+    size_t          glyph_budget = 0;
+    volatile long   glyphs_resident = 0;
+    volatile long   evictable_faces = 0;
+
+    inline long atomic_add(volatile long & count, long n)
+    {
+#if defined(_MSC_VER)
+        return _InterlockedExchangeAdd(&count, n) + n;
+#else
+        return __sync_add_and_fetch(&count, n);
+#endif
+    }
+
+    inline size_t box_size(int numsubs)
+    {
+        return sizeof(GlyphBox) + 8 * numsubs * sizeof(float);
+    }
 }
 
 const SlantBox SlantBox::empty = {0,0,0,0};
 
 
+// Storage for the glyphs and boxes of one face. Small objects come from
+// per-size free lists carved out of large blocks, so a glyph costs no more
+// than its own size and the whole face is released in a few frees. If the
+// face is evictable, the glyphs other than 0 are also kept on an LRU list,
+// linked by glyph id through a pair of uint16 arrays with 0 as the head, and
+// counted both here and in glyphs_resident.
+class GlyphCache::Pool
+{
+public:
+    Pool(unsigned short num_glyphs, bool evictable) throw();
+    ~Pool() throw();
+
+    bool operator ! () const throw()            { return _evictable && !(_prev && _next); }
+    bool evictable() const throw()              { return _evictable; }
+
+    void * alloc(size_t n) throw();
+    void   release(void * p, size_t n) throw();
+
+    void            link(unsigned short gid) throw();
+    void            unlink(unsigned short gid) throw();
+    void            touch(unsigned short gid) throw()   { if (_next[0] != gid) { _unlink(gid); _link(gid); } }
+    unsigned short  oldest() const throw()              { return _prev[0]; }
+    long            resident() const throw()            { return _resident; }
+
+    CLASS_NEW_DELETE;
+private:
+    enum { granule = 16, num_classes = 64, block_size = 0x4000 };
+    struct block { block * next; };
+
+    void      * _free[num_classes];
+    block     * _blocks;
+    byte      * _top,
+              * _end;
+    uint16    * _prev,
+              * _next;
+    long        _resident;
+    const bool  _evictable;
+
+    void _link(unsigned short gid) throw();
+    void _unlink(unsigned short gid) throw();
+};
+
+GlyphCache::Pool::Pool(unsigned short num_glyphs, bool evictable) throw()
+: _blocks(0), _top(0), _end(0),
+  _prev(evictable ? gralloc<uint16>(num_glyphs) : 0),
+  _next(evictable ? gralloc<uint16>(num_glyphs) : 0),
+  _resident(0),
+  _evictable(evictable)
+{
+    memset(_free, 0, sizeof _free);
+    if (_prev && _next)
+        _prev[0] = _next[0] = 0;
+    if (_evictable)
+        atomic_add(evictable_faces, 1);
+}
+
+GlyphCache::Pool::~Pool() throw()
+{
+    while (_blocks)
+    {
+        block * const b = _blocks;
+        _blocks = b->next;
+        free(b);
+    }
+    free(_prev);
+    free(_next);
+    if (_resident)
+        atomic_add(glyphs_resident, -_resident);
+    if (_evictable)
+        atomic_add(evictable_faces, -1);
+}
+
+void * GlyphCache::Pool::alloc(size_t n) throw()
+{
+    const size_t c = (n + granule - 1) / granule;
+    if (c >= num_classes)   return gralloc<byte>(n);
+
+    if (_free[c])
+    {
+        void * const p = _free[c];
+        _free[c] = *static_cast<void **>(p);
+        return p;
+    }
+
+    if (size_t(_end - _top) < c * granule)
+    {
+        // The tail of the old block is left unused; it is under 1K.
+        block * const b = reinterpret_cast<block *>(gralloc<byte>(block_size));
+        if (!b) return 0;
+        b->next = _blocks;
+        _blocks = b;
+        _top = reinterpret_cast<byte *>(b) + granule;
+        _end = reinterpret_cast<byte *>(b) + block_size;
+    }
+    void * const p = _top;
+    _top += c * granule;
+    return p;
+}
+
+void GlyphCache::Pool::release(void * p, size_t n) throw()
+{
+    const size_t c = (n + granule - 1) / granule;
+    if (!p) return;
+    if (c >= num_classes)
+    {
+        free(p);
+        return;
+    }
+    *static_cast<void **>(p) = _free[c];
+    _free[c] = p;
+}
+
+void GlyphCache::Pool::link(unsigned short gid) throw()
+{
+    _link(gid);
+    ++_resident;
+    atomic_add(glyphs_resident, 1);
+}
+
+void GlyphCache::Pool::unlink(unsigned short gid) throw()
+{
+    _unlink(gid);
+    --_resident;
+    atomic_add(glyphs_resident, -1);
+}
+
+void GlyphCache::Pool::_link(unsigned short gid) throw()
+{
+    _next[gid] = _next[0];
+    _prev[gid] = 0;
+    _prev[_next[0]] = gid;
+    _next[0] = gid;
+}
+
+void GlyphCache::Pool::_unlink(unsigned short gid) throw()
+{
+    _next[_prev[gid]] = _next[gid];
+    _prev[_next[gid]] = _prev[gid];
+}
+
+
 class GlyphCache::Loader
 {
 public:
@@ -120,51 +288,13 @@ GlyphCache::GlyphCache(const Face & face, const uint32 face_options)
   _boxes(_glyph_loader && _glyph_loader->has_boxes() ? grzeroalloc<GlyphBox *>(_glyph_loader->num_glyphs()) : 0),
   _num_glyphs(_glyphs ? _glyph_loader->num_glyphs() : 0),
   _num_attrs(_glyphs ? _glyph_loader->num_attrs() : 0),
-  _upem(_glyphs ? _glyph_loader->units_per_em() : 0)
+  _upem(_glyphs ? _glyph_loader->units_per_em() : 0),
+  _pool(_glyphs ? new Pool(_num_glyphs, glyph_budget && !(face_options & gr_face_preloadGlyphs)) : 0)
 {
-    if ((face_options & gr_face_preloadGlyphs) && _glyph_loader && _glyphs)
-    {
-        int numsubs = 0;
-        GlyphFace * const glyphs = new GlyphFace [_num_glyphs];
-        if (!glyphs)
-            return;
-
-        // The 0 glyph is definately required.
-        _glyphs[0] = _glyph_loader->read_glyph(0, glyphs[0], &numsubs);
-
-        // glyphs[0] has the same address as the glyphs array just allocated,
-        //  thus assigning the &glyphs[0] to _glyphs[0] means _glyphs[0] points
-        //  to the entire array.
-        const GlyphFace * loaded = _glyphs[0];
-        for (uint16 gid = 1; loaded && gid != _num_glyphs; ++gid)
-            _glyphs[gid] = loaded = _glyph_loader->read_glyph(gid, glyphs[gid], &numsubs);
-
-        if (!loaded)
-        {
-            _glyphs[0] = 0;
-            delete [] glyphs;
-        }
-        else if (numsubs > 0)
-        {
-            GlyphBox * boxes = (GlyphBox *)gralloc<char>(_num_glyphs * sizeof(GlyphBox) + numsubs * 8 * sizeof(float));
-            GlyphBox * currbox = boxes;
-
-            for (uint16 gid = 0; currbox && gid != _num_glyphs; ++gid)
-            {
-                _boxes[gid] = currbox;
-                currbox = _glyph_loader->read_box(gid, currbox, *_glyphs[gid]);
-            }
-            if (!currbox)
-            {
-                free(boxes);
-                _boxes[0] = 0;
-            }
-        }
-        delete _glyph_loader;
-        _glyph_loader = 0;
-    }
-
-    if (_glyphs && glyph(0) == 0)
+    // Glyphs are only read when first asked for, whatever the face options;
+    // gr_face_preloadGlyphs just keeps them from being evicted. The 0 glyph
+    // is definately required, and stands in for any that fail to load.
+    if (_glyphs && (!_pool || !*_pool || glyph(0) == 0))
     {
         free(_glyphs);
         _glyphs = 0;
@@ -182,28 +312,15 @@ GlyphCache::~GlyphCache()
 {
     if (_glyphs)
     {
-        if (_glyph_loader)
-        {
-            const GlyphFace *  * g = _glyphs;
-            for(unsigned short n = _num_glyphs; n; --n, ++g)
-                delete *g;
-        }
-        else
-            delete [] _glyphs[0];
+        // The boxes are plain data and go with the pool, which also takes
+        // this face's glyphs off the resident count.
+        for (unsigned short gid = 0; gid != _num_glyphs; ++gid)
+            if (_glyphs[gid])
+                _glyphs[gid]->~GlyphFace();
         free(_glyphs);
     }
-    if (_boxes)
-    {
-        if (_glyph_loader)
-        {
-            GlyphBox *  * g = _boxes;
-            for (uint16 n = _num_glyphs; n; --n, ++g)
-                free(*g);
-        }
-        else
-            free(_boxes[0]);
-        free(_boxes);
-    }
+    free(_boxes);
+    delete _pool;
     delete _glyph_loader;
 }
 
@@ -213,26 +330,71 @@ const GlyphFace *GlyphCache::glyph(unsigned short glyphid) const      //result m
     if (p == 0 && _glyph_loader)
     {
         int numsubs = 0;
-        GlyphFace * g = new GlyphFace();
+        void * const mem = _pool->alloc(sizeof(GlyphFace));
+        GlyphFace * g = mem ? new (mem) GlyphFace() : 0;
         if (g)  p = _glyph_loader->read_glyph(glyphid, *g, &numsubs);
         if (!p)
         {
-            delete g;
+            if (g)
+            {
+                g->~GlyphFace();
+                _pool->release(g, sizeof(GlyphFace));
+            }
             return *_glyphs;
         }
         if (_boxes)
         {
-            _boxes[glyphid] = (GlyphBox *)gralloc<char>(sizeof(GlyphBox) + 8 * numsubs * sizeof(float));
-            if (!_glyph_loader->read_box(glyphid, _boxes[glyphid], *_glyphs[glyphid]))
+            const size_t size = box_size(numsubs);
+            _boxes[glyphid] = static_cast<GlyphBox *>(_pool->alloc(size));
+            if (_boxes[glyphid] && !_glyph_loader->read_box(glyphid, _boxes[glyphid], *_glyphs[glyphid]))
             {
-                free(_boxes[glyphid]);
+                _pool->release(_boxes[glyphid], size);
                 _boxes[glyphid] = 0;
             }
         }
+        if (glyphid && _pool->evictable())
+            _pool->link(glyphid);
     }
+    else if (p && glyphid && _pool->evictable())
+        _pool->touch(glyphid);
     return p;
 }
 
+// A face only evicts its own glyphs, so each evictable face gets an equal
+// share of the budget. While all the faces together are over the budget, a
+// face trims itself down to its share; a face under its share keeps its
+// glyphs however many other faces hold.
+void GlyphCache::trim() const
+{
+    if (!_pool || !_pool->evictable())
+        return;
+
+    const long faces = atomic_add(evictable_faces, 0);
+    const long share = long(glyph_budget) / (faces > 0 ? faces : 1);
+
+    unsigned short gid;
+    while (_pool->resident() > share
+        && atomic_add(glyphs_resident, 0) > long(glyph_budget)
+        && (gid = _pool->oldest()) != 0)
+    {
+        _pool->unlink(gid);
+        const GlyphFace * & p = _glyphs[gid];
+        p->~GlyphFace();
+        _pool->release(const_cast<GlyphFace *>(p), sizeof(GlyphFace));
+        p = 0;
+        if (_boxes && _boxes[gid])
+        {
+            _pool->release(_boxes[gid], box_size(_boxes[gid]->num()));
+            _boxes[gid] = 0;
+        }
+    }
+}
+
+void GlyphCache::budget(size_t glyphs)
+{
+    glyph_budget = glyphs;
+}
+
 
 
 GlyphCache::Loader::Loader(const Face & face, const bool dumb_font)
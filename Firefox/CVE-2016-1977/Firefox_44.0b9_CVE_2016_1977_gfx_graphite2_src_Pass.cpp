@@ -355,6 +355,18 @@ bool Pass::readStates(const byte * starts, const byte *states, const byte * o_ru
         s->rules_end = (end - begin <= FiniteStateMachine::MAX_RULES)? end :
             begin + FiniteStateMachine::MAX_RULES;
         qsort(begin, end - begin, sizeof(RuleEntry), &cmpRuleEntry);
+
+        // Rules are tried in this order and the first whose constraint holds
+        // fires. One with no constraint that needs no more precontext than
+        // runFSM guarantees always fires, so anything after it is dead.
+        for (const RuleEntry * r = s->rules; r != s->rules_end; ++r)
+        {
+            if (!*r->rule->constraint && r->rule->preContext <= m_minPreCtxt)
+            {
+                s->rules_end = r + 1;
+                break;
+            }
+        }
     }
 
     return true;
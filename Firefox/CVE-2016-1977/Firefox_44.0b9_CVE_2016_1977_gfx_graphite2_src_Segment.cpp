@@ -42,6 +42,111 @@ of the License or (at your option) any later version.
 
 using namespace graphite2;
 
+#if !defined GRAPHITE2_NSEGARENA && (__cplusplus >= 201103L || (defined _MSC_VER && _MSC_VER >= 1900))
+namespace
+{
+    // The slot, attribute and justification blocks of a segment are kept
+    // when it dies, for the next segment built on the same thread: layout
+    // makes a great many short segments, and a recycled block saves the
+    // allocator round trip and is likely still in cache. Blocks are sized
+    // in powers of two so that they fit the next segment's requests.
+    class BlockCache
+    {
+    public:
+        BlockCache() : _cached(0) { memset(_free, 0, sizeof _free); }
+        ~BlockCache();
+
+        static void * alloc(size_t n);
+        static void   release(void * p);
+
+    private:
+        enum { min_block = 256, num_classes = 9, max_cached = 0x40000 };   // blocks up to 64K, 256K in all
+        struct header
+        {
+            header    * next;
+            size_t      cls;
+        };
+
+        header    * _free[num_classes];
+        size_t      _cached;
+    };
+
+    thread_local BlockCache block_cache;
+    // Segments can still be made or freed on this thread after block_cache
+    // is destroyed, by the destructors of other thread_locals. This flag has
+    // no destructor, so it stays readable until the thread is gone, and
+    // once it is set the blocks go straight to malloc() and free().
+    thread_local bool block_cache_gone = false;
+
+    BlockCache::~BlockCache()
+    {
+        block_cache_gone = true;
+        for (size_t c = 0; c != num_classes; ++c)
+        {
+            while (_free[c])
+            {
+                header * const h = _free[c];
+                _free[c] = h->next;
+                free(h);
+            }
+        }
+    }
+
+    // Returns n zeroed bytes, or 0 if they cannot be had.
+    void * BlockCache::alloc(size_t n)
+    {
+        if (n > size_t(-1) - sizeof(header))
+            return 0;
+        const size_t total = n + sizeof(header);
+        size_t c = 0;
+        while (c != num_classes && size_t(min_block) << c < total) ++c;
+
+        BlockCache * const bc = block_cache_gone ? 0 : &block_cache;
+        header * h = bc && c != num_classes ? bc->_free[c] : 0;
+        if (h)
+        {
+            bc->_free[c] = h->next;
+            bc->_cached -= size_t(min_block) << c;
+        }
+        else
+        {
+            h = static_cast<header *>(malloc(c != num_classes ? size_t(min_block) << c : total));
+            if (!h) return 0;
+            h->cls = c;
+        }
+        memset(h + 1, 0, n);
+        return h + 1;
+    }
+
+    void BlockCache::release(void * p)
+    {
+        if (!p) return;
+        header * const h = static_cast<header *>(p) - 1;
+        BlockCache * const bc = block_cache_gone ? 0 : &block_cache;
+        if (!bc || h->cls == num_classes || bc->_cached + (size_t(min_block) << h->cls) > max_cached)
+        {
+            free(h);
+            return;
+        }
+        h->next = bc->_free[h->cls];
+        bc->_free[h->cls] = h;
+        bc->_cached += size_t(min_block) << h->cls;
+    }
+
+    // Like grzeroalloc, fails rather than wrap when sizeof(T) * n overflows.
+    template <typename T>
+    inline T * block_alloc(size_t n)    { return n > size_t(-1) / sizeof(T) ? 0 : static_cast<T *>(BlockCache::alloc(sizeof(T) * n)); }
+    inline void block_free(void * p)    { BlockCache::release(p); }
+}
+#else
+namespace
+{
+    template <typename T>
+    inline T * block_alloc(size_t n)    { return grzeroalloc<T>(n); }
+    inline void block_free(void * p)    { free(p); }
+}
+#endif
+
 Segment::Segment(unsigned int numchars, const Face* face, uint32 script, int textDir)
 : m_freeSlots(NULL),
   m_freeJustifies(NULL),
@@ -58,6 +163,13 @@ Segment::Segment(unsigned int numchars, const Face* face, uint32 script, int tex
   m_dir(textDir),
   m_flags(((m_silf->flags() & 0x20) != 0) << 1)
 {
+    // This is where a face gives back what it has over its share of the
+    // glyph budget. Slots refer to glyphs by id, and glyph() reloads any
+    // that were evicted, so other live segments of this face (such as ones
+    // kept in a SegCache) are unaffected. What callers must not do is hold
+    // a GlyphFace or GlyphBox pointer from this face across the making of
+    // a new segment on it, or make one while another thread uses the face.
+    face->glyphs().trim();
     freeSlot(newSlot());
     m_bufSize = log_binary(numchars)+1;
 }
@@ -65,11 +177,11 @@ Segment::Segment(unsigned int numchars, const Face* face, uint32 script, int tex
 Segment::~Segment()
 {
     for (SlotRope::iterator i = m_slots.begin(); i != m_slots.end(); ++i)
-        free(*i);
+        block_free(*i);
     for (AttributeRope::iterator i = m_userAttrs.begin(); i != m_userAttrs.end(); ++i)
-        free(*i);
+        block_free(*i);
     for (JustifyRope::iterator i = m_justifies.begin(); i != m_justifies.end(); ++i)
-        free(*i);
+        block_free(*i);
     delete[] m_charinfo;
 }
 
@@ -174,13 +286,13 @@ Slot *Segment::newSlot()
 #if !defined GRAPHITE2_NTRACING
         if (m_face->logger()) ++numUser;
 #endif
-        Slot *newSlots = grzeroalloc<Slot>(m_bufSize);
+        Slot *newSlots = block_alloc<Slot>(m_bufSize);
         int attrSize = numUser + (hasCollisionInfo() ? ((sizeof(SlotCollision) + 1) / 2) : 0);
-        int16 *newAttrs = grzeroalloc<int16>(m_bufSize * attrSize);
+        int16 *newAttrs = block_alloc<int16>(m_bufSize * attrSize);
         if (!newSlots || !newAttrs)
         {
-            free(newSlots);
-            free(newAttrs);
+            block_free(newSlots);
+            block_free(newAttrs);
             return NULL;
         }
         for (size_t i = 0; i < m_bufSize; i++)
@@ -234,7 +346,7 @@ SlotJustify *Segment::newJustify()
     if (!m_freeJustifies)
     {
         const size_t justSize = SlotJustify::size_of(m_silf->numJustLevels());
-        byte *justs = grzeroalloc<byte>(justSize * m_bufSize);
+        byte *justs = block_alloc<byte>(justSize * m_bufSize);
         if (!justs) return NULL;
         for (int i = m_bufSize - 2; i >= 0; --i)
         {
@@ -6,8 +6,13 @@
 
 #include "js/UbiNodeCensus.h"
 
+#include "jsapi.h"
 #include "jscntxt.h"
 #include "jscompartment.h"
+#include "prmjtime.h"
+
+#include "vm/HelperThreads.h"
+
 #include "jsobjinlines.h"
 
 using namespace js;
@@ -37,6 +42,41 @@ Census::init() {
 
 /*** Count Types ***********************************************************************************/
 
+// Scale a count made from a sample up to an estimate for the whole heap.
+static size_t
+ScaleCount(size_t n, double factor)
+{
+    return size_t(double(n) * factor + 0.5);
+}
+
+// Merge the entries of |src| into |dest|, moving over the counts of keys
+// |dest| doesn't have yet. |src| is left with null counts for those.
+template<typename Table>
+static bool
+MergeCountTables(Table& dest, Table& src)
+{
+    for (typename Table::Range r = src.all(); !r.empty(); r.popFront()) {
+        typename Table::Entry& entry = r.front();
+        typename Table::AddPtr p = dest.lookupForAdd(entry.key());
+        if (!p) {
+            if (!dest.add(p, entry.key(), Move(entry.value())))
+                return false;
+            continue;
+        }
+        if (!p->value()->merge(*entry.value()))
+            return false;
+    }
+    return true;
+}
+
+template<typename Table>
+static void
+ScaleCountTable(Table& table, double factor)
+{
+    for (typename Table::Range r = table.all(); !r.empty(); r.popFront())
+        r.front().value()->scale(factor);
+}
+
 // The simplest type: just count everything.
 class SimpleCount : public CountType {
 
@@ -78,6 +118,9 @@ class SimpleCount : public CountType {
     CountBasePtr makeCount() override { return CountBasePtr(js_new<Count>(*this)); }
     void traceCount(CountBase& countBase, JSTracer* trc) override { }
     bool count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, const Node& node) override;
+    bool canCountOffThread() override { return true; }
+    bool merge(CountBase& countBase, CountBase& otherBase) override;
+    void scale(CountBase& countBase, double factor) override;
     bool report(JSContext* cx, CountBase& countBase, MutableHandleValue report) override;
 };
 
@@ -91,6 +134,24 @@ SimpleCount::count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, con
     return true;
 }
 
+bool
+SimpleCount::merge(CountBase& countBase, CountBase& otherBase)
+{
+    Count& count = static_cast<Count&>(countBase);
+    Count& other = static_cast<Count&>(otherBase);
+    count.total_ += other.total_;
+    count.totalBytes_ += other.totalBytes_;
+    return true;
+}
+
+void
+SimpleCount::scale(CountBase& countBase, double factor)
+{
+    Count& count = static_cast<Count&>(countBase);
+    count.total_ = ScaleCount(count.total_, factor);
+    count.totalBytes_ = ScaleCount(count.totalBytes_, factor);
+}
+
 bool
 SimpleCount::report(JSContext* cx, CountBase& countBase, MutableHandleValue report)
 {
@@ -173,6 +234,14 @@ class ByCoarseType : public CountType {
     CountBasePtr makeCount() override;
     void traceCount(CountBase& countBase, JSTracer* trc) override;
     bool count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, const Node& node) override;
+    bool canCountOffThread() override {
+        return objects->canCountOffThread() &&
+               scripts->canCountOffThread() &&
+               strings->canCountOffThread() &&
+               other->canCountOffThread();
+    }
+    bool merge(CountBase& countBase, CountBase& otherBase) override;
+    void scale(CountBase& countBase, double factor) override;
     bool report(JSContext* cx, CountBase& countBase, MutableHandleValue report) override;
 };
 
@@ -225,6 +294,30 @@ ByCoarseType::count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, co
     }
 }
 
+bool
+ByCoarseType::merge(CountBase& countBase, CountBase& otherBase)
+{
+    Count& count = static_cast<Count&>(countBase);
+    Count& other = static_cast<Count&>(otherBase);
+    count.total_ += other.total_;
+
+    return count.objects->merge(*other.objects) &&
+           count.scripts->merge(*other.scripts) &&
+           count.strings->merge(*other.strings) &&
+           count.other->merge(*other.other);
+}
+
+void
+ByCoarseType::scale(CountBase& countBase, double factor)
+{
+    Count& count = static_cast<Count&>(countBase);
+    count.total_ = ScaleCount(count.total_, factor);
+    count.objects->scale(factor);
+    count.scripts->scale(factor);
+    count.strings->scale(factor);
+    count.other->scale(factor);
+}
+
 bool
 ByCoarseType::report(JSContext* cx, CountBase& countBase, MutableHandleValue report)
 {
@@ -367,6 +460,11 @@ class ByObjectClass : public CountType {
     CountBasePtr makeCount() override;
     void traceCount(CountBase& countBase, JSTracer* trc) override;
     bool count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, const Node& node) override;
+    bool canCountOffThread() override {
+        return classesType->canCountOffThread() && otherType->canCountOffThread();
+    }
+    bool merge(CountBase& countBase, CountBase& otherBase) override;
+    void scale(CountBase& countBase, double factor) override;
     bool report(JSContext* cx, CountBase& countBase, MutableHandleValue report) override;
 };
 
@@ -412,6 +510,26 @@ ByObjectClass::count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, c
     return p->value()->count(mallocSizeOf, node);
 }
 
+bool
+ByObjectClass::merge(CountBase& countBase, CountBase& otherBase)
+{
+    Count& count = static_cast<Count&>(countBase);
+    Count& other = static_cast<Count&>(otherBase);
+    count.total_ += other.total_;
+
+    return MergeCountTables(count.table, other.table) &&
+           count.other->merge(*other.other);
+}
+
+void
+ByObjectClass::scale(CountBase& countBase, double factor)
+{
+    Count& count = static_cast<Count&>(countBase);
+    count.total_ = ScaleCount(count.total_, factor);
+    ScaleCountTable(count.table, factor);
+    count.other->scale(factor);
+}
+
 bool
 ByObjectClass::report(JSContext* cx, CountBase& countBase, MutableHandleValue report)
 {
@@ -464,6 +582,9 @@ class ByUbinodeType : public CountType {
     CountBasePtr makeCount() override;
     void traceCount(CountBase& countBase, JSTracer* trc) override;
     bool count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, const Node& node) override;
+    bool canCountOffThread() override { return entryType->canCountOffThread(); }
+    bool merge(CountBase& countBase, CountBase& otherBase) override;
+    void scale(CountBase& countBase, double factor) override;
     bool report(JSContext* cx, CountBase& countBase, MutableHandleValue report) override;
 };
 
@@ -502,6 +623,24 @@ ByUbinodeType::count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, c
     return p->value()->count(mallocSizeOf, node);
 }
 
+bool
+ByUbinodeType::merge(CountBase& countBase, CountBase& otherBase)
+{
+    Count& count = static_cast<Count&>(countBase);
+    Count& other = static_cast<Count&>(otherBase);
+    count.total_ += other.total_;
+
+    return MergeCountTables(count.table, other.table);
+}
+
+void
+ByUbinodeType::scale(CountBase& countBase, double factor)
+{
+    Count& count = static_cast<Count&>(countBase);
+    count.total_ = ScaleCount(count.total_, factor);
+    ScaleCountTable(count.table, factor);
+}
+
 bool
 ByUbinodeType::report(JSContext* cx, CountBase& countBase, MutableHandleValue report)
 {
@@ -607,6 +746,11 @@ class ByAllocationStack : public CountType {
     CountBasePtr makeCount() override;
     void traceCount(CountBase& countBase, JSTracer* trc) override;
     bool count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, const Node& node) override;
+    // Allocation stacks live in the compartment's object metadata table,
+    // which only the main thread may look things up in.
+    bool canCountOffThread() override { return false; }
+    bool merge(CountBase& countBase, CountBase& otherBase) override;
+    void scale(CountBase& countBase, double factor) override;
     bool report(JSContext* cx, CountBase& countBase, MutableHandleValue report) override;
 };
 
@@ -664,6 +808,28 @@ ByAllocationStack::count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeO
     return count.noStack->count(mallocSizeOf, node);
 }
 
+bool
+ByAllocationStack::merge(CountBase& countBase, CountBase& otherBase)
+{
+    // Merging looks entries up by key, so like counting it may only happen
+    // during the traversal; see the comments for Count::table.
+    Count& count = static_cast<Count&>(countBase);
+    Count& other = static_cast<Count&>(otherBase);
+    count.total_ += other.total_;
+
+    return MergeCountTables(count.table, other.table) &&
+           count.noStack->merge(*other.noStack);
+}
+
+void
+ByAllocationStack::scale(CountBase& countBase, double factor)
+{
+    Count& count = static_cast<Count&>(countBase);
+    count.total_ = ScaleCount(count.total_, factor);
+    ScaleCountTable(count.table, factor);
+    count.noStack->scale(factor);
+}
+
 bool
 ByAllocationStack::report(JSContext* cx, CountBase& countBase, MutableHandleValue report)
 {
@@ -764,6 +930,11 @@ class ByFilename : public CountType {
     CountBasePtr makeCount() override;
     void traceCount(CountBase& countBase, JSTracer* trc) override;
     bool count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, const Node& node) override;
+    // Filenames are reached through other cells (the script's source
+    // object), not the node's own, so keep them on the main thread.
+    bool canCountOffThread() override { return false; }
+    bool merge(CountBase& countBase, CountBase& otherBase) override;
+    void scale(CountBase& countBase, double factor) override;
     bool report(JSContext* cx, CountBase& countBase, MutableHandleValue report) override;
 };
 
@@ -813,6 +984,26 @@ ByFilename::count(CountBase& countBase, mozilla::MallocSizeOf mallocSizeOf, cons
     return p->value()->count(mallocSizeOf, node);
 }
 
+bool
+ByFilename::merge(CountBase& countBase, CountBase& otherBase)
+{
+    Count& count = static_cast<Count&>(countBase);
+    Count& other = static_cast<Count&>(otherBase);
+    count.total_ += other.total_;
+
+    return MergeCountTables(count.table, other.table) &&
+           count.noFilename->merge(*other.noFilename);
+}
+
+void
+ByFilename::scale(CountBase& countBase, double factor)
+{
+    Count& count = static_cast<Count&>(countBase);
+    count.total_ = ScaleCount(count.total_, factor);
+    ScaleCountTable(count.table, factor);
+    count.noFilename->scale(factor);
+}
+
 bool
 ByFilename::report(JSContext* cx, CountBase& countBase, MutableHandleValue report)
 {
@@ -836,6 +1027,144 @@ ByFilename::report(JSContext* cx, CountBase& countBase, MutableHandleValue repor
 
 /*** Census Handler *******************************************************************************/
 
+// Counts batches of nodes on a helper thread, into a count tree of its own
+// that CensusHandler::finish merges into the root count. Only count types
+// whose canCountOffThread() holds are used: those look at nothing but the
+// node's own cell, which nothing changes while the traversal runs, since no
+// GC can happen during it.
+class CensusCounter : public GCParallelTask
+{
+    mozilla::MallocSizeOf mallocSizeOf;
+
+    void run() override {
+        for (const Node& node : nodes) {
+            if (!count->count(mallocSizeOf, node)) {
+                ok = false;
+                return;
+            }
+        }
+    }
+
+  public:
+    CountBasePtr count;
+    js::Vector<Node, 0, SystemAllocPolicy> nodes;
+    bool ok;
+
+    CensusCounter(CountBasePtr& count, mozilla::MallocSizeOf mallocSizeOf)
+      : mallocSizeOf(mallocSizeOf),
+        count(Move(count)),
+        ok(true)
+    { }
+};
+
+// The number of nodes handed to a CensusCounter at a time.
+static const size_t CensusCountingBatch = 16 * 1024;
+
+CensusHandler::~CensusHandler()
+{
+    // Tasks must be joined before they are destroyed. Callers should have
+    // done this already with finish(), while the nodes were still alive.
+    for (auto& counter : counters)
+        counter->join();
+}
+
+bool
+CensusHandler::init(CountType& rootType)
+{
+    // ParseCensusOptions refuses threads for such breakdowns; if a caller
+    // set them up by hand, count on the main thread instead.
+    size_t threads = census.countingThreads;
+    if (!threads || !rootType.canCountOffThread())
+        return true;
+
+    if (!counters.reserve(threads) || !pending.reserve(CensusCountingBatch))
+        return false;
+
+    for (size_t i = 0; i < threads; i++) {
+        CountBasePtr count(rootType.makeCount());
+        if (!count)
+            return false;
+
+        UniquePtr<CensusCounter> counter(js_new<CensusCounter>(count, mallocSizeOf));
+        if (!counter || !counter->nodes.reserve(CensusCountingBatch))
+            return false;
+
+        counters.infallibleAppend(Move(counter));
+    }
+
+    return true;
+}
+
+bool
+CensusHandler::report(JSContext* cx, MutableHandleValue report)
+{
+    // Counts made on helper threads only reach the root count in finish(),
+    // and sampled counts are only scaled up there. Reporting without it
+    // would silently under-count.
+    MOZ_RELEASE_ASSERT(finished || (counters.empty() && census.sampling.isNothing()));
+    return rootCount->report(cx, report);
+}
+
+bool
+CensusHandler::count(const Node& node)
+{
+    if (census.sampling.isSome() && !census.sampling->trial())
+        return true;
+
+    if (counters.empty())
+        return rootCount->count(mallocSizeOf, node);
+
+    pending.infallibleAppend(node);
+    if (pending.length() < CensusCountingBatch)
+        return true;
+    return dispatchPending();
+}
+
+bool
+CensusHandler::dispatchPending()
+{
+    CensusCounter& counter = *counters[nextCounter];
+    nextCounter = (nextCounter + 1) % counters.length();
+
+    // Wait for the counter to finish its previous batch before handing it
+    // this one. Both vectors have room for a whole batch, so swapping them
+    // leaves |pending| ready for the next one.
+    counter.join();
+    if (!counter.ok)
+        return false;
+
+    counter.nodes.clear();
+    counter.nodes.swap(pending);
+    if (!counter.start())
+        counter.runFromMainThread(census.cx->runtime());
+
+    return true;
+}
+
+bool
+CensusHandler::finish()
+{
+    bool ok = true;
+    if (!counters.empty() && !pending.empty())
+        ok = dispatchPending();
+
+    for (auto& counter : counters) {
+        counter->join();
+        ok = ok && counter->ok;
+    }
+
+    for (size_t i = 0; ok && i < counters.length(); i++)
+        ok = rootCount->merge(*counters[i]->count);
+    counters.clear();
+    pending.clear();
+
+    if (ok && census.sampling.isSome())
+        rootCount->scale(1.0 / census.sampling->probability());
+
+    finished = true;
+    return ok;
+}
+
 bool
 CensusHandler::operator() (BreadthFirst<CensusHandler>& traversal,
                            Node origin, const Edge& edge,
@@ -856,11 +1185,11 @@ CensusHandler::operator() (BreadthFirst<CensusHandler>& traversal,
     Zone* zone = referent.zone();
 
     if (census.targetZones.count() == 0 || census.targetZones.has(zone))
-        return rootCount->count(mallocSizeOf, referent);
+        return count(referent);
 
     if (zone == census.atomsZone) {
         traversal.abandonReferent();
-        return rootCount->count(mallocSizeOf, referent);
+        return count(referent);
     }
 
     traversal.abandonReferent();
@@ -1050,6 +1379,53 @@ GetDefaultBreakdown()
                                              other));
 }
 
+// Parse the census options other than the breakdown:
+//
+// - samplingProbability: count each node with this probability, in (0, 1],
+//   and scale the counts up to estimate the whole heap. Defaults to 1.
+//
+// - threads: the number of helper threads to count nodes on while the main
+//   thread traverses the heap, capped at the number there are. Defaults to
+//   0, counting on the main thread.
+static bool
+ParseCensusCountingOptions(JSContext* cx, Census& census, HandleObject options)
+{
+    RootedValue probabilityValue(cx), threadsValue(cx);
+    if (!JS_GetProperty(cx, options, "samplingProbability", &probabilityValue) ||
+        !JS_GetProperty(cx, options, "threads", &threadsValue))
+    {
+        return false;
+    }
+
+    if (!probabilityValue.isUndefined()) {
+        double probability;
+        if (!ToNumber(cx, probabilityValue, &probability))
+            return false;
+        if (!(probability > 0 && probability <= 1)) {
+            JS_ReportError(cx, "census samplingProbability must be greater than 0 and at most 1");
+            return false;
+        }
+        if (probability < 1) {
+            uint64_t seed = uint64_t(PRMJ_Now());
+            census.sampling.emplace(probability, seed | 1, seed ^ 0x9e3779b97f4a7c15);
+        }
+    }
+
+    if (!threadsValue.isUndefined()) {
+        double threads;
+        if (!ToNumber(cx, threadsValue, &threads))
+            return false;
+        if (!(threads >= 0) || threads != floor(threads)) {
+            JS_ReportError(cx, "census threads must be a non-negative integer");
+            return false;
+        }
+        double helperThreads = double(HelperThreadState().threadCount);
+        census.countingThreads = size_t(mozilla::Min(threads, helperThreads));
+    }
+
+    return true;
+}
+
 bool
 ParseCensusOptions(JSContext* cx, Census& census, HandleObject options, CountTypePtr& outResult)
 {
@@ -1060,7 +1436,19 @@ ParseCensusOptions(JSContext* cx, Census& census, HandleObject options, CountTyp
     outResult = breakdown.isUndefined()
         ? GetDefaultBreakdown()
         : ParseBreakdown(cx, breakdown);
-    return !!outResult;
+    if (!outResult)
+        return false;
+
+    if (options && !ParseCensusCountingOptions(cx, census, options))
+        return false;
+
+    if (census.countingThreads && !outResult->canCountOffThread()) {
+        JS_ReportError(cx, "census threads can't be used with allocationStack or filename "
+                           "breakdowns");
+        return false;
+    }
+
+    return true;
 }
 
 } // namespace ubi
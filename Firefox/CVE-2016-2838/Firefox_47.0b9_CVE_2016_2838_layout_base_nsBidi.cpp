@@ -7,9 +7,21 @@
 #include "nsBidi.h"
 #include "nsUnicodeProperties.h"
 #include "nsCRTGlue.h"
+#include "mozilla/SSE.h"
 
 using namespace mozilla::unicode;
 
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+namespace mozilla {
+namespace SSE2 {
+
+const char16_t* FindPossiblyRTL(const char16_t* aStart,
+                                const char16_t* aEnd);
+
+} // namespace SSE2
+} // namespace mozilla
+#endif
+
 // These are #defined in <sys/regset.h> under Solaris 10 x86
 #undef CS
 #undef ES
@@ -247,6 +259,79 @@ void nsBidi::Free()
   mIsolatesMemory = nullptr;
 }
 
+/* LTR-only paragraphs ------------------------------------------------------ */
+
+/*
+ * Whether aChar may have a directional type that makes an LTR paragraph
+ * mixed: the Hebrew, Arabic and other RTL blocks, RLM, the explicit
+ * embedding, override and isolate codes, and surrogates, which may encode
+ * any of these. Everything else is L, a number type other than AN, a
+ * neutral, NSM or BN. The ranges are also in nsBidiSSE2.cpp.
+ */
+static inline bool
+IsPossiblyRTL(char16_t aChar)
+{
+  return (aChar >= 0x0590 && aChar <= 0x08FF) ||
+         aChar == 0x200F ||
+         (aChar >= 0x202A && aChar <= 0x202E) ||
+         (aChar >= 0x2066 && aChar <= 0x2069) ||
+         (aChar >= 0xD800 && aChar <= 0xDFFF) ||
+         (aChar >= 0xFB1D && aChar <= 0xFEFF);
+}
+
+static bool
+HasPossiblyRTLChars(const char16_t *aText, int32_t aLength)
+{
+  const char16_t *p = aText, *end = aText + aLength;
+#ifdef MOZILLA_MAY_SUPPORT_SSE2
+  if (mozilla::supports_sse2()) {
+    p = mozilla::SSE2::FindPossiblyRTL(p, end);
+  }
+#endif
+  for (; p < end; ++p) {
+    if (IsPossiblyRTL(*p)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * A cut-down GetDirProps() for paragraphs that HasPossiblyRTLChars() clears:
+ * there are no surrogate pairs or isolates to look after, and L is the only
+ * strong type, so the paragraph level is known once the flags are. Returns
+ * false, leaving *aParaLevel and *aFlags alone, if the paragraph level is
+ * odd; such a paragraph may still be mixed and needs the full algorithm.
+ */
+static bool
+GetLTRDirProps(const char16_t *aText, int32_t aLength, DirProp *aDirProps,
+               nsBidiLevel *aParaLevel, Flags *aFlags)
+{
+  nsBidiLevel paraLevel = *aParaLevel;
+  bool isDefaultLevel = IS_DEFAULT_LEVEL(paraLevel);
+  if ((!isDefaultLevel && (paraLevel & 1)) ||
+      HasPossiblyRTLChars(aText, aLength)) {
+    return false;
+  }
+
+  Flags flags = 0;
+  for (int32_t i = 0; i < aLength; ++i) {
+    flags |= DIRPROP_FLAG(aDirProps[i] = GetBidiCat((uint32_t)aText[i]));
+  }
+
+  /* (P2)..(P3): the first strong character, if any, is an L */
+  if (isDefaultLevel) {
+    paraLevel = (flags & DIRPROP_FLAG(L)) ? 0 : paraLevel & 1;
+    if (paraLevel & 1) {
+      return false;
+    }
+  }
+
+  *aParaLevel = paraLevel;
+  *aFlags = flags | DIRPROP_FLAG_LR(paraLevel);
+  return true;
+}
+
 /* SetPara ------------------------------------------------------------ */
 
 nsresult nsBidi::SetPara(const char16_t *aText, int32_t aLength,
@@ -296,10 +381,17 @@ nsresult nsBidi::SetPara(const char16_t *aText, int32_t aLength,
    * Get the directional properties,
    * the flags bit-set, and
    * determine the partagraph level if necessary.
+   * Most paragraphs have no RTL characters at all; those skip the
+   * isolate bookkeeping here and the (Xn) rules below.
    */
+  bool ltrOnly;
   if(GETDIRPROPSMEMORY(aLength)) {
     mDirProps=mDirPropsMemory;
-    GetDirProps(aText);
+    ltrOnly = GetLTRDirProps(aText, aLength, mDirPropsMemory,
+                             &mParaLevel, &mFlags);
+    if (!ltrOnly) {
+      GetDirProps(aText);
+    }
   } else {
     return NS_ERROR_OUT_OF_MEMORY;
   }
@@ -307,7 +399,12 @@ nsresult nsBidi::SetPara(const char16_t *aText, int32_t aLength,
   /* determine explicit levels according to the (Xn) rules */
   if(GETLEVELSMEMORY(aLength)) {
     mLevels=mLevelsMemory;
-    ResolveExplicitLevels(&direction, aText);
+    if (ltrOnly) {
+      mIsolateCount = 0;
+      direction = NSBIDI_LTR;
+    } else {
+      ResolveExplicitLevels(&direction, aText);
+    }
   } else {
     return NS_ERROR_OUT_OF_MEMORY;
   }
@@ -0,0 +1,52 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// SSE2 pre-scan used by nsBidi::SetPara to find paragraphs that cannot be
+// anything but left-to-right. The ranges must match IsPossiblyRTL() in
+// nsBidi.cpp, which finishes the last few characters of the text.
+
+#include "nscore.h"
+#include "mozilla/MathAlgorithms.h"
+
+#include <emmintrin.h>
+
+namespace mozilla {
+namespace SSE2 {
+
+// Lanes of aChars in [aFirst, aLast]: aChars - aFirst wraps around below
+// aFirst, so it is at most aLast - aFirst exactly for the lanes in range.
+static inline __m128i
+InRange(__m128i aChars, char16_t aFirst, char16_t aLast)
+{
+  __m128i offset = _mm_sub_epi16(aChars, _mm_set1_epi16(aFirst));
+  __m128i over = _mm_subs_epu16(offset, _mm_set1_epi16(aLast - aFirst));
+  return _mm_cmpeq_epi16(over, _mm_setzero_si128());
+}
+
+// Returns the first character in [aStart, aEnd) that IsPossiblyRTL() would
+// accept, or the start of the last, shorter than eight characters, stretch
+// of the range.
+const char16_t*
+FindPossiblyRTL(const char16_t* aStart, const char16_t* aEnd)
+{
+  while (aEnd - aStart >= 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aStart));
+    __m128i hit = _mm_or_si128(InRange(v, 0x0590, 0x08FF),
+                               InRange(v, 0x200F, 0x200F));
+    hit = _mm_or_si128(hit, InRange(v, 0x202A, 0x202E));
+    hit = _mm_or_si128(hit, InRange(v, 0x2066, 0x2069));
+    hit = _mm_or_si128(hit, InRange(v, 0xD800, 0xDFFF));
+    hit = _mm_or_si128(hit, InRange(v, 0xFB1D, 0xFEFF));
+    uint32_t mask = _mm_movemask_epi8(hit);
+    if (mask) {
+      return aStart + CountTrailingZeroes32(mask) / 2;
+    }
+    aStart += 8;
+  }
+  return aStart;
+}
+
+} // namespace SSE2
+} // namespace mozilla
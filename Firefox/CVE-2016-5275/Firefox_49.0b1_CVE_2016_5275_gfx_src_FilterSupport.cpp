@@ -8,14 +8,23 @@
 #include "mozilla/gfx/2D.h"
 #include "mozilla/gfx/Filters.h"
 #include "mozilla/gfx/Logging.h"
+#include "mozilla/Monitor.h"
 #include "mozilla/PodOperations.h"
+#include "mozilla/Services.h"
+#include "mozilla/StaticPtr.h"
 
 #include "gfxContext.h"
 #include "gfxPattern.h"
 #include "gfxPlatform.h"
 #include "gfx2DGlue.h"
 
+#include "nsIObserver.h"
+#include "nsIObserverService.h"
+#include "nsIThreadPool.h"
 #include "nsMargin.h"
+#include "nsThreadUtils.h"
+#include "nsXPCOMCIDInternal.h"
+#include "prsystem.h"
 
 // c = n / 255
 // c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f
@@ -1331,6 +1340,303 @@ FilterNodeGraphFromDescription(DrawTarget* aDT,
   return primitiveFilters.LastElement()->ForColorModel(ColorModel::PremulSRGB());
 }
 
+// Tiled rendering
+//
+// Software filter graphs are evaluated on a single thread by the DrawTarget
+// that owns them. For large results we instead split the render rect into
+// tiles, build an independent filter graph per tile on its own DrawTarget and
+// evaluate the tiles on a thread pool. The tiles are then stitched into the
+// destination on the calling thread. Only the SourceSurfaces are shared
+// between workers; they are read-only and their reference counts are atomic.
+
+static const int32_t kFilterTileSize = 256;
+static const int32_t kMinFilterTilesForThreading = 4;
+
+// Each tile filters its own copy of the source pixels it needs, so the
+// margin around a tile is work that every neighbouring tile repeats. With a
+// margin of one tile on each side a tile already reads nine tiles' worth of
+// source; past that the repeated work eats the gain from the extra threads,
+// and such filters (large blurs, or tile primitives, which need the whole
+// plane) are rendered in one piece.
+static const int32_t kMaxFilterTileMargin = kFilterTileSize;
+
+// The pool that renders filter tiles. It is made on first use and lives
+// until xpcom-shutdown, so a draw never pays for starting threads and never
+// has to shut a pool down: nsIThreadPool::Shutdown spins the event loop,
+// which must not happen in the middle of a paint. Tiling is only done on
+// the main thread, which is also where the pool is shut down, so a draw
+// that is waiting for its tiles can never see the pool go away.
+class FilterTilePool final : public nsIObserver
+{
+public:
+  NS_DECL_THREADSAFE_ISUPPORTS
+  NS_DECL_NSIOBSERVER
+
+  static nsIThreadPool* Get();
+
+private:
+  ~FilterTilePool() {}
+
+  static StaticRefPtr<nsIThreadPool> sPool;
+  static bool sInitialized;
+};
+
+NS_IMPL_ISUPPORTS(FilterTilePool, nsIObserver)
+
+StaticRefPtr<nsIThreadPool> FilterTilePool::sPool;
+bool FilterTilePool::sInitialized = false;
+
+/* static */ nsIThreadPool*
+FilterTilePool::Get()
+{
+  MOZ_ASSERT(NS_IsMainThread());
+  if (sInitialized) {
+    return sPool;
+  }
+  sInitialized = true;
+
+  nsCOMPtr<nsIObserverService> obsSvc = services::GetObserverService();
+  if (!obsSvc) {
+    return nullptr;
+  }
+  nsCOMPtr<nsIThreadPool> pool = do_CreateInstance(NS_THREADPOOL_CONTRACTID);
+  if (!pool) {
+    return nullptr;
+  }
+  RefPtr<FilterTilePool> observer = new FilterTilePool();
+  if (NS_FAILED(obsSvc->AddObserver(observer, NS_XPCOM_SHUTDOWN_OBSERVER_ID,
+                                    false))) {
+    return nullptr;
+  }
+  uint32_t threads = std::max(PR_GetNumberOfProcessors(), 1);
+  pool->SetThreadLimit(threads);
+  pool->SetIdleThreadLimit(threads);
+  pool->SetName(NS_LITERAL_CSTRING("FilterTiles"));
+  sPool = pool;
+  return sPool;
+}
+
+NS_IMETHODIMP
+FilterTilePool::Observe(nsISupports* aSubject, const char* aTopic,
+                        const char16_t* aData)
+{
+  MOZ_ASSERT(!strcmp(aTopic, NS_XPCOM_SHUTDOWN_OBSERVER_ID));
+
+  nsCOMPtr<nsIObserverService> obsSvc = services::GetObserverService();
+  if (obsSvc) {
+    obsSvc->RemoveObserver(this, NS_XPCOM_SHUTDOWN_OBSERVER_ID);
+  }
+
+  nsCOMPtr<nsIThreadPool> pool = sPool.get();
+  sPool = nullptr;
+  if (pool) {
+    pool->Shutdown();
+  }
+  return NS_OK;
+}
+
+struct FilterTile
+{
+  IntRect mRect;
+  RefPtr<DrawTarget> mTarget;
+  nsTArray<RefPtr<SourceSurface>> mAdditionalImages;
+};
+
+static bool
+IsSoftwareFilterBackend(BackendType aBackend)
+{
+  return aBackend == BackendType::CAIRO || aBackend == BackendType::SKIA;
+}
+
+// Returns a read-only surface that is safe to read from several threads.
+static already_AddRefed<SourceSurface>
+ThreadSafeSurface(SourceSurface* aSurface)
+{
+  if (!aSurface) {
+    return nullptr;
+  }
+  RefPtr<SourceSurface> data = aSurface->GetDataSurface();
+  return data.forget();
+}
+
+// A tile is worth rendering on its own if the source pixels the filter
+// actually needs for it, as worked out from the primitives, lie within
+// kMaxFilterTileMargin of the tile.
+static bool
+TileHasBoundedSourceNeeds(const FilterDescription& aFilter,
+                          const IntRect& aTileRect)
+{
+  nsIntRegion sourceGraphicNeeded;
+  nsIntRegion fillPaintNeeded;
+  nsIntRegion strokePaintNeeded;
+  FilterSupport::ComputeSourceNeededRegions(aFilter, nsIntRegion(aTileRect),
+                                            sourceGraphicNeeded,
+                                            fillPaintNeeded,
+                                            strokePaintNeeded);
+  const IntRect limit = aTileRect.Inflated(kMaxFilterTileMargin);
+  return limit.Contains(sourceGraphicNeeded.GetBounds()) &&
+         limit.Contains(fillPaintNeeded.GetBounds()) &&
+         limit.Contains(strokePaintNeeded.GetBounds());
+}
+
+// Builds a filter graph on the tile's own DrawTarget and renders the tile's
+// part of the result into it.
+static void
+RenderFilterTile(FilterTile& aTile,
+                 const FilterDescription& aFilter,
+                 SourceSurface* aSourceGraphic,
+                 const IntRect& aSourceGraphicRect,
+                 SourceSurface* aFillPaint,
+                 const IntRect& aFillPaintRect,
+                 SourceSurface* aStrokePaint,
+                 const IntRect& aStrokePaintRect)
+{
+  RefPtr<FilterNode> resultFilter =
+    FilterNodeGraphFromDescription(aTile.mTarget, aFilter, Rect(aTile.mRect),
+                                   aSourceGraphic, aSourceGraphicRect,
+                                   aFillPaint, aFillPaintRect,
+                                   aStrokePaint, aStrokePaintRect,
+                                   aTile.mAdditionalImages);
+  if (!resultFilter) {
+    return;
+  }
+  aTile.mTarget->DrawFilter(resultFilter, Rect(aTile.mRect), Point(0, 0),
+                            DrawOptions(1.0f, CompositionOp::OP_SOURCE));
+  aTile.mTarget->Flush();
+}
+
+static bool
+RenderFilterDescriptionTiled(DrawTarget* aDT,
+                             const FilterDescription& aFilter,
+                             const Rect& aRenderRect,
+                             SourceSurface* aSourceGraphic,
+                             const IntRect& aSourceGraphicRect,
+                             SourceSurface* aFillPaint,
+                             const IntRect& aFillPaintRect,
+                             SourceSurface* aStrokePaint,
+                             const IntRect& aStrokePaintRect,
+                             nsTArray<RefPtr<SourceSurface>>& aAdditionalImages,
+                             const Point& aDestPoint,
+                             const DrawOptions& aOptions)
+{
+  BackendType backend = aDT->GetBackendType();
+  if (!IsSoftwareFilterBackend(backend) || aFilter.mPrimitives.IsEmpty() ||
+      !NS_IsMainThread()) {
+    return false;
+  }
+
+  // Drawing the tiles one by one is only equivalent to a single draw for an
+  // operator that leaves pixels outside each tile alone.
+  if (aOptions.mCompositionOp != CompositionOp::OP_OVER) {
+    return false;
+  }
+
+  // Tiles are stitched with point sampling, so both the render rect and the
+  // destination must be pixel aligned.
+  IntRect renderRect;
+  if (!aDT->GetTransform().IsIntegerTranslation() ||
+      !aRenderRect.ToIntRect(&renderRect) ||
+      aDestPoint.x != floor(aDestPoint.x) ||
+      aDestPoint.y != floor(aDestPoint.y)) {
+    return false;
+  }
+
+  int32_t columns = (renderRect.width + kFilterTileSize - 1) / kFilterTileSize;
+  int32_t rows = (renderRect.height + kFilterTileSize - 1) / kFilterTileSize;
+  if (columns * rows < kMinFilterTilesForThreading) {
+    return false;
+  }
+
+  nsTArray<FilterTile> tiles;
+  tiles.SetCapacity(columns * rows);
+  for (int32_t y = renderRect.y; y < renderRect.YMost(); y += kFilterTileSize) {
+    for (int32_t x = renderRect.x; x < renderRect.XMost(); x += kFilterTileSize) {
+      IntRect tileRect(x, y, kFilterTileSize, kFilterTileSize);
+      tileRect = tileRect.Intersect(renderRect);
+      if (!TileHasBoundedSourceNeeds(aFilter, tileRect)) {
+        return false;
+      }
+      FilterTile* tile = tiles.AppendElement();
+      tile->mRect = tileRect;
+      tile->mTarget = Factory::CreateDrawTarget(backend, tileRect.Size(),
+                                                SurfaceFormat::B8G8R8A8);
+      if (!tile->mTarget) {
+        return false;
+      }
+      tile->mAdditionalImages.SetCapacity(aAdditionalImages.Length());
+      for (size_t i = 0; i < aAdditionalImages.Length(); i++) {
+        tile->mAdditionalImages.AppendElement(
+          ThreadSafeSurface(aAdditionalImages[i]));
+      }
+    }
+  }
+
+  nsCOMPtr<nsIThreadPool> pool = FilterTilePool::Get();
+  if (!pool) {
+    return false;
+  }
+
+  RefPtr<SourceSurface> sourceGraphic = ThreadSafeSurface(aSourceGraphic);
+  RefPtr<SourceSurface> fillPaint = ThreadSafeSurface(aFillPaint);
+  RefPtr<SourceSurface> strokePaint = ThreadSafeSurface(aStrokePaint);
+
+  Monitor monitor("FilterTiles");
+  size_t remaining = tiles.Length();
+  size_t dispatched = 0;
+
+  for (size_t i = 0; i < tiles.Length(); i++) {
+    FilterTile* tile = &tiles[i];
+    nsCOMPtr<nsIRunnable> task = NS_NewRunnableFunction([&, tile] () {
+      RenderFilterTile(*tile, aFilter,
+                       sourceGraphic, aSourceGraphicRect,
+                       fillPaint, aFillPaintRect,
+                       strokePaint, aStrokePaintRect);
+
+      MonitorAutoLock lock(monitor);
+      if (--remaining == 0) {
+        lock.Notify();
+      }
+    });
+    if (NS_FAILED(pool->Dispatch(task, NS_DISPATCH_NORMAL))) {
+      break;
+    }
+    dispatched++;
+  }
+
+  {
+    // Tiles that could not be dispatched are rendered on this thread below.
+    // This only blocks; no events run here while the workers finish.
+    MonitorAutoLock lock(monitor);
+    remaining -= tiles.Length() - dispatched;
+    while (remaining) {
+      lock.Wait();
+    }
+  }
+
+  for (size_t i = dispatched; i < tiles.Length(); i++) {
+    RenderFilterTile(tiles[i], aFilter,
+                     sourceGraphic, aSourceGraphicRect,
+                     fillPaint, aFillPaintRect,
+                     strokePaint, aStrokePaintRect);
+  }
+
+  for (size_t i = 0; i < tiles.Length(); i++) {
+    FilterTile& tile = tiles[i];
+    RefPtr<SourceSurface> snapshot = tile.mTarget->Snapshot();
+    if (!snapshot) {
+      gfxWarning() << "Filter tile snapshot failed.";
+      continue;
+    }
+    Point offset = aDestPoint + Point(tile.mRect.TopLeft() - renderRect.TopLeft());
+    aDT->DrawSurface(snapshot,
+                     Rect(offset, Size(tile.mRect.Size())),
+                     Rect(Point(0, 0), Size(tile.mRect.Size())),
+                     DrawSurfaceOptions(Filter::POINT),
+                     aOptions);
+  }
+  return true;
+}
+
 // FilterSupport
 
 void
@@ -1347,6 +1653,14 @@ FilterSupport::RenderFilterDescription(DrawTarget* aDT,
                                        const Point& aDestPoint,
                                        const DrawOptions& aOptions)
 {
+  if (RenderFilterDescriptionTiled(aDT, aFilter, aRenderRect,
+                                   aSourceGraphic, aSourceGraphicRect,
+                                   aFillPaint, aFillPaintRect,
+                                   aStrokePaint, aStrokePaintRect,
+                                   aAdditionalImages, aDestPoint, aOptions)) {
+    return;
+  }
+
   RefPtr<FilterNode> resultFilter =
     FilterNodeGraphFromDescription(aDT, aFilter, aRenderRect,
                                    aSourceGraphic, aSourceGraphicRect, aFillPaint, aFillPaintRect,